@@ -0,0 +1,42 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Small helpers shared by the host tools.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "common.h"
+
+const t_flash_chip *parse_chip(const char *arg) {
+  for (unsigned i = 0; i < chipdb_count; i++)
+    if (!strcasecmp(chipdb[i].name, arg))
+      return &chipdb[i];
+
+  char *end;
+  unsigned long id = strtoul(arg, &end, 16);
+  if (*arg && !*end)
+    return chipdb_lookup(id);
+  return NULL;
+}
+
+uint8_t *load_file(const char *path, unsigned *size) {
+  FILE *fd = fopen(path, "rb");
+  if (!fd)
+    return NULL;
+
+  fseek(fd, 0, SEEK_END);
+  long fsize = ftell(fd);
+  fseek(fd, 0, SEEK_SET);
+
+  uint8_t *ret = (uint8_t*)malloc(fsize ? fsize : 1);
+  if (fread(ret, 1, fsize, fd) != (size_t)fsize) {
+    free(ret);
+    ret = NULL;
+  }
+  fclose(fd);
+
+  if (ret && size)
+    *size = fsize;
+  return ret;
+}
@@ -0,0 +1,17 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Small helpers shared by the host tools.
+
+#ifndef _HOST_COMMON_H_
+#define _HOST_COMMON_H_
+
+#include <stdint.h>
+
+#include "chipdb.h"
+
+// Finds a chip by name or by its hex ID (as reported by flash_ident).
+const t_flash_chip *parse_chip(const char *arg);
+// Loads a whole file into a malloc'ed buffer, returns NULL on error.
+uint8_t *load_file(const char *path, unsigned *size);
+
+#endif
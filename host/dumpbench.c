@@ -0,0 +1,142 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Dump consistency harness.
+//
+// Dumps the flash of a simulated cart with bus faults (usually flaky=PPM,
+// bit flips on bulk reads) through the simulated SD card, with the dual read
+// checks enabled, and compares every dump with the cart contents. Running it
+// with several seeds gives the success rate of the dual read and the cost of
+// the blocks it reads again.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "dump.h"
+#include "flash.h"
+#include "flashsim.h"
+#include "storagesim.h"
+
+#define DUMP_NAME   "dumpbench.bin"
+
+static void usage() {
+  fprintf(stderr, "Usage: dumpbench [options]\n");
+  fprintf(stderr, "  -c chip     Simulated chip (name or hex ID), defaults to %s\n", chipdb[0].name);
+  fprintf(stderr, "  -i file     Flash contents (random data by default)\n");
+  fprintf(stderr, "  -F faults   Fault spec, eg. seed=N,flaky=PPM\n");
+  fprintf(stderr, "  -n runs     Number of runs (seed is incremented every run)\n");
+  fprintf(stderr, "  -s          Single read (no dual read checks)\n");
+  fprintf(stderr, "  -q          Only print the summary\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const t_flash_chip *chip = &chipdb[0];
+  const char *imgfn = NULL;
+  t_simfaults faults = {0};
+  unsigned runs = 1;
+  bool quiet = false;
+  dump_dual_read = true;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:i:F:n:sq")) != -1) {
+    switch (opt) {
+    case 'c':
+      if (!(chip = parse_chip(optarg))) {
+        fprintf(stderr, "Unknown chip %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'i': imgfn = optarg; break;
+    case 'F':
+      if (!flashsim_parse_faults(optarg, &faults)) {
+        fprintf(stderr, "Invalid fault spec %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'n': runs = atoi(optarg); break;
+    case 's': dump_dual_read = false; break;
+    case 'q': quiet = true; break;
+    default:  usage();
+    };
+  }
+  if (!runs)
+    usage();
+
+  unsigned imgsize = FLASH_FW_SIZE;
+  uint8_t *img;
+  if (imgfn) {
+    if (!(img = load_file(imgfn, &imgsize)) || imgsize > FLASH_FW_SIZE) {
+      fprintf(stderr, "Could not load %s (or bigger than %d bytes)\n", imgfn, FLASH_FW_SIZE);
+      return 1;
+    }
+  } else {
+    img = (uint8_t*)malloc(imgsize);
+    srand(faults.seed);
+    for (unsigned i = 0; i < imgsize; i++)
+      img[i] = rand();
+  }
+
+  // The dumps go to a scratch directory, as the simulated card root.
+  t_storagecfg scfg = storagesim_defaults;
+  char dumpfn[sizeof(scfg.root) + 32];
+  strcpy(scfg.root, "/tmp/dumpbench.XXXXXX");
+  if (!mkdtemp(scfg.root)) {
+    fprintf(stderr, "Could not create a temporary directory\n");
+    return 1;
+  }
+  storagesim_config(&scfg);
+  snprintf(dumpfn, sizeof(dumpfn), "%s/%s", scfg.root, DUMP_NAME);
+
+  unsigned passed = 0, undetected = 0;
+  double total_ms = 0, worst_ms = 0;
+  uint64_t total_flips = 0, total_rereads = 0;
+
+  for (unsigned r = 0; r < runs; r++) {
+    t_simfaults rf = faults;
+    rf.seed = faults.seed + r;
+
+    t_flashsim *sim = flashsim_create(chip);
+    flashsim_select(sim);
+    flashsim_load(sim, img, imgsize);
+    flashsim_set_faults(sim, &rf);
+    storagesim_reset_stats();
+    cart_detect(NULL);
+
+    bool dump_ok = flash_dump("fat:/" DUMP_NAME);
+    unsigned dsize = 0;
+    uint8_t *dump = load_file(dumpfn, &dsize);
+    bool match = dump && dsize >= imgsize && !memcmp(dump, img, imgsize);
+    free(dump);
+    unlink(dumpfn);
+
+    // Wrong dumps that report success (errors the checks missed) are the
+    // worst outcome, they are counted apart.
+    bool ok = dump_ok && match;
+    double run_ms = sim->now_ns / 1e6;
+    if (!quiet)
+      printf("seed %-6u dump %-6s data %-8s %9.1f ms  (%llu bit flips, %lu blocks read again)\n",
+             rf.seed, dump_ok ? "ok" : "FAIL", !dump_ok ? "-" : match ? "ok" : "mismatch", run_ms,
+             (unsigned long long)sim->stats.bit_flips, (unsigned long)dump_rereads);
+
+    passed += ok;
+    undetected += dump_ok && !match;
+    total_ms += run_ms;
+    worst_ms = run_ms > worst_ms ? run_ms : worst_ms;
+    total_flips += sim->stats.bit_flips;
+    total_rereads += dump_rereads;
+    flashsim_destroy(sim);
+  }
+  rmdir(scfg.root);
+
+  printf("%s: %u/%u dumps passed (%u corrupted undetected), mean %.1f ms, worst %.1f ms, "
+         "%llu bit flips injected, %llu blocks read again\n",
+         chip->name, passed, runs, undetected, total_ms / runs, worst_ms,
+         (unsigned long long)total_flips, (unsigned long long)total_rereads);
+
+  free(img);
+  return passed == runs ? 0 : 2;
+}
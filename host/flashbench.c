@@ -0,0 +1,124 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Flash benchmark harness.
+//
+// Runs the NDS flashing sequence (identify, erase, erase check, write and
+// validate) against the simulator, optionally with fault injection, and
+// reports the outcome and the modeled time of every step. Running it with
+// several seeds gives the success rate and time cost of the retry/timeout
+// policy for a given set of faults.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "flash.h"
+#include "flashsim.h"
+
+static void usage() {
+  fprintf(stderr, "Usage: flashbench [options]\n");
+  fprintf(stderr, "  -c chip     Simulated chip (name or hex ID), defaults to %s\n", chipdb[0].name);
+  fprintf(stderr, "  -i file     Firmware image to flash (random data by default)\n");
+  fprintf(stderr, "  -F faults   Fault spec: seed=N,stuck=N,slow=A[-B]:F,progfail=PPM,\n");
+  fprintf(stderr, "              erasefail=PPM,toggle=PPM,latency=fixed|uniform|exp[:PCT]\n");
+  fprintf(stderr, "  -n runs     Number of runs (seed is incremented every run)\n");
+  fprintf(stderr, "  -r retries  Program retries per word (default %u)\n", flash_write_retries);
+  fprintf(stderr, "  -p polls    Status polls before a program times out (default %u)\n", flash_prog_polls);
+  fprintf(stderr, "  -q          Only print the summary\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const t_flash_chip *chip = &chipdb[0];
+  const char *imgfn = NULL;
+  t_simfaults faults = {0};
+  unsigned runs = 1;
+  bool quiet = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:i:F:n:r:p:q")) != -1) {
+    switch (opt) {
+    case 'c':
+      if (!(chip = parse_chip(optarg))) {
+        fprintf(stderr, "Unknown chip %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'i': imgfn = optarg; break;
+    case 'F':
+      if (!flashsim_parse_faults(optarg, &faults)) {
+        fprintf(stderr, "Invalid fault spec %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'n': runs = atoi(optarg); break;
+    case 'r': flash_write_retries = atoi(optarg); break;
+    case 'p': flash_prog_polls = atoi(optarg); break;
+    case 'q': quiet = true; break;
+    default:  usage();
+    };
+  }
+
+  unsigned imgsize = FLASH_FW_SIZE;
+  uint8_t *img;
+  if (imgfn) {
+    if (!(img = load_file(imgfn, &imgsize)) || imgsize > FLASH_FW_SIZE) {
+      fprintf(stderr, "Could not load %s (or bigger than %d bytes)\n", imgfn, FLASH_FW_SIZE);
+      return 1;
+    }
+  } else {
+    img = (uint8_t*)malloc(imgsize);
+    srand(faults.seed);
+    for (unsigned i = 0; i < imgsize; i++)
+      img[i] = rand();
+  }
+
+  unsigned passed = 0;
+  double total_ms = 0, worst_ms = 0;
+  uint64_t total_failures = 0, total_glitches = 0;
+
+  for (unsigned r = 0; r < runs; r++) {
+    t_simfaults rf = faults;
+    rf.seed = faults.seed + r;
+
+    t_flashsim *sim = flashsim_create(chip);
+    flashsim_select(sim);
+    flashsim_set_faults(sim, &rf);
+
+    uint32_t id = flash_ident();
+    uint64_t t0 = sim->now_ns;
+    bool erase_ok = flash_erase();
+    uint64_t t1 = sim->now_ns;
+    bool check_ok = erase_ok && !flash_erase_check();
+    uint64_t t2 = sim->now_ns;
+    bool write_ok = check_ok && flash_write(img, imgsize);
+    uint64_t t3 = sim->now_ns;
+    bool valid_ok = write_ok && flash_validate(img, imgsize);
+    uint64_t t4 = sim->now_ns;
+
+    double run_ms = sim->now_ns / 1e6;
+    if (!quiet)
+      printf("seed %-6u id %08x  erase %-4s %9.1f ms  check %-4s %7.1f ms  write %-4s %9.1f ms  "
+             "validate %-4s %6.1f ms  total %9.1f ms  (%llu failures, %llu glitches)\n",
+             rf.seed, id, erase_ok ? "ok" : "FAIL", (t1 - t0) / 1e6, check_ok ? "ok" : "FAIL",
+             (t2 - t1) / 1e6, write_ok ? "ok" : "FAIL", (t3 - t2) / 1e6,
+             valid_ok ? "ok" : "FAIL", (t4 - t3) / 1e6, run_ms,
+             (unsigned long long)sim->stats.failures, (unsigned long long)sim->stats.toggle_glitches);
+
+    passed += valid_ok;
+    total_ms += run_ms;
+    worst_ms = run_ms > worst_ms ? run_ms : worst_ms;
+    total_failures += sim->stats.failures;
+    total_glitches += sim->stats.toggle_glitches;
+    flashsim_destroy(sim);
+  }
+
+  printf("%s: %u/%u runs passed, mean %.1f ms, worst %.1f ms, %llu injected failures, %llu toggle glitches\n",
+         chip->name, passed, runs, total_ms / runs, worst_ms,
+         (unsigned long long)total_failures, (unsigned long long)total_glitches);
+
+  free(img);
+  return passed == runs ? 0 : 2;
+}
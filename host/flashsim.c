@@ -0,0 +1,602 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SuperCard slot-2 simulator, see flashsim.h
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flashsim.h"
+#include "platform.h"
+#include "scsd.h"
+
+#define SDRAM_WORDS   (SLOT2_ROM_SIZE / 2)
+
+// Flash command states
+enum {
+  ST_READ, ST_UNLOCK1, ST_UNLOCK2, ST_AUTOSELECT, ST_PROGRAM,
+  ST_ERASE, ST_ERASE_UNLOCK1, ST_ERASE_UNLOCK2, ST_SECTOR_ERASE,
+  ST_BYPASS, ST_BYPASS_PROGRAM, ST_BYPASS_ERASE, ST_BYPASS_EXIT,
+  ST_WBUF_COUNT, ST_WBUF_DATA, ST_WBUF_CONFIRM,
+};
+
+enum { BUSY_NONE, BUSY_PROGRAM, BUSY_ERASE };
+
+// Sector erase commands are accepted for this long before the erase starts.
+#define SECTOR_ERASE_WINDOW_NS   50000
+
+// Each thread drives its own simulator instance.
+static __thread t_flashsim *cursim = NULL;
+
+// Inverse of the cart wiring (cart_wire_addr): maps the bus address to the
+// address the flash chip actually sees.
+static uint32_t bus_to_chip(const t_flashsim *sim, uint32_t b) {
+  if (sim->profile->wiring == CART_WIRING_STRAIGHT)
+    return b;
+  return (b & 0xFFFFFE02) |
+         ((b >> 7) & 1) << 0 |
+         ((b >> 6) & 1) << 2 |
+         ((b >> 5) & 1) << 3 |
+         ((b >> 0) & 1) << 4 |
+         ((b >> 2) & 1) << 5 |
+         ((b >> 8) & 1) << 6 |
+         ((b >> 4) & 1) << 7 |
+         ((b >> 3) & 1) << 8;
+}
+
+// Flash cell contents, with the stuck bits applied.
+static uint16_t cell_read(const t_flashsim *sim, uint32_t ca) {
+  uint16_t v = sim->flash[ca];
+  for (unsigned i = 0; i < sim->faults.stuck_count; i++)
+    if (sim->stuck[i].addr == ca)
+      v = (v & ~sim->stuck[i].mask) | sim->stuck[i].value;
+  return v;
+}
+
+t_flashsim *flashsim_create(const t_flash_chip *chip) {
+  t_flashsim *sim = (t_flashsim*)calloc(1, sizeof(t_flashsim));
+  sim->chip = chip;
+  sim->profile = &cart_profiles[0];
+  sim->flash = (uint16_t*)malloc(chip->size);
+  memset(sim->flash, 0xFF, chip->size);
+  sim->sdram = (uint16_t*)calloc(SDRAM_WORDS, sizeof(uint16_t));
+  sim->state = ST_READ;
+  sim->first_cycles = 10;
+  sim->seq_cycles = 6;
+  sim->rng = 1;
+  return sim;
+}
+
+void flashsim_destroy(t_flashsim *sim) {
+  if (cursim == sim)
+    cursim = NULL;
+  free(sim->flash);
+  free(sim->sdram);
+  free(sim);
+}
+
+void flashsim_select(t_flashsim *sim) {
+  cursim = sim;
+}
+
+t_flashsim *flashsim_current() {
+  return cursim;
+}
+
+void flashsim_advance(uint64_t ns) {
+  if (cursim)
+    cursim->now_ns += ns;
+}
+
+void flashsim_wait_vblank() {
+  // The tick counter wraps around, use the absolute position in the frame.
+  const uint64_t frame = PLATFORM_FRAME_LINES * PLATFORM_LINE_TICKS;
+  uint64_t ticks = (uint64_t)(cursim->now_ns * (PLATFORM_TICKS_PER_SEC / 1e9));
+  uint64_t wait = (PLATFORM_VBLANK_LINE * PLATFORM_LINE_TICKS + frame - ticks % frame) % frame;
+  cursim->now_ns = (uint64_t)((ticks + (wait ? wait : frame)) * (1e9 / PLATFORM_TICKS_PER_SEC)) + 1;
+}
+
+void flashsim_set_profile(t_flashsim *sim, const t_cart_profile *prof) {
+  sim->profile = prof;
+}
+
+void flashsim_load(t_flashsim *sim, const uint8_t *data, unsigned size) {
+  unsigned cwords = sim->chip->size / 2;
+  for (unsigned i = 0; i < size / 2 && i < cwords; i++)
+    sim->flash[bus_to_chip(sim, i) & (cwords - 1)] = data[i*2] | (data[i*2+1] << 8);
+}
+
+void flashsim_read(t_flashsim *sim, uint8_t *data, unsigned size) {
+  unsigned cwords = sim->chip->size / 2;
+  for (unsigned i = 0; i < size / 2; i++) {
+    uint16_t v = cell_read(sim, bus_to_chip(sim, i) & (cwords - 1));
+    data[i*2] = v;
+    data[i*2+1] = v >> 8;
+  }
+}
+
+bool flashsim_busy(const t_flashsim *sim) {
+  return sim->busy_op != BUSY_NONE && sim->now_ns < sim->busy_until;
+}
+
+// xorshift64* generator, seeded from the fault config.
+static uint64_t rng_next(t_flashsim *sim) {
+  sim->rng ^= sim->rng >> 12;
+  sim->rng ^= sim->rng << 25;
+  sim->rng ^= sim->rng >> 27;
+  return sim->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(t_flashsim *sim) {
+  return (rng_next(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool rng_ppm(t_flashsim *sim, unsigned ppm) {
+  return ppm && (rng_next(sim) % 1000000) < ppm;
+}
+
+void flashsim_set_faults(t_flashsim *sim, const t_simfaults *faults) {
+  sim->faults = *faults;
+  sim->rng = faults->seed * 0x9E3779B97F4A7C15ULL + 1;
+  if (sim->faults.stuck_count > SIM_MAX_STUCK)
+    sim->faults.stuck_count = SIM_MAX_STUCK;
+
+  for (unsigned i = 0; i < sim->faults.stuck_count; i++) {
+    sim->stuck[i].addr = rng_next(sim) % (sim->chip->size / 2);
+    sim->stuck[i].mask = 1 << (rng_next(sim) % 16);
+    sim->stuck[i].value = (rng_next(sim) & 1) ? sim->stuck[i].mask : 0;
+  }
+}
+
+bool flashsim_parse_faults(const char *spec, t_simfaults *faults) {
+  char tmp[256];
+  snprintf(tmp, sizeof(tmp), "%s", spec);
+
+  for (char *tok = strtok(tmp, ","); tok; tok = strtok(NULL, ",")) {
+    char *val = strchr(tok, '=');
+    if (!val)
+      return false;
+    *val++ = 0;
+
+    if (!strcmp(tok, "seed"))
+      faults->seed = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "stuck"))
+      faults->stuck_count = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "progfail"))
+      faults->prog_fail_ppm = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "erasefail"))
+      faults->erase_fail_ppm = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "toggle"))
+      faults->toggle_ppm = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "flaky"))
+      faults->flaky_ppm = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "slow")) {
+      // slow=<first>[-<last>]:<factor>
+      unsigned first, last, factor;
+      if (sscanf(val, "%u-%u:%u", &first, &last, &factor) != 3) {
+        if (sscanf(val, "%u:%u", &first, &factor) != 2)
+          return false;
+        last = first;
+      }
+      for (unsigned i = first; i <= last && i < 64; i++)
+        faults->slow_sectors |= 1ULL << i;
+      faults->slow_factor = factor;
+    }
+    else if (!strcmp(tok, "latency")) {
+      // latency=<fixed|uniform|exp>[:<percent>]
+      char *pct = strchr(val, ':');
+      if (pct)
+        *pct++ = 0;
+      if (!strcmp(val, "fixed"))
+        faults->latency = SIM_LAT_FIXED;
+      else if (!strcmp(val, "uniform"))
+        faults->latency = SIM_LAT_UNIFORM;
+      else if (!strcmp(val, "exp"))
+        faults->latency = SIM_LAT_EXP;
+      else
+        return false;
+      faults->latency_pct = pct ? strtoul(pct, NULL, 0) : 50;
+    }
+    else
+      return false;
+  }
+  return true;
+}
+
+// Applies the slow sectors and the latency distribution to a busy time.
+static uint64_t busy_time(t_flashsim *sim, uint64_t base_ns, uint32_t ca) {
+  int sect = chip_sector_at(sim->chip, ca * 2);
+  if (sect >= 0 && sect < 64 && ((sim->faults.slow_sectors >> sect) & 1))
+    base_ns *= sim->faults.slow_factor;
+
+  double pct = sim->faults.latency_pct / 100.0;
+  switch (sim->faults.latency) {
+  case SIM_LAT_UNIFORM:
+    return base_ns * (1.0 + (2.0 * rng_unit(sim) - 1.0) * pct);
+  case SIM_LAT_EXP:
+    return base_ns * (1.0 - log(1.0 - rng_unit(sim)) * pct);
+  default:
+    return base_ns;
+  };
+}
+
+// The operation never completes and DQ5 goes high, until the chip is reset.
+static void fail_op(t_flashsim *sim) {
+  sim->failed = true;
+  sim->busy_until = UINT64_MAX;
+  sim->stats.failures++;
+}
+
+static void tick(t_flashsim *sim, unsigned cycles) {
+  sim->now_ns += (uint64_t)(cycles * SIM_CYCLE_NS);
+}
+
+static void start_busy(t_flashsim *sim, unsigned op, uint64_t duration_ns) {
+  sim->busy_op = op;
+  sim->busy_until = sim->now_ns + duration_ns;
+  sim->stats.busy_ns += duration_ns;
+}
+
+static void check_busy(t_flashsim *sim) {
+  if (sim->busy_op != BUSY_NONE && sim->now_ns >= sim->busy_until) {
+    sim->busy_op = BUSY_NONE;
+    if (sim->state == ST_SECTOR_ERASE)
+      sim->state = ST_READ;
+  }
+}
+
+static void program_word(t_flashsim *sim, uint32_t ca, uint16_t value) {
+  // Programming can only clear bits.
+  sim->flash[ca] &= value;
+  sim->busy_data = value;
+  sim->stats.programs++;
+  start_busy(sim, BUSY_PROGRAM, busy_time(sim, sim->chip->word_prog_us * 1000ULL, ca));
+
+  if (rng_ppm(sim, sim->faults.prog_fail_ppm)) {
+    // One of the bits to clear stays set
+    uint16_t zeros = ~value;
+    sim->flash[ca] |= zeros & -zeros;
+    fail_op(sim);
+  }
+}
+
+static void erase_sector(t_flashsim *sim, uint32_t ca) {
+  int sect = chip_sector_at(sim->chip, ca * 2);
+  uint32_t start, size;
+  if (sect < 0 || !chip_sector(sim->chip, sect, &start, &size))
+    return;
+  memset(&sim->flash[start / 2], 0xFF, size);
+  sim->stats.erases++;
+
+  // Each additional sector extends the erase operation.
+  uint64_t erase_ns = busy_time(sim, sim->chip->sector_erase_ms * 1000000ULL, ca);
+  if (sim->busy_op != BUSY_ERASE) {
+    sim->busy_op = BUSY_ERASE;
+    sim->erase_window = sim->now_ns + SECTOR_ERASE_WINDOW_NS;
+    sim->busy_until = sim->erase_window;
+  }
+  sim->busy_until += erase_ns;
+  sim->stats.busy_ns += erase_ns;
+
+  if (rng_ppm(sim, sim->faults.erase_fail_ppm)) {
+    sim->flash[start / 2] = 0xFFFE;
+    fail_op(sim);
+  }
+}
+
+static void erase_chip(t_flashsim *sim) {
+  memset(sim->flash, 0xFF, sim->chip->size);
+  sim->stats.erases++;
+
+  // Slow sectors add their extra time to the chip erase.
+  uint64_t erase_ns = busy_time(sim, sim->chip->chip_erase_ms * 1000000ULL, UINT32_MAX);
+  for (unsigned i = 0; i < 64; i++)
+    if ((sim->faults.slow_sectors >> i) & 1)
+      erase_ns += (sim->faults.slow_factor - 1) * sim->chip->sector_erase_ms * 1000000ULL;
+  start_busy(sim, BUSY_ERASE, erase_ns);
+
+  if (rng_ppm(sim, sim->faults.erase_fail_ppm)) {
+    sim->flash[rng_next(sim) % (sim->chip->size / 2)] = 0xFFFE;
+    fail_op(sim);
+  }
+}
+
+static uint16_t status_read(t_flashsim *sim) {
+  // DQ7: data polling (complement of the programmed bit, zero while erasing)
+  // DQ6: toggles on every read, DQ5: operation failed, DQ3: erase started
+  uint16_t ret = 0;
+  if (sim->busy_op == BUSY_PROGRAM)
+    ret |= (~sim->busy_data) & 0x80;
+  else
+    ret |= 0x08;
+  ret |= sim->toggle ? 0x40 : 0x00;
+  ret |= sim->failed ? 0x20 : 0x00;
+
+  if (rng_ppm(sim, sim->faults.toggle_ppm))
+    sim->stats.toggle_glitches++;   // Skip a toggle
+  else
+    sim->toggle = !sim->toggle;
+  return ret;
+}
+
+static uint16_t flash_read(t_flashsim *sim, uint32_t ca) {
+  check_busy(sim);
+  if (sim->busy_op != BUSY_NONE)
+    return status_read(sim);
+
+  if (sim->state == ST_AUTOSELECT) {
+    switch (ca & 0xFF) {
+    case 0x00: return sim->chip->id >> 16;
+    case 0x01: return sim->chip->id & 0xFFFF;
+    default:   return 0x0000;
+    };
+  }
+  return cell_read(sim, ca);
+}
+
+static void flash_cmd(t_flashsim *sim, uint32_t ca, uint16_t value) {
+  check_busy(sim);
+  uint32_t uaddr = ca & 0x7FF;
+  uint8_t cmd = value & 0xFF;
+
+  if (sim->failed && cmd == 0xF0) {
+    // Reset is the only way out of a failed operation.
+    sim->failed = false;
+    sim->busy_op = BUSY_NONE;
+    sim->state = ST_READ;
+    return;
+  }
+
+  if (sim->busy_op != BUSY_NONE) {
+    // Additional sectors can be queued during the sector erase window.
+    if (sim->state == ST_SECTOR_ERASE && cmd == 0x30 && sim->now_ns < sim->erase_window)
+      erase_sector(sim, ca);
+    return;   // Writes are ignored while busy
+  }
+
+  if (cmd == 0xF0 && sim->state != ST_PROGRAM && sim->state < ST_BYPASS) {
+    sim->state = ST_READ;
+    return;
+  }
+
+  switch (sim->state) {
+  case ST_READ:
+  case ST_AUTOSELECT:
+    sim->state = (uaddr == 0x555 && cmd == 0xAA) ? ST_UNLOCK1 : sim->state;
+    break;
+  case ST_UNLOCK1:
+    sim->state = (uaddr == 0x2AA && cmd == 0x55) ? ST_UNLOCK2 : ST_READ;
+    break;
+  case ST_UNLOCK2:
+    if (uaddr == 0x555 && cmd == 0x90)
+      sim->state = ST_AUTOSELECT;
+    else if (uaddr == 0x555 && cmd == 0xA0)
+      sim->state = ST_PROGRAM;
+    else if (uaddr == 0x555 && cmd == 0x80)
+      sim->state = ST_ERASE;
+    else if (uaddr == 0x555 && cmd == 0x20 && (sim->chip->flags & CHIP_FLAG_UNLOCK_BYPASS))
+      sim->state = ST_BYPASS;
+    else if (cmd == 0x25 && (sim->chip->flags & CHIP_FLAG_WRITE_BUFFER)) {
+      sim->wbuf_sa = ca;
+      sim->state = ST_WBUF_COUNT;
+    }
+    else
+      sim->state = ST_READ;
+    break;
+  case ST_PROGRAM:
+    sim->state = ST_READ;
+    program_word(sim, ca, value);
+    break;
+  case ST_ERASE:
+    sim->state = (uaddr == 0x555 && cmd == 0xAA) ? ST_ERASE_UNLOCK1 : ST_READ;
+    break;
+  case ST_ERASE_UNLOCK1:
+    sim->state = (uaddr == 0x2AA && cmd == 0x55) ? ST_ERASE_UNLOCK2 : ST_READ;
+    break;
+  case ST_ERASE_UNLOCK2:
+    if (uaddr == 0x555 && cmd == 0x10) {
+      sim->state = ST_READ;
+      erase_chip(sim);
+    } else if (cmd == 0x30) {
+      sim->state = ST_SECTOR_ERASE;
+      erase_sector(sim, ca);
+    } else
+      sim->state = ST_READ;
+    break;
+
+  case ST_BYPASS:
+    if (cmd == 0xA0)
+      sim->state = ST_BYPASS_PROGRAM;
+    else if (cmd == 0x80)
+      sim->state = ST_BYPASS_ERASE;
+    else if (cmd == 0x90)
+      sim->state = ST_BYPASS_EXIT;
+    break;
+  case ST_BYPASS_PROGRAM:
+    sim->state = ST_BYPASS;
+    program_word(sim, ca, value);
+    break;
+  case ST_BYPASS_ERASE:
+    sim->state = ST_BYPASS;
+    if (cmd == 0x10)
+      erase_chip(sim);
+    else if (cmd == 0x30)
+      erase_sector(sim, ca);
+    break;
+  case ST_BYPASS_EXIT:
+    sim->state = (value == 0x00) ? ST_READ : ST_BYPASS;
+    break;
+
+  case ST_WBUF_COUNT:
+    sim->wbuf_count = value + 1;
+    sim->wbuf_loaded = 0;
+    sim->state = sim->wbuf_count <= sim->chip->wbuf_words ? ST_WBUF_DATA : ST_READ;
+    break;
+  case ST_WBUF_DATA:
+    // All the words must belong to the same write buffer page, or it aborts.
+    if (sim->wbuf_loaded && (ca & ~(sim->chip->wbuf_words - 1)) !=
+                            (sim->wbuf_addr[0] & ~(sim->chip->wbuf_words - 1))) {
+      sim->state = ST_READ;
+      break;
+    }
+    sim->wbuf_addr[sim->wbuf_loaded] = ca;
+    sim->wbuf_data[sim->wbuf_loaded] = value;
+    if (++sim->wbuf_loaded == sim->wbuf_count)
+      sim->state = ST_WBUF_CONFIRM;
+    break;
+  case ST_WBUF_CONFIRM:
+    sim->state = ST_READ;
+    if (cmd == 0x29) {
+      for (unsigned i = 0; i < sim->wbuf_count; i++)
+        sim->flash[sim->wbuf_addr[i]] &= sim->wbuf_data[i];
+      sim->busy_data = sim->wbuf_data[sim->wbuf_count - 1];
+      sim->stats.programs++;
+      start_busy(sim, BUSY_PROGRAM, busy_time(sim, sim->chip->buf_prog_us * 1000ULL, sim->wbuf_sa));
+      if (rng_ppm(sim, sim->faults.prog_fail_ppm))
+        fail_op(sim);
+    }
+    break;
+  };
+}
+
+static void mode_write(t_flashsim *sim, uint16_t value) {
+  // Magic value twice, then the mode value twice.
+  if (sim->mode_seq < 2 && value == sim->profile->mode_magic)
+    sim->mode_seq++;
+  else if (sim->mode_seq == 2) {
+    sim->mode_pending = value;
+    sim->mode_seq = 3;
+  }
+  else if (sim->mode_seq == 3 && value == sim->mode_pending) {
+    sim->mode = value;
+    sim->mode_seq = 0;
+    sim->stats.mode_switches++;
+  }
+  else
+    sim->mode_seq = (value == sim->profile->mode_magic) ? 1 : 0;
+}
+
+// Platform and slot-2 primitives for the shared code.
+
+void platform_init() {
+}
+
+uint32_t platform_ticks() {
+  return (uint32_t)(cursim->now_ns * (PLATFORM_TICKS_PER_SEC / 1e9));
+}
+
+// Whole lines, like VCOUNT on the NDS.
+uint32_t platform_ticks_to_vblank() {
+  unsigned line = platform_ticks() / PLATFORM_LINE_TICKS % PLATFORM_FRAME_LINES;
+  return platform_lines_to_vblank(line) * PLATFORM_LINE_TICKS;
+}
+
+void sleep_1ms() {
+  cursim->now_ns += 1000000;
+}
+
+bool slot2_raw_acquire() {
+  return false;
+}
+
+void slot2_raw_release(bool pmode) {
+}
+
+// EXMEMCNT ROM timing: first access 10, 8, 6 or 18 cycles, sequential 6 or 4.
+uint16_t slot2_raw_get_timing() {
+  return cursim->timing;
+}
+
+void slot2_raw_set_timing(uint16_t bits) {
+  static const unsigned first[4] = {10, 8, 6, 18};
+  cursim->timing = bits & 0x7F;
+  cursim->first_cycles = first[(bits >> 2) & 3];
+  cursim->seq_cycles = (bits & 0x10) ? 4 : 6;
+}
+
+// The SD interface registers are mapped by the mode bit 1.
+static bool sd_mapped(const t_flashsim *sim) {
+  return (sim->mode & 0x2) && sim->sd;
+}
+
+uint16_t slot2_raw_read16(uint32_t waddr) {
+  t_flashsim *sim = cursim;
+  tick(sim, sim->first_cycles);
+  sim->stats.reads++;
+
+  waddr &= SDRAM_WORDS - 1;
+  if (sd_mapped(sim) && waddr == SCSD_CMD_WADDR)
+    return sdsim_cmd_read(sim->sd);
+  if (sd_mapped(sim) && waddr == SCSD_DATA_RD_WADDR)
+    return sdsim_data_read(sim->sd, sim->now_ns);
+  if (sim->mode & MAPPED_SDRAM)
+    return sim->sdram[waddr];
+  return flash_read(sim, bus_to_chip(sim, waddr) & (sim->chip->size / 2 - 1));
+}
+
+void slot2_raw_write16(uint32_t waddr, uint16_t value) {
+  t_flashsim *sim = cursim;
+  tick(sim, sim->first_cycles);
+  sim->stats.writes++;
+
+  waddr &= SDRAM_WORDS - 1;
+  if (waddr == sim->profile->mode_waddr)
+    mode_write(sim, value);
+  else if (sd_mapped(sim) && waddr == SCSD_CMD_WADDR)
+    sdsim_cmd_write(sim->sd, sim->now_ns, value);
+  else if (sd_mapped(sim) && waddr == SCSD_DATA_WR_WADDR)
+    sdsim_data_write(sim->sd, sim->now_ns, value);
+  else if (!(sim->mode & 0x4))
+    return;   // Write protected
+  else if (sim->mode & MAPPED_SDRAM)
+    sim->sdram[waddr] = value;
+  else
+    flash_cmd(sim, bus_to_chip(sim, waddr) & (sim->chip->size / 2 - 1), value);
+}
+
+void slot2_raw_read(void *dst, uint32_t offset, unsigned bytes) {
+  t_flashsim *sim = cursim;
+  uint8_t *d = (uint8_t*)dst;
+  unsigned words = bytes / 2;
+  tick(sim, sim->first_cycles + (words ? words - 1 : 0) * sim->seq_cycles);
+  sim->stats.block_words += words;
+
+  // Dirty contacts: transient bit flips, rarer with the slowest timing.
+  unsigned flaky = sim->first_cycles == 18 ? sim->faults.flaky_ppm / 10 : sim->faults.flaky_ppm;
+  for (unsigned i = 0; i < words; i++) {
+    uint32_t waddr = (offset / 2 + i) & (SDRAM_WORDS - 1);
+    uint16_t v = (sim->mode & MAPPED_SDRAM) ? sim->sdram[waddr] :
+                 flash_read(sim, bus_to_chip(sim, waddr) & (sim->chip->size / 2 - 1));
+    if (rng_ppm(sim, flaky)) {
+      v ^= 1 << (rng_next(sim) % 16);
+      sim->stats.bit_flips++;
+    }
+    d[i*2] = v;
+    d[i*2+1] = v >> 8;
+  }
+}
+
+// Bulk writes only reach the SDRAM (flash commands are single writes).
+void slot2_raw_write(uint32_t offset, const void *src, unsigned bytes) {
+  t_flashsim *sim = cursim;
+  const uint8_t *s = (const uint8_t*)src;
+  unsigned words = bytes / 2;
+  tick(sim, sim->first_cycles + (words ? words - 1 : 0) * sim->seq_cycles);
+  sim->stats.block_words += words;
+
+  if ((sim->mode & (MAPPED_SDRAM | 0x4)) != (MAPPED_SDRAM | 0x4))
+    return;
+  for (unsigned i = 0; i < words; i++)
+    sim->sdram[(offset / 2 + i) & (SDRAM_WORDS - 1)] = s[i*2] | (s[i*2+1] << 8);
+}
+
+uint8_t slot2_raw_sram_read8(uint32_t addr) {
+  tick(cursim, cursim->first_cycles);
+  return cursim->sram[addr % SLOT2_SRAM_SIZE];
+}
+
+void slot2_raw_sram_write8(uint32_t addr, uint8_t value) {
+  tick(cursim, cursim->first_cycles);
+  cursim->sram[addr % SLOT2_SRAM_SIZE] = value;
+}
@@ -0,0 +1,123 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SuperCard slot-2 simulator for the host tools.
+//
+// Models the SuperCard mode register, the SDRAM/SRAM windows, the SD
+// interface registers (driving an sdsim card, if one is inserted) and an AMD
+// command set flash chip (autoselect, program, unlock bypass, buffered
+// program, sector/chip erase and toggle/data polling status reads), with a
+// simulated clock driven by the bus accesses and the chip busy times.
+// It provides the slot2_raw_* and platform_* primitives used by the shared
+// code in source/, operating on the currently selected simulator instance.
+
+#ifndef _FLASHSIM_H_
+#define _FLASHSIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cartprof.h"
+#include "chipdb.h"
+#include "sdsim.h"
+#include "slot2.h"
+
+#define SIM_CYCLE_NS   (1e9 / 33513982.0)
+
+// Fault injection. Everything random is derived from the seed, so that runs
+// are reproducible.
+enum { SIM_LAT_FIXED, SIM_LAT_UNIFORM, SIM_LAT_EXP };
+
+#define SIM_MAX_STUCK   32
+
+typedef struct {
+  uint32_t seed;
+  unsigned stuck_count;             // Words with stuck bits (random addresses)
+  uint64_t slow_sectors;            // Bitmap of slow sectors
+  unsigned slow_factor;             // Busy time multiplier for the slow sectors
+  unsigned prog_fail_ppm;           // Program failures (DQ5), per million programs
+  unsigned erase_fail_ppm;          // Erase failures (DQ5), per million erases
+  unsigned toggle_ppm;              // DQ6 not toggling, per million status reads
+  unsigned flaky_ppm;               // Bit flips, per million words of bulk reads
+                                    // (ten times less with the slowest timing)
+  unsigned latency;                 // Busy time distribution (SIM_LAT_*)
+  unsigned latency_pct;             // Spread (uniform) or mean tail (exp), in percent
+} t_simfaults;
+
+typedef struct {
+  uint64_t reads, writes;       // 16 bit bus accesses
+  uint64_t block_words;         // Words transferred by bulk reads
+  uint64_t mode_switches;
+  uint64_t programs;            // Program operations (word or buffer)
+  uint64_t erases;              // Erase operations (sector or chip)
+  uint64_t busy_ns;             // Time the chip spent busy
+  uint64_t failures;            // Injected program/erase failures
+  uint64_t toggle_glitches;     // Injected toggle bit anomalies
+  uint64_t bit_flips;           // Injected bulk read bit flips
+} t_flashsim_stats;
+
+typedef struct {
+  const t_flash_chip *chip;
+  const t_cart_profile *profile;   // Cart wiring and mode register
+  uint16_t *flash;              // Flash contents, in chip address order
+  uint16_t *sdram;
+  uint8_t sram[SLOT2_SRAM_SIZE];
+  t_sdsim *sd;                  // Card in the cart SD slot (NULL if none)
+
+  // SuperCard mode register
+  uint16_t mode;
+  unsigned mode_seq;
+  uint16_t mode_pending;
+
+  // Flash command state machine
+  unsigned state;
+  unsigned busy_op;
+  uint64_t busy_until;
+  uint64_t erase_window;        // End of the sector erase command window
+  uint16_t busy_data;           // Programmed data (for DQ7 polling)
+  bool toggle;                  // DQ6 toggle bit state
+  bool failed;                  // Operation failed (DQ5), until reset
+  uint32_t wbuf_sa;             // Write buffer: sector address, count, contents
+  unsigned wbuf_count, wbuf_loaded;
+  uint32_t wbuf_addr[64];
+  uint16_t wbuf_data[64];
+
+  // Simulated time and bus timings (in DS bus cycles, from the EXMEMCNT bits)
+  uint64_t now_ns;
+  uint16_t timing;
+  unsigned first_cycles, seq_cycles;
+
+  t_flashsim_stats stats;
+
+  t_simfaults faults;
+  uint64_t rng;
+  struct {
+    uint32_t addr;
+    uint16_t mask, value;
+  } stuck[SIM_MAX_STUCK];
+} t_flashsim;
+
+t_flashsim *flashsim_create(const t_flash_chip *chip);
+void flashsim_destroy(t_flashsim *sim);
+// Selects the simulator instance used by the slot2_raw_* primitives (per thread).
+void flashsim_select(t_flashsim *sim);
+t_flashsim *flashsim_current();
+// Advances the selected simulator clock (time spent outside the bus).
+void flashsim_advance(uint64_t ns);
+// Advances the selected simulator clock to the start of the next VBlank (like
+// swiWaitForVBlank).
+void flashsim_wait_vblank();
+
+// Loads/reads the flash contents, in bus (CPU visible) order.
+// Simulated cart wiring and mode register protocol (SuperCard by default).
+// Contents are loaded and read in bus order, set it before loading them.
+void flashsim_set_profile(t_flashsim *sim, const t_cart_profile *prof);
+void flashsim_load(t_flashsim *sim, const uint8_t *data, unsigned size);
+void flashsim_read(t_flashsim *sim, uint8_t *data, unsigned size);
+bool flashsim_busy(const t_flashsim *sim);
+
+// Enables fault injection (stuck bits are generated here, from the seed).
+void flashsim_set_faults(t_flashsim *sim, const t_simfaults *faults);
+// Parses a fault spec like "stuck=4,slow=0-3:10,progfail=100,latency=exp:50,flaky=20".
+bool flashsim_parse_faults(const char *spec, t_simfaults *faults);
+
+#endif
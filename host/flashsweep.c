@@ -0,0 +1,290 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Flash strategy sweep.
+//
+// Runs every combination of chip model, programming strategy and workload
+// (the image to flash plus the previous flash contents) against the
+// simulator, spreading the runs across all the CPU cores (each worker thread
+// drives its own simulated cart). Reports the modeled time and bus operation
+// counts, and the fastest strategy for every chip/workload.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "flash.h"
+#include "flashsim.h"
+
+#define MAX_ITEMS   32
+
+static const struct {
+  const char *name;
+  unsigned method, opts;
+} strategies[] = {
+  { "word",          FLASH_PROG_WORD,     0 },
+  { "bypass",        FLASH_PROG_BYPASS,   0 },
+  { "buffered",      FLASH_PROG_BUFFERED, 0 },
+  { "sparse",        FLASH_PROG_WORD,     FLASH_OPT_SPARSE },
+  { "diff",          FLASH_PROG_WORD,     FLASH_OPT_DIFF },
+  { "diff-bypass",   FLASH_PROG_BYPASS,   FLASH_OPT_DIFF },
+  { "diff-buffered", FLASH_PROG_BUFFERED, FLASH_OPT_DIFF },
+};
+#define NUM_STRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+typedef struct {
+  char name[64];
+  uint8_t *newimg, *oldimg;
+  unsigned size;
+} t_workload;
+
+typedef struct {
+  const t_flash_chip *chip;
+  unsigned strategy;
+  const t_workload *wl;
+  // Results
+  bool skipped, ok;
+  uint64_t time_ns;
+  t_flashsim_stats stats;
+} t_job;
+
+static t_job *jobs;
+static unsigned num_jobs;
+static unsigned next_job = 0;
+
+static bool chip_supports(const t_flash_chip *chip, unsigned method) {
+  switch (method) {
+  case FLASH_PROG_BYPASS:   return chip->flags & CHIP_FLAG_UNLOCK_BYPASS;
+  case FLASH_PROG_BUFFERED: return chip->flags & CHIP_FLAG_WRITE_BUFFER;
+  default:                  return true;
+  };
+}
+
+static void run_job(t_job *job) {
+  unsigned method = strategies[job->strategy].method;
+  if (!chip_supports(job->chip, method)) {
+    job->skipped = true;
+    return;
+  }
+
+  t_flashsim *sim = flashsim_create(job->chip);
+  flashsim_select(sim);
+  flashsim_load(sim, job->wl->oldimg, job->wl->size);
+
+  bool ok = flash_update(job->chip, job->wl->newimg, job->wl->size, method, strategies[job->strategy].opts);
+
+  uint8_t *readback = (uint8_t*)malloc(job->wl->size);
+  flashsim_read(sim, readback, job->wl->size);
+  job->ok = ok && !memcmp(readback, job->wl->newimg, job->wl->size);
+  job->time_ns = sim->now_ns;
+  job->stats = sim->stats;
+
+  free(readback);
+  flashsim_destroy(sim);
+}
+
+static void *worker(void *arg) {
+  while (1) {
+    unsigned idx = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+    if (idx >= num_jobs)
+      return NULL;
+    run_job(&jobs[idx]);
+  }
+}
+
+static void random_fill(uint8_t *buf, unsigned size, unsigned *seed) {
+  for (unsigned i = 0; i < size; i++)
+    buf[i] = rand_r(seed);
+}
+
+// Synthetic workloads: a full image, an image that only fills half of the
+// flash and a small update over the previous firmware.
+static bool make_workload(t_workload *wl, const char *spec, unsigned seed) {
+  wl->size = FLASH_FW_SIZE;
+  wl->newimg = (uint8_t*)malloc(FLASH_FW_SIZE);
+  wl->oldimg = (uint8_t*)malloc(FLASH_FW_SIZE);
+  snprintf(wl->name, sizeof(wl->name), "%s", spec);
+  random_fill(wl->oldimg, FLASH_FW_SIZE, &seed);
+
+  if (!strcmp(spec, "full"))
+    random_fill(wl->newimg, FLASH_FW_SIZE, &seed);
+  else if (!strcmp(spec, "half")) {
+    random_fill(wl->newimg, FLASH_FW_SIZE / 2, &seed);
+    memset(&wl->newimg[FLASH_FW_SIZE / 2], 0xFF, FLASH_FW_SIZE / 2);
+  }
+  else if (!strcmp(spec, "update")) {
+    memcpy(wl->newimg, wl->oldimg, FLASH_FW_SIZE);
+    random_fill(&wl->newimg[0x20000], 4096, &seed);
+  }
+  else {
+    // new.bin[:old.bin], the previous contents default to random data.
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s", spec);
+    char *oldfn = strchr(tmp, ':');
+    if (oldfn)
+      *oldfn++ = 0;
+
+    free(wl->newimg);
+    if (!(wl->newimg = load_file(tmp, &wl->size)) || wl->size > FLASH_FW_SIZE)
+      return false;
+    if (oldfn) {
+      unsigned osize;
+      uint8_t *o = load_file(oldfn, &osize);
+      if (!o)
+        return false;
+      memcpy(wl->oldimg, o, osize < FLASH_FW_SIZE ? osize : FLASH_FW_SIZE);
+      free(o);
+    }
+    const char *bn = strrchr(tmp, '/');
+    snprintf(wl->name, sizeof(wl->name), "%.63s", bn ? bn + 1 : tmp);
+  }
+  return true;
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: flashsweep [options]\n");
+  fprintf(stderr, "  -c chip       Chip to evaluate (repeatable, defaults to all)\n");
+  fprintf(stderr, "  -s strategy   Strategy to evaluate (repeatable, defaults to all):\n               ");
+  for (unsigned i = 0; i < NUM_STRATEGIES; i++)
+    fprintf(stderr, " %s", strategies[i].name);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  -w workload   full, half, update or new.bin[:old.bin] (repeatable)\n");
+  fprintf(stderr, "  -j threads    Worker threads (defaults to the number of CPUs)\n");
+  fprintf(stderr, "  -S seed       Seed for the synthetic workloads\n");
+  fprintf(stderr, "  -C            CSV output\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const t_flash_chip *chips[MAX_ITEMS];
+  unsigned strats[MAX_ITEMS];
+  const char *wlspecs[MAX_ITEMS];
+  unsigned nchips = 0, nstrats = 0, nwls = 0;
+  unsigned nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned seed = 1;
+  bool csv = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:s:w:j:S:C")) != -1) {
+    switch (opt) {
+    case 'c':
+      if (nchips == MAX_ITEMS || !(chips[nchips++] = parse_chip(optarg))) {
+        fprintf(stderr, "Unknown chip %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 's':
+      {
+        unsigned i = 0;
+        while (i < NUM_STRATEGIES && strcasecmp(strategies[i].name, optarg))
+          i++;
+        if (i == NUM_STRATEGIES || nstrats == MAX_ITEMS) {
+          fprintf(stderr, "Unknown strategy %s\n", optarg);
+          return 1;
+        }
+        strats[nstrats++] = i;
+      }
+      break;
+    case 'w':
+      if (nwls < MAX_ITEMS)
+        wlspecs[nwls++] = optarg;
+      break;
+    case 'j': nthreads = atoi(optarg); break;
+    case 'S': seed = atoi(optarg); break;
+    case 'C': csv = true; break;
+    default:  usage();
+    };
+  }
+
+  if (!nchips)
+    for (; nchips < chipdb_count && nchips < MAX_ITEMS; nchips++)
+      chips[nchips] = &chipdb[nchips];
+  if (!nstrats)
+    for (; nstrats < NUM_STRATEGIES; nstrats++)
+      strats[nstrats] = nstrats;
+  if (!nwls) {
+    wlspecs[nwls++] = "full";
+    wlspecs[nwls++] = "half";
+    wlspecs[nwls++] = "update";
+  }
+  if (!nthreads)
+    nthreads = 1;
+
+  t_workload wls[MAX_ITEMS];
+  for (unsigned i = 0; i < nwls; i++) {
+    if (!make_workload(&wls[i], wlspecs[i], seed + i)) {
+      fprintf(stderr, "Could not load workload %s\n", wlspecs[i]);
+      return 1;
+    }
+  }
+
+  num_jobs = nwls * nchips * nstrats;
+  jobs = (t_job*)calloc(num_jobs, sizeof(t_job));
+  for (unsigned w = 0, n = 0; w < nwls; w++)
+    for (unsigned c = 0; c < nchips; c++)
+      for (unsigned s = 0; s < nstrats; s++, n++) {
+        jobs[n].wl = &wls[w];
+        jobs[n].chip = chips[c];
+        jobs[n].strategy = strats[s];
+      }
+
+  // Workers take jobs from a shared counter: if a thread cannot be created
+  // the calling thread joins in, so every job still runs.
+  pthread_t *th = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+  unsigned started = 0;
+  while (started < nthreads && !pthread_create(&th[started], NULL, worker, NULL))
+    started++;
+  if (started < nthreads) {
+    fprintf(stderr, "Could only start %u of %u threads\n", started, nthreads);
+    worker(NULL);
+  }
+  for (unsigned i = 0; i < started; i++)
+    pthread_join(th[i], NULL);
+
+  if (csv)
+    printf("workload,chip,strategy,ok,time_ms,reads,writes,block_words,programs,erases\n");
+
+  for (unsigned n = 0; n < num_jobs; n += nstrats) {
+    const t_job *grp = &jobs[n];
+    if (!csv)
+      printf("\n%s on %s:\n", grp->wl->name, grp->chip->name);
+
+    const t_job *best = NULL;
+    for (unsigned s = 0; s < nstrats; s++) {
+      const t_job *j = &grp[s];
+      const char *sname = strategies[j->strategy].name;
+      if (j->skipped) {
+        if (!csv)
+          printf("  %-14s      n/a\n", sname);
+        continue;
+      }
+      if (csv)
+        printf("%s,%s,%s,%d,%.3f,%llu,%llu,%llu,%llu,%llu\n", j->wl->name, j->chip->name, sname,
+               j->ok, j->time_ns / 1e6, (unsigned long long)j->stats.reads,
+               (unsigned long long)j->stats.writes, (unsigned long long)j->stats.block_words,
+               (unsigned long long)j->stats.programs, (unsigned long long)j->stats.erases);
+      else
+        printf("  %-14s %-4s %10.1f ms  %9llu reads %9llu writes %8llu programs %4llu erases\n",
+               sname, j->ok ? "ok" : "FAIL", j->time_ns / 1e6,
+               (unsigned long long)(j->stats.reads + j->stats.block_words),
+               (unsigned long long)j->stats.writes, (unsigned long long)j->stats.programs,
+               (unsigned long long)j->stats.erases);
+      if (j->ok && (!best || j->time_ns < best->time_ns))
+        best = j;
+    }
+    if (!csv && best)
+      printf("  fastest: %s\n", strategies[best->strategy].name);
+  }
+
+  for (unsigned i = 0; i < nwls; i++) {
+    free(wls[i].newimg);
+    free(wls[i].oldimg);
+  }
+  free(jobs);
+  free(th);
+  return 0;
+}
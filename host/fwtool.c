@@ -0,0 +1,735 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Firmware image tool.
+//
+// Host counterpart of the NDS tool image handling, sharing its code: checks
+// and identifies images, prints manifests, builds full flash images (bundles)
+// and sector patches between two images, flashes/dumps images on the
+// simulator (through the simulated SD card) and checks cart archives.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "arena.h"
+#include "common.h"
+#include "dump.h"
+#include "flash.h"
+#include "flashsim.h"
+#include "fwindex.h"
+#include "image.h"
+#include "sched.h"
+#include "sha256.h"
+#include "storagesim.h"
+
+// Patch file: header followed by "count" records (offset, size, data).
+#define PATCH_MAGIC     0x50574653   // "SFWP"
+#define PATCH_VERSION   1
+
+typedef struct {
+  uint32_t magic, version;
+  uint32_t chip_id;          // Chip used to split the image in sectors
+  uint32_t size;             // Target image size
+  uint8_t base_hash[32];     // Hash of the image the patch applies to
+  uint8_t target_hash[32];   // Hash of the patched image
+  uint32_t count;
+} t_patch_header;
+
+typedef struct {
+  uint32_t offset, size;
+} t_patch_record;
+
+static void print_hash(const uint8_t *hash) {
+  for (unsigned i = 0; i < 32; i++)
+    printf("%02x", hash[i]);
+}
+
+static bool write_file(const char *path, const void *data, unsigned size) {
+  FILE *fd = fopen(path, "wb");
+  if (!fd)
+    return false;
+  bool ok = fwrite(data, 1, size, fd) == size;
+  return !fclose(fd) && ok;
+}
+
+// Loads an image and checks that it fits the flash.
+static uint8_t *load_image(const char *path, unsigned *size) {
+  uint8_t *img = load_file(path, size);
+  if (!img)
+    fprintf(stderr, "Could not read %s\n", path);
+  else if (*size > FLASH_FW_SIZE) {
+    fprintf(stderr, "%s is bigger than %d bytes\n", path, FLASH_FW_SIZE);
+    free(img);
+    img = NULL;
+  }
+  return img;
+}
+
+static bool check_image(const uint8_t *img, unsigned size) {
+  return size >= IMAGE_HEADER_SIZE && valid_header(img);
+}
+
+static int cmd_validate(int argc, char **argv) {
+  int ret = 0;
+  for (int i = 1; i < argc; i++) {
+    unsigned size;
+    uint8_t *img = load_image(argv[i], &size);
+    if (!img) {
+      ret = 1;
+      continue;
+    }
+
+    const char *name = image_ident(img, size);
+    bool hdr = check_image(img, size);
+    printf("%s: %s%s%s\n", argv[i], hdr ? "valid" : "INVALID header",
+           name ? ", " : "", name ? name : "");
+    if (!hdr)
+      ret = 1;
+    free(img);
+  }
+  return ret;
+}
+
+// One line per image: sha256, size, header status, known name and path.
+static int cmd_manifest(int argc, char **argv) {
+  int ret = 0;
+  for (int i = 1; i < argc; i++) {
+    unsigned size;
+    uint8_t *img = load_image(argv[i], &size);
+    if (!img) {
+      ret = 1;
+      continue;
+    }
+
+    uint8_t hash[32];
+    sha256sum(img, size, hash);
+    const char *name = image_lookup(hash);
+    print_hash(hash);
+    printf("  %7u  %-7s  %-30s  %s\n", size, check_image(img, size) ? "valid" : "invalid",
+           name ? name : "-", argv[i]);
+    free(img);
+  }
+  return ret;
+}
+
+// Pads an image to the full flash size (with erased bytes).
+static int cmd_bundle(int argc, char **argv) {
+  const char *outfn = NULL;
+  bool force = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:f")) != -1) {
+    switch (opt) {
+    case 'o': outfn = optarg; break;
+    case 'f': force = true; break;
+    default:  return -1;
+    };
+  }
+  if (!outfn || optind + 1 != argc)
+    return -1;
+
+  unsigned size;
+  uint8_t *img = load_image(argv[optind], &size);
+  if (!img)
+    return 1;
+  if (!check_image(img, size) && !force) {
+    fprintf(stderr, "%s has an invalid header (use -f to bundle it anyway)\n", argv[optind]);
+    free(img);
+    return 1;
+  }
+
+  uint8_t *bundle = (uint8_t*)malloc(FLASH_FW_SIZE);
+  memcpy(bundle, img, size);
+  memset(&bundle[size], 0xFF, FLASH_FW_SIZE - size);
+  free(img);
+
+  int ret = 0;
+  if (!write_file(outfn, bundle, FLASH_FW_SIZE)) {
+    fprintf(stderr, "Could not write %s\n", outfn);
+    ret = 1;
+  } else {
+    uint8_t hash[32];
+    sha256sum(bundle, FLASH_FW_SIZE, hash);
+    print_hash(hash);
+    printf("  %7u  %s\n", FLASH_FW_SIZE, outfn);
+  }
+  free(bundle);
+  return ret;
+}
+
+// Builds a patch with the sectors that differ between two images.
+static int cmd_patch(int argc, char **argv) {
+  const t_flash_chip *chip = &chipdb[0];
+  const char *outfn = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:c:")) != -1) {
+    switch (opt) {
+    case 'o': outfn = optarg; break;
+    case 'c':
+      if (!(chip = parse_chip(optarg))) {
+        fprintf(stderr, "Unknown chip %s\n", optarg);
+        return 1;
+      }
+      break;
+    default:  return -1;
+    };
+  }
+  if (!outfn || optind + 2 != argc)
+    return -1;
+
+  unsigned osize, nsize;
+  uint8_t *oldimg = load_image(argv[optind], &osize);
+  uint8_t *newimg = load_image(argv[optind + 1], &nsize);
+  if (!oldimg || !newimg) {
+    free(oldimg);
+    free(newimg);
+    return 1;
+  }
+
+  t_patch_header hdr = {
+    .magic = PATCH_MAGIC, .version = PATCH_VERSION,
+    .chip_id = chip->id, .size = nsize,
+  };
+  sha256sum(oldimg, osize, hdr.base_hash);
+  sha256sum(newimg, nsize, hdr.target_hash);
+
+  // Compare against the erased flash past the end of the old image.
+  uint8_t *base = (uint8_t*)malloc(FLASH_FW_SIZE);
+  memset(base, 0xFF, FLASH_FW_SIZE);
+  memcpy(base, oldimg, osize);
+
+  FILE *fd = fopen(outfn, "wb");
+  if (!fd) {
+    fprintf(stderr, "Could not write %s\n", outfn);
+    free(base);
+    free(oldimg);
+    free(newimg);
+    return 1;
+  }
+  fwrite(&hdr, sizeof(hdr), 1, fd);
+
+  unsigned changed = 0;
+  for (unsigned i = 0; i < chip_sector_count(chip); i++) {
+    uint32_t start, ssize;
+    chip_sector(chip, i, &start, &ssize);
+    if (start >= nsize)
+      break;
+    if (start + ssize > nsize)
+      ssize = nsize - start;
+
+    if (memcmp(&base[start], &newimg[start], ssize)) {
+      t_patch_record rec = { start, ssize };
+      fwrite(&rec, sizeof(rec), 1, fd);
+      fwrite(&newimg[start], 1, ssize, fd);
+      hdr.count++;
+      changed += ssize;
+    }
+  }
+
+  // Rewrite the header with the final record count.
+  fseek(fd, 0, SEEK_SET);
+  fwrite(&hdr, sizeof(hdr), 1, fd);
+  int ret = fclose(fd) ? 1 : 0;
+
+  printf("%u sectors (%u bytes) differ\n", hdr.count, changed);
+  free(base);
+  free(oldimg);
+  free(newimg);
+  return ret;
+}
+
+// Applies a patch to an image, checking the base and result hashes.
+static int cmd_apply(int argc, char **argv) {
+  const char *outfn = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+    case 'o': outfn = optarg; break;
+    default:  return -1;
+    };
+  }
+  if (!outfn || optind + 2 != argc)
+    return -1;
+
+  unsigned osize, psize;
+  uint8_t *oldimg = load_image(argv[optind], &osize);
+  uint8_t *patch = load_file(argv[optind + 1], &psize);
+  if (!oldimg || !patch) {
+    free(oldimg);
+    free(patch);
+    return 1;
+  }
+
+  int ret = 1;
+  uint8_t *img = (uint8_t*)malloc(FLASH_FW_SIZE);
+  memset(img, 0xFF, FLASH_FW_SIZE);
+  memcpy(img, oldimg, osize);
+
+  t_patch_header hdr;
+  uint8_t hash[32];
+  sha256sum(oldimg, osize, hash);
+  if (psize < sizeof(hdr))
+    fprintf(stderr, "Invalid patch file\n");
+  else {
+    memcpy(&hdr, patch, sizeof(hdr));
+    if (hdr.magic != PATCH_MAGIC || hdr.version != PATCH_VERSION || hdr.size > FLASH_FW_SIZE)
+      fprintf(stderr, "Invalid patch file\n");
+    else if (memcmp(hash, hdr.base_hash, sizeof(hash)))
+      fprintf(stderr, "The patch does not apply to %s\n", argv[optind]);
+    else {
+      unsigned off = sizeof(hdr), i;
+      for (i = 0; i < hdr.count; i++) {
+        t_patch_record rec;
+        if (off + sizeof(rec) > psize)
+          break;
+        memcpy(&rec, &patch[off], sizeof(rec));
+        off += sizeof(rec);
+        if (rec.offset > hdr.size || rec.size > hdr.size - rec.offset || off + rec.size > psize)
+          break;
+        memcpy(&img[rec.offset], &patch[off], rec.size);
+        off += rec.size;
+      }
+
+      sha256sum(img, hdr.size, hash);
+      if (i != hdr.count)
+        fprintf(stderr, "Truncated or corrupted patch file\n");
+      else if (memcmp(hash, hdr.target_hash, sizeof(hash)))
+        fprintf(stderr, "The patched image does not match the expected hash\n");
+      else if (!write_file(outfn, img, hdr.size))
+        fprintf(stderr, "Could not write %s\n", outfn);
+      else
+        ret = 0;
+    }
+  }
+
+  free(img);
+  free(oldimg);
+  free(patch);
+  return ret;
+}
+
+static bool parse_method(const char *arg, unsigned *method) {
+  if (!strcasecmp(arg, "word"))
+    *method = FLASH_PROG_WORD;
+  else if (!strcasecmp(arg, "bypass"))
+    *method = FLASH_PROG_BYPASS;
+  else if (!strcasecmp(arg, "buffered"))
+    *method = FLASH_PROG_BUFFERED;
+  else
+    return false;
+  return true;
+}
+
+static bool parse_profile(const char *arg, const t_cart_profile **prof) {
+  if (!(*prof = cart_profile_lookup(arg))) {
+    fprintf(stderr, "Unknown cart profile %s\n", arg);
+    return false;
+  }
+  return true;
+}
+
+static bool parse_storage(const char *arg) {
+  t_storagecfg scfg;
+  if (!storagesim_parse(arg, &scfg)) {
+    fprintf(stderr, "Invalid storage spec %s\n", arg);
+    return false;
+  }
+  storagesim_config(&scfg);
+  return true;
+}
+
+// Flashes an image on the simulator (or just plans it, dry run), loading it
+// through the simulated SD card.
+static int cmd_run(int argc, char **argv) {
+  const t_flash_chip *chip = &chipdb[0];
+  const t_cart_profile *prof = &cart_profiles[0];
+  const char *basefn = NULL;
+  unsigned method = FLASH_PROG_WORD, opts = 0;
+  bool dry = false;
+  t_simfaults faults = {0};
+  int opt;
+  while ((opt = getopt(argc, argv, "c:P:b:m:sdnF:S:")) != -1) {
+    switch (opt) {
+    case 'c':
+      if (!(chip = parse_chip(optarg))) {
+        fprintf(stderr, "Unknown chip %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'P':
+      if (!parse_profile(optarg, &prof))
+        return 1;
+      break;
+    case 'b': basefn = optarg; break;
+    case 'm':
+      if (!parse_method(optarg, &method))
+        return -1;
+      break;
+    case 's': opts |= FLASH_OPT_SPARSE; break;
+    case 'd': opts |= FLASH_OPT_DIFF; break;
+    case 'n': dry = true; break;
+    case 'F':
+      if (!flashsim_parse_faults(optarg, &faults)) {
+        fprintf(stderr, "Invalid fault spec %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'S':
+      if (!parse_storage(optarg))
+        return 1;
+      break;
+    default:  return -1;
+    };
+  }
+  if (optind + 1 != argc)
+    return -1;
+
+  unsigned bsize = 0;
+  uint8_t *base = NULL;
+  if (basefn && !(base = load_image(basefn, &bsize)))
+    return 1;
+
+  t_flashsim *sim = flashsim_create(chip);
+  flashsim_set_profile(sim, prof);
+  flashsim_select(sim);
+  flashsim_set_faults(sim, &faults);
+  if (base)
+    flashsim_load(sim, base, bsize);
+
+  int ret = 2;
+  uint8_t *img;
+  unsigned size;
+  unsigned smark = scratch_mark();
+  if (image_load(argv[optind], FLASH_FW_SIZE, &img, &size) != IMAGE_LOAD_OK)
+    fprintf(stderr, "Could not load %s\n", argv[optind]);
+  else {
+    uint64_t t0 = sim->now_ns;
+    uint32_t id;
+    const t_cart_profile *found = cart_detect(&id);
+    t_flash_plan plan;
+    bool plan_ok = flash_plan(&plan, chip, img, size, method, opts, false);
+    uint64_t t1 = sim->now_ns;
+    printf("Cart profile: %s\n", found ? found->name : "not detected");
+    if (plan_ok)
+      printf("Plan: erase %s%u sectors, program %u sectors (%u words, %u pages), "
+             "read %u bytes, estimated %u ms (planned in %.1f ms)\n",
+             plan.chip_erase ? "chip, " : "", plan.erase_sectors, plan.program_sectors,
+             plan.program_words, plan.program_pages, plan.read_bytes, plan.est_ms,
+             (t1 - t0) / 1e6);
+
+    if (!dry) {
+      t_flash_job job;
+      bool write_ok = plan_ok && flash_job_start_plan(&job, &plan, img) && flash_job_run(&job);
+      uint64_t t2 = sim->now_ns;
+      bool valid_ok = write_ok && flash_validate(img, size);
+      uint64_t t3 = sim->now_ns;
+
+      printf("%s (%08x): load %.1f ms, flash %s %.1f ms, validate %s %.1f ms, %llu programs, %llu erases\n",
+             chip->name, id, t0 / 1e6, write_ok ? "ok" : "FAIL", (t2 - t1) / 1e6,
+             valid_ok ? "ok" : "FAIL", (t3 - t2) / 1e6,
+             (unsigned long long)sim->stats.programs, (unsigned long long)sim->stats.erases);
+      ret = valid_ok ? 0 : 2;
+    }
+    else
+      ret = plan_ok ? 0 : 2;
+  }
+  scratch_release(smark);
+
+  flashsim_destroy(sim);
+  free(base);
+  return ret;
+}
+
+// Parses a dump range like "sdram:0x100000:64K" (K and M suffixes allowed).
+static bool parse_range(const char *arg, unsigned *region, uint32_t *start, uint32_t *size) {
+  static const char * const names[] = { "flash", "sram", "sdram" };
+  const char *sep = strchr(arg, ':');
+  *region = 0;
+  for (unsigned i = 0; sep && i < ARCHIVE_REGIONS; i++)
+    if (strlen(names[i]) == (size_t)(sep - arg) && !strncmp(arg, names[i], sep - arg))
+      *region = 1 << i;
+
+  char *end;
+  if (*region) {
+    uint32_t *vals[2] = { start, size };
+    for (unsigned i = 0; i < 2 && sep; i++) {
+      *vals[i] = strtoul(sep + 1, &end, 0);
+      if (*end == 'K' || *end == 'M')
+        *vals[i] <<= (*end++ == 'K') ? 10 : 20;
+      sep = (i == 0 && *end == ':') || (i == 1 && !*end) ? end : NULL;
+    }
+  }
+  if (!*region || !sep) {
+    fprintf(stderr, "Invalid range %s (expected region:start:size)\n", arg);
+    return false;
+  }
+  return true;
+}
+
+// Dumps the simulated flash (or ROM, a full archive or a range of a region)
+// to the simulated SD card.
+static int cmd_dump(int argc, char **argv) {
+  const t_flash_chip *chip = &chipdb[0];
+  const t_cart_profile *prof = &cart_profiles[0];
+  const char *basefn = NULL;
+  bool rom = false, archive = false;
+  unsigned range = 0;
+  uint32_t rstart, rsize;
+  int opt;
+  t_simfaults faults = {0};
+  while ((opt = getopt(argc, argv, "c:P:b:raR:vdF:S:")) != -1) {
+    switch (opt) {
+    case 'c':
+      if (!(chip = parse_chip(optarg))) {
+        fprintf(stderr, "Unknown chip %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'P':
+      if (!parse_profile(optarg, &prof))
+        return 1;
+      break;
+    case 'b': basefn = optarg; break;
+    case 'r': rom = true; break;
+    case 'a': archive = true; break;
+    case 'R':
+      if (!parse_range(optarg, &range, &rstart, &rsize))
+        return 1;
+      break;
+    case 'v': dump_verify = true; break;
+    case 'd': dump_dual_read = true; break;
+    case 'F':
+      if (!flashsim_parse_faults(optarg, &faults)) {
+        fprintf(stderr, "Invalid fault spec %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'S':
+      if (!parse_storage(optarg))
+        return 1;
+      break;
+    default:  return -1;
+    };
+  }
+  if (optind + 1 != argc)
+    return -1;
+
+  unsigned bsize = 0;
+  uint8_t *base = NULL;
+  if (basefn && !(base = load_image(basefn, &bsize)))
+    return 1;
+
+  t_flashsim *sim = flashsim_create(chip);
+  flashsim_set_profile(sim, prof);
+  flashsim_select(sim);
+  flashsim_set_faults(sim, &faults);
+  if (base)
+    flashsim_load(sim, base, bsize);
+
+  // Same as the NDS tool, which detects the profile before any operation.
+  cart_detect(NULL);
+
+  bool ok;
+  unsigned bytes;
+  uint8_t hash[32];
+  if (range) {
+    ok = range_dump(argv[optind], range, rstart, rsize, hash);
+    bytes = rsize;
+  } else if (archive) {
+    ok = cart_archive(argv[optind], ARCHIVE_ALL);
+    bytes = FLASH_FW_SIZE + SLOT2_SRAM_SIZE + SLOT2_ROM_SIZE + sizeof(t_archive_manifest);
+  } else {
+    ok = rom ? rom_dump(argv[optind]) : flash_dump(argv[optind]);
+    bytes = rom ? SLOT2_ROM_SIZE : FLASH_FW_SIZE;
+  }
+  const t_storagestats *st = storagesim_stats();
+
+  printf("%s dump %s: %.1f ms (%.1f ms storage, %.1f ms bus), %.1f KiB/s, "
+         "%llu writes, %llu reads, %llu unaligned\n",
+         range ? "Range" : archive ? "Archive" : rom ? "ROM" : "Flash", ok ? "ok" : "FAILED", sim->now_ns / 1e6,
+         st->busy_ns / 1e6, (sim->now_ns - st->busy_ns) / 1e6,
+         bytes / 1024.0 / (sim->now_ns / 1e9),
+         (unsigned long long)st->writes, (unsigned long long)st->reads,
+         (unsigned long long)st->misaligned);
+  if (faults.flaky_ppm)
+    printf("%llu bit flips injected, %lu blocks read again\n",
+           (unsigned long long)sim->stats.bit_flips, (unsigned long)dump_rereads);
+  if (range && ok) {
+    printf("Range sha256: ");
+    print_hash(hash);
+    printf("\n");
+  }
+
+  flashsim_destroy(sim);
+  free(base);
+  return ok ? 0 : 2;
+}
+
+// Checks the region hashes of a cart archive, and optionally extracts the
+// regions to <prefix>_<region>.bin files.
+static int cmd_unpack(int argc, char **argv) {
+  const char *prefix = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+    case 'o': prefix = optarg; break;
+    default:  return -1;
+    };
+  }
+  if (optind + 1 != argc)
+    return -1;
+
+  unsigned size;
+  uint8_t *arc = load_file(argv[optind], &size);
+  if (!arc) {
+    fprintf(stderr, "Could not read %s\n", argv[optind]);
+    return 1;
+  }
+
+  t_archive_manifest man;
+  if (size < sizeof(man)) {
+    fprintf(stderr, "%s is not a cart archive\n", argv[optind]);
+    free(arc);
+    return 1;
+  }
+  memcpy(&man, &arc[size - sizeof(man)], sizeof(man));
+  if (man.magic != ARCHIVE_MAGIC || man.version != ARCHIVE_VERSION || man.count > ARCHIVE_REGIONS) {
+    fprintf(stderr, "%s is not a cart archive\n", argv[optind]);
+    free(arc);
+    return 1;
+  }
+
+  printf("Flash ID %08x, %u regions\n", man.flash_id, man.count);
+  int ret = 0;
+  for (unsigned i = 0; i < man.count; i++) {
+    const t_archive_region *r = &man.regions[i];
+    if (r->offset > size - sizeof(man) || r->size > size - sizeof(man) - r->offset) {
+      printf("  %-6.8s truncated\n", r->name);
+      ret = 2;
+      continue;
+    }
+
+    uint8_t hash[32];
+    sha256sum(&arc[r->offset], r->size, hash);
+    bool hash_ok = !memcmp(hash, r->sha256, sizeof(hash));
+    printf("  %-6.8s %9u bytes at %9u ", r->name, r->size, r->offset);
+    print_hash(r->sha256);
+    printf(" %s\n", hash_ok ? "ok" : "BAD HASH");
+    if (!hash_ok)
+      ret = 2;
+
+    if (prefix) {
+      char fn[512];
+      snprintf(fn, sizeof(fn), "%s_%.8s.bin", prefix, r->name);
+      if (!write_file(fn, &arc[r->offset], r->size)) {
+        fprintf(stderr, "Could not write %s\n", fn);
+        ret = 1;
+      }
+    }
+  }
+
+  free(arc);
+  return ret;
+}
+
+// Indexes the simulated SD card the way the NDS tool browser does: the index
+// scan runs as a background task in the idle time of every frame (see
+// sched_idle), with the UI loop starting right after the VBlank. Frames left
+// without idle time are reported as a failure, the scan would never advance.
+static int cmd_index(int argc, char **argv) {
+  unsigned max_frames = 60 * 60;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:S:")) != -1) {
+    switch (opt) {
+    case 'f': max_frames = atoi(optarg); break;
+    case 'S':
+      if (!parse_storage(optarg))
+        return 1;
+      break;
+    default:  return -1;
+    };
+  }
+  if (optind != argc)
+    return -1;
+
+  t_flashsim *sim = flashsim_create(&chipdb[0]);
+  flashsim_select(sim);
+  sched_add(fwindex_step, SCHED_PRIO_LOW, FWINDEX_BUDGET);
+
+  unsigned frames = 0, starved = 0;
+  uint64_t budget = 0;
+  fwindex_start();
+  while (fwindex_busy() && frames < max_frames) {
+    flashsim_wait_vblank();
+    frames++;
+    uint32_t b = sched_idle();
+    budget += b;
+    if (!b)
+      starved++;
+  }
+  sched_remove(fwindex_step);
+
+  bool ok = !fwindex_busy() && !starved;
+  printf("Index %s: %u images, %u frames (%u without idle time), %.1f ms of idle budget\n",
+         ok ? "ok" : "FAILED", fwindex_count(), frames, starved,
+         budget / (PLATFORM_TICKS_PER_SEC / 1e3));
+  for (unsigned i = 0; i < fwindex_count(); i++) {
+    const t_fwindex_entry *e = fwindex_get(i);
+    printf("  %-48s %9u ", e->path, e->size);
+    for (unsigned j = 0; j < sizeof(e->sha256); j++)
+      printf("%02x", e->sha256[j]);
+    printf("\n");
+  }
+
+  flashsim_destroy(sim);
+  return ok ? 0 : 2;
+}
+
+static const struct {
+  const char *name;
+  int (*handler)(int argc, char **argv);
+  const char *usage;
+} commands[] = {
+  { "validate", cmd_validate, "image...              Check image headers" },
+  { "manifest", cmd_manifest, "image...              Print hash, size and status" },
+  { "bundle",   cmd_bundle,   "[-f] -o out image     Pad image to the flash size" },
+  { "patch",    cmd_patch,    "[-c chip] -o out old new\n"
+                              "                                 Build a sector patch" },
+  { "apply",    cmd_apply,    "-o out old patch      Apply a sector patch" },
+  { "run",      cmd_run,      "[-c chip] [-P profile] [-b base] [-m word|bypass|buffered] [-s] [-d]\n"
+                              "           [-n] [-F faults] [-S storage] image\n"
+                              "                                 Flash an image on the simulator (-n: plan only)" },
+  { "dump",     cmd_dump,     "[-c chip] [-P profile] [-b base] [-r|-a|-R region:start:size] [-v] [-d]\n"
+                              "           [-F faults] [-S storage] out\n"
+                              "                                 Dump the simulated flash (or ROM, archive or a\n"
+                              "                                 region range), -v reads it back to verify it,\n"
+                              "                                 -d reads every block twice" },
+  { "unpack",   cmd_unpack,   "[-o prefix] archive   Check (and extract) a cart archive" },
+  { "index",    cmd_index,    "[-f frames] [-S storage]\n"
+                              "                                 Index the simulated card in the frame idle time" },
+};
+
+static void usage() {
+  fprintf(stderr, "Usage: fwtool command [args]\n");
+  for (unsigned i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    fprintf(stderr, "  %-8s %s\n", commands[i].name, commands[i].usage);
+  fprintf(stderr, "Storage spec (simulated SD card): root=DIR,mount=US,open=US,op=US,read=KBPS,\n"
+                  "                                  write=KBPS,block=N,misalign=US\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2)
+    usage();
+
+  for (unsigned i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (!strcmp(argv[1], commands[i].name)) {
+      int ret = commands[i].handler(argc - 1, &argv[1]);
+      if (ret < 0)
+        usage();
+      return ret;
+    }
+  }
+  usage();
+}
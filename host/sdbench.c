@@ -0,0 +1,144 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SD interface benchmark harness.
+//
+// Runs the native SuperCard SD driver (source/scsd.c) against a simulated
+// card: initializes it, reads (and optionally writes) a range of sectors in
+// transfers of a given size, checks every sector against the card contents
+// and reports the modeled throughput. Data errors can be injected to check
+// the CRC checks and retries.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "flashsim.h"
+#include "scsd.h"
+
+static void usage() {
+  fprintf(stderr, "Usage: sdbench [options]\n");
+  fprintf(stderr, "  -m size     Card size in MiB (default 32)\n");
+  fprintf(stderr, "  -H          High capacity card (block addressing)\n");
+  fprintf(stderr, "  -i file     Card contents (random data by default)\n");
+  fprintf(stderr, "  -n size     MiB to transfer (default 4)\n");
+  fprintf(stderr, "  -s count    Sectors per transfer (default 64)\n");
+  fprintf(stderr, "  -w          Also run the write test\n");
+  fprintf(stderr, "  -e ppm      Corrupted data blocks on the bus, per million\n");
+  fprintf(stderr, "  -S seed     Seed for the card contents and the errors\n");
+  exit(1);
+}
+
+static double mib_per_sec(uint64_t bytes, uint64_t ns) {
+  return ns ? bytes / (1024.0 * 1024.0) / (ns / 1e9) : 0;
+}
+
+// Transfers [0, sectors) in runs of chunk sectors, returns false on failure.
+static bool run_transfers(uint8_t *buf, uint32_t sectors, unsigned chunk, bool write) {
+  for (uint32_t s = 0; s < sectors; s += chunk) {
+    unsigned count = sectors - s < chunk ? sectors - s : chunk;
+    uint8_t *p = &buf[(uint64_t)s * SCSD_SECTOR_SIZE];
+    if (!(write ? scsd_write(s, count, p) : scsd_read(s, count, p))) {
+      fprintf(stderr, "%s failed at sector %u\n", write ? "Write" : "Read", s);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  unsigned size_mb = 32, test_mb = 4, chunk = 64, ppm = 0;
+  uint32_t seed = 0;
+  bool hc = false, write = false;
+  const char *imgfn = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:Hi:n:s:we:S:")) != -1) {
+    switch (opt) {
+    case 'm': size_mb = atoi(optarg); break;
+    case 'H': hc = true; break;
+    case 'i': imgfn = optarg; break;
+    case 'n': test_mb = atoi(optarg); break;
+    case 's': chunk = atoi(optarg); break;
+    case 'w': write = true; break;
+    case 'e': ppm = atoi(optarg); break;
+    case 'S': seed = atoi(optarg); break;
+    default:  usage();
+    };
+  }
+  if (!size_mb || !chunk || test_mb > size_mb)
+    usage();
+
+  t_flashsim *sim = flashsim_create(&chipdb[0]);
+  flashsim_select(sim);
+  t_sdsim *sd = sim->sd = sdsim_create(size_mb * 2048, hc);
+  sdsim_set_errors(sd, seed, ppm);
+
+  uint64_t card_bytes = (uint64_t)sd->sectors * SCSD_SECTOR_SIZE;
+  if (imgfn) {
+    unsigned isize;
+    uint8_t *img = load_file(imgfn, &isize);
+    if (!img || isize > card_bytes) {
+      fprintf(stderr, "Could not load %s (or bigger than the card)\n", imgfn);
+      return 1;
+    }
+    memcpy(sd->data, img, isize);
+    free(img);
+  } else {
+    srand(seed);
+    for (uint64_t i = 0; i < card_bytes; i++)
+      sd->data[i] = rand();
+  }
+
+  uint64_t t0 = sim->now_ns;
+  if (!scsd_init()) {
+    fprintf(stderr, "Card initialization failed\n");
+    return 2;
+  }
+  printf("Card: %u sectors (%s), init %.1f ms\n", scsd_sectors(),
+         hc ? "high capacity" : "standard capacity", (sim->now_ns - t0) / 1e6);
+  if (scsd_sectors() != sd->sectors) {
+    fprintf(stderr, "Wrong card size (expected %u sectors)\n", sd->sectors);
+    return 2;
+  }
+
+  uint32_t sectors = test_mb * 2048;
+  uint64_t bytes = (uint64_t)sectors * SCSD_SECTOR_SIZE;
+  uint8_t *buf = (uint8_t*)malloc(bytes);
+  bool ok = true;
+
+  t0 = sim->now_ns;
+  ok = run_transfers(buf, sectors, chunk, false);
+  uint64_t read_ns = sim->now_ns - t0;
+  if (ok && memcmp(buf, sd->data, bytes)) {
+    fprintf(stderr, "Read data mismatch\n");
+    ok = false;
+  }
+  printf("Read:  %u sectors in runs of %u, %.1f ms (%.2f MiB/s)\n",
+         sectors, chunk, read_ns / 1e6, mib_per_sec(bytes, read_ns));
+
+  if (ok && write) {
+    for (uint64_t i = 0; i < bytes; i++)
+      buf[i] = rand();
+    t0 = sim->now_ns;
+    ok = run_transfers(buf, sectors, chunk, true);
+    uint64_t write_ns = sim->now_ns - t0;
+    if (ok && memcmp(buf, sd->data, bytes)) {
+      fprintf(stderr, "Written data mismatch\n");
+      ok = false;
+    }
+    printf("Write: %u sectors in runs of %u, %.1f ms (%.2f MiB/s)\n",
+           sectors, chunk, write_ns / 1e6, mib_per_sec(bytes, write_ns));
+  }
+
+  printf("%llu commands (%llu dropped), %llu blocks read, %llu blocks written, %llu corrupted: %s\n",
+         (unsigned long long)sd->stats.commands, (unsigned long long)sd->stats.bad_commands,
+         (unsigned long long)sd->stats.blocks_read, (unsigned long long)sd->stats.blocks_written,
+         (unsigned long long)sd->stats.corrupted, ok ? "ok" : "FAIL");
+
+  free(buf);
+  sdsim_destroy(sd);
+  flashsim_destroy(sim);
+  return ok ? 0 : 2;
+}
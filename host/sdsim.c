@@ -0,0 +1,393 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SD card simulator, see sdsim.h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdsim.h"
+
+// Card states (as reported in the R1 status)
+enum { SD_IDLE, SD_READY, SD_IDENT, SD_STBY, SD_TRAN, SD_DATA, SD_RCV, SD_PRG };
+
+// DAT lines state
+enum { DAT_IDLE, DAT_READ_WAIT, DAT_READ, DAT_WRITE_WAIT, DAT_WRITE, DAT_TOKEN, DAT_BUSY };
+
+#define BLOCK_SIZE      512
+#define CRC_NIBBLES     16
+
+#define ST_OUT_OF_RANGE   0x80000000
+#define ST_ILLEGAL_CMD    0x00400000
+#define ST_READY_DATA     0x00000100
+#define ST_APP_CMD        0x00000020
+
+#define TOKEN_ACCEPTED    0x05      // Start bit, 010, end bit
+#define TOKEN_CRC_ERROR   0x0B      // Start bit, 101, end bit
+
+// DAT lines as seen in bits 8..11 of the data register.
+#define DAT_LINES(v)      ((uint16_t)((v) << 8))
+
+t_sdsim *sdsim_create(uint32_t sectors, bool hc) {
+  t_sdsim *sd = (t_sdsim*)calloc(1, sizeof(t_sdsim));
+  sd->data = (uint8_t*)calloc(sectors, BLOCK_SIZE);
+  sd->sectors = sectors;
+  sd->hc = hc;
+  sd->access_ns = 200000;
+  sd->next_block_ns = 10000;
+  sd->program_ns = 250000;
+  sd->init_polls = 4;
+  return sd;
+}
+
+void sdsim_destroy(t_sdsim *sd) {
+  free(sd->data);
+  free(sd);
+}
+
+void sdsim_set_errors(t_sdsim *sd, uint32_t seed, unsigned ppm) {
+  sd->rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+  sd->error_ppm = ppm;
+}
+
+// xorshift64*, same as the flash simulator.
+static uint64_t rng_next(t_sdsim *sd) {
+  sd->rng ^= sd->rng >> 12;
+  sd->rng ^= sd->rng << 25;
+  sd->rng ^= sd->rng >> 27;
+  return sd->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static bool corrupt_block(t_sdsim *sd) {
+  if (!sd->error_ppm || (rng_next(sd) % 1000000) >= sd->error_ppm)
+    return false;
+  unsigned bit = rng_next(sd) % (BLOCK_SIZE * 8);
+  sd->block[bit / 8] ^= 1 << (bit % 8);
+  sd->stats.corrupted++;
+  return true;
+}
+
+static uint8_t crc7(const uint8_t *data, unsigned size) {
+  uint8_t crc = 0;
+  for (unsigned i = 0; i < size * 8; i++) {
+    unsigned bit = (data[i / 8] >> (7 - i % 8)) & 1;
+    bool fb = bit != (crc >> 6);
+    crc = ((crc << 1) & 0x7F) ^ (fb ? 0x09 : 0);
+  }
+  return crc;
+}
+
+// Per line CRC16 of the block data, appended after it as it goes on the bus.
+static void block_crc(uint8_t *block) {
+  uint16_t crc[4] = {0};
+  for (unsigned n = 0; n < BLOCK_SIZE * 2; n++) {
+    unsigned nibble = (block[n / 2] >> ((n & 1) ? 0 : 4)) & 0xF;
+    for (unsigned l = 0; l < 4; l++) {
+      bool fb = ((nibble >> l) & 1) != (crc[l] >> 15);
+      crc[l] = (crc[l] << 1) ^ (fb ? 0x1021 : 0);
+    }
+  }
+  memset(&block[BLOCK_SIZE], 0, CRC_NIBBLES / 2);
+  for (unsigned n = 0; n < CRC_NIBBLES; n++)
+    for (unsigned l = 0; l < 4; l++)
+      if ((crc[l] >> (15 - n)) & 1)
+        block[BLOCK_SIZE + n / 2] |= (1 << l) << ((n & 1) ? 0 : 4);
+}
+
+// Sets bits msb..lsb of a 128 bit register (CID/CSD byte order).
+static void reg_set(uint8_t *reg, unsigned msb, unsigned lsb, uint32_t value) {
+  for (unsigned b = lsb; b <= msb; b++, value >>= 1)
+    if (value & 1)
+      reg[15 - b / 8] |= 1 << (b % 8);
+}
+
+static void respond(t_sdsim *sd, const uint8_t *resp, unsigned size) {
+  memcpy(sd->resp, resp, size);
+  sd->resp_bits = size * 8;
+  sd->resp_pos = 0;
+  sd->resp_delay = 2;       // Ncr
+}
+
+static void respond_r1(t_sdsim *sd, unsigned cmd, uint32_t value) {
+  uint8_t resp[6] = { cmd, value >> 24, value >> 16, value >> 8, value, 0 };
+  resp[5] = (crc7(resp, 5) << 1) | 1;
+  respond(sd, resp, sizeof(resp));
+}
+
+static uint32_t card_status(const t_sdsim *sd, unsigned state) {
+  return (state << 9) | ST_READY_DATA | (sd->app_cmd ? ST_APP_CMD : 0);
+}
+
+// Responds with the CID or CSD register.
+static void respond_r2(t_sdsim *sd, bool csd) {
+  uint8_t reg[16] = {0};
+  if (!csd) {
+    memcpy(&reg[1], "SFSIMCARD", 9);
+    reg_set(reg, 55, 24, 0x5CD00001);     // Serial number
+  }
+  else if (sd->hc) {
+    reg_set(reg, 127, 126, 1);
+    reg_set(reg, 83, 80, 9);
+    reg_set(reg, 69, 48, sd->sectors / 1024 - 1);
+  }
+  else {
+    reg_set(reg, 83, 80, 9);
+    reg_set(reg, 73, 62, sd->sectors / 512 - 1);
+    reg_set(reg, 49, 47, 7);
+  }
+  reg[15] = (crc7(reg, 15) << 1) | 1;
+
+  uint8_t resp[17] = { 0x3F };
+  memcpy(&resp[1], reg, sizeof(reg));
+  respond(sd, resp, sizeof(resp));
+}
+
+static void start_read(t_sdsim *sd, uint64_t when) {
+  sd->dat = DAT_READ_WAIT;
+  sd->ready_at = when;
+}
+
+static void process_cmd(t_sdsim *sd, uint64_t now_ns) {
+  unsigned cmd = sd->cmd[0] & 0x3F;
+  uint32_t arg = ((uint32_t)sd->cmd[1] << 24) | (sd->cmd[2] << 16) | (sd->cmd[3] << 8) | sd->cmd[4];
+  if ((sd->cmd[0] & 0xC0) != 0x40 || !(sd->cmd[5] & 1) || (sd->cmd[5] >> 1) != crc7(sd->cmd, 5)) {
+    sd->stats.bad_commands++;
+    return;
+  }
+  sd->stats.commands++;
+
+  bool app = sd->app_cmd;
+  sd->app_cmd = false;
+  unsigned state = sd->state;
+  uint32_t status = card_status(sd, state);
+  bool selected = (arg >> 16) == sd->rca;
+  uint32_t addr = sd->hc ? arg : arg / BLOCK_SIZE;
+
+  if (app && cmd == 41 && state == SD_IDLE) {
+    uint32_t ocr = 0x00FF8000;
+    if (++sd->acmd41_count >= sd->init_polls) {
+      ocr |= 0x80000000 | ((sd->hc && (arg & 0x40000000)) ? 0x40000000 : 0);
+      sd->state = SD_READY;
+    }
+    uint8_t resp[6] = { 0x3F, ocr >> 24, ocr >> 16, ocr >> 8, ocr, 0xFF };
+    respond(sd, resp, sizeof(resp));
+    return;
+  }
+  if (app && cmd == 6 && state == SD_TRAN) {
+    sd->wide = (arg & 3) == 2;
+    respond_r1(sd, cmd, status);
+    return;
+  }
+
+  switch (cmd) {
+  case 0:
+    sd->state = SD_IDLE;
+    sd->dat = DAT_IDLE;
+    sd->rca = 0;
+    sd->wide = false;
+    sd->acmd41_count = 0;
+    break;
+  case 8:
+    if (state == SD_IDLE)
+      respond_r1(sd, cmd, arg & 0xFFF);
+    break;
+  case 55:
+    if (state <= SD_IDENT || selected) {
+      sd->app_cmd = true;
+      respond_r1(sd, cmd, card_status(sd, state));
+    }
+    break;
+  case 2:
+    if (state == SD_READY) {
+      sd->state = SD_IDENT;
+      respond_r2(sd, false);
+    }
+    break;
+  case 3:
+    if (state == SD_IDENT || state == SD_STBY) {
+      sd->rca = 0xB368;
+      sd->state = SD_STBY;
+      uint8_t resp[6] = { cmd, sd->rca >> 8, sd->rca, (status >> 8) & 0xFF, status & 0xFF, 0 };
+      resp[5] = (crc7(resp, 5) << 1) | 1;
+      respond(sd, resp, sizeof(resp));
+    }
+    break;
+  case 9:
+    if (state == SD_STBY && selected)
+      respond_r2(sd, true);
+    break;
+  case 7:
+    if (state == SD_STBY && selected) {
+      sd->state = SD_TRAN;
+      respond_r1(sd, cmd, status);
+    }
+    else if (!selected && state == SD_TRAN)
+      sd->state = SD_STBY;
+    break;
+  case 13:
+    if (selected)
+      respond_r1(sd, cmd, status);
+    break;
+  case 16:
+    if (state == SD_TRAN)
+      respond_r1(sd, cmd, status | (arg != BLOCK_SIZE ? ST_ILLEGAL_CMD : 0));
+    break;
+  case 17:
+  case 18:
+  case 24:
+  case 25:
+    if (state != SD_TRAN || !sd->wide)
+      respond_r1(sd, cmd, status | ST_ILLEGAL_CMD);
+    else if (addr >= sd->sectors)
+      respond_r1(sd, cmd, status | ST_OUT_OF_RANGE);
+    else {
+      sd->addr = addr;
+      sd->multi = cmd == 18 || cmd == 25;
+      if (cmd == 17 || cmd == 18) {
+        sd->state = SD_DATA;
+        start_read(sd, now_ns + sd->access_ns);
+      }
+      else {
+        sd->state = SD_RCV;
+        sd->dat = DAT_WRITE_WAIT;
+      }
+      respond_r1(sd, cmd, status);
+    }
+    break;
+  case 12:
+    if (state == SD_DATA || state == SD_RCV) {
+      // Blocks being programmed keep the card busy (then it goes back to
+      // the transfer state).
+      sd->multi = false;
+      if (sd->dat != DAT_BUSY && sd->dat != DAT_TOKEN) {
+        sd->dat = DAT_IDLE;
+        sd->state = SD_TRAN;
+      }
+      respond_r1(sd, cmd, status);
+    }
+    break;
+  default:
+    break;
+  };
+}
+
+uint16_t sdsim_cmd_read(t_sdsim *sd) {
+  if (sd->resp_pos >= sd->resp_bits)
+    return 1;
+  if (sd->resp_delay) {
+    sd->resp_delay--;
+    return 1;
+  }
+  unsigned pos = sd->resp_pos++;
+  return (sd->resp[pos / 8] >> (7 - pos % 8)) & 1;
+}
+
+void sdsim_cmd_write(t_sdsim *sd, uint64_t now_ns, uint16_t value) {
+  unsigned bit = (value >> 7) & 1;
+  if (!sd->cmd_bits) {
+    if (bit)
+      return;        // Idle line, waiting for a start bit
+    memset(sd->cmd, 0, sizeof(sd->cmd));
+    sd->resp_pos = sd->resp_bits;
+  }
+  sd->cmd[sd->cmd_bits / 8] |= bit << (7 - sd->cmd_bits % 8);
+  if (++sd->cmd_bits == 48) {
+    sd->cmd_bits = 0;
+    process_cmd(sd, now_ns);
+  }
+}
+
+// Block (and card state) transitions once a block was transferred.
+static void block_done(t_sdsim *sd, uint64_t now_ns) {
+  if (sd->multi && sd->addr + 1 < sd->sectors) {
+    sd->addr++;
+    if (sd->state == SD_DATA)
+      start_read(sd, now_ns + sd->next_block_ns);
+    else
+      sd->dat = DAT_WRITE_WAIT;
+    return;
+  }
+  sd->dat = DAT_IDLE;
+  // Multi-block transfers wait for CMD12.
+  if (!sd->multi)
+    sd->state = SD_TRAN;
+}
+
+uint16_t sdsim_data_read(t_sdsim *sd, uint64_t now_ns) {
+  switch (sd->dat) {
+  case DAT_READ_WAIT:
+    if (now_ns < sd->ready_at)
+      return DAT_LINES(0xF);
+    memcpy(sd->block, &sd->data[(uint64_t)sd->addr * BLOCK_SIZE], BLOCK_SIZE);
+    block_crc(sd->block);
+    corrupt_block(sd);
+    sd->dat = DAT_READ;
+    sd->pos = 0;
+    return DAT_LINES(0);        // Start bit
+  case DAT_READ:
+    sd->shift = (sd->shift << 8) | sd->block[sd->pos++];
+    if (sd->pos == sizeof(sd->block)) {
+      sd->stats.blocks_read++;
+      block_done(sd, now_ns);
+    }
+    return sd->shift;
+  case DAT_TOKEN:
+    {
+      unsigned bit = (sd->token >> (4 - sd->token_pos)) & 1;
+      if (++sd->token_pos == 5) {
+        if (sd->token == TOKEN_ACCEPTED) {
+          sd->dat = DAT_BUSY;
+          sd->ready_at = now_ns + sd->program_ns;
+        }
+        else
+          block_done(sd, now_ns);
+      }
+      return DAT_LINES(0xE | bit);
+    }
+  case DAT_BUSY:
+    if (now_ns < sd->ready_at)
+      return DAT_LINES(0xE);
+    if (sd->state == SD_RCV)
+      block_done(sd, now_ns);
+    else {
+      sd->dat = DAT_IDLE;       // Stopped while programming
+      sd->state = SD_TRAN;
+    }
+    return DAT_LINES(0xF);
+  default:
+    return DAT_LINES(0xF);
+  };
+}
+
+void sdsim_data_write(t_sdsim *sd, uint64_t now_ns, uint16_t value) {
+  for (int n = 3; n >= 0; n--) {
+    unsigned nibble = (value >> (n * 4)) & 0xF;
+    if (sd->dat == DAT_WRITE_WAIT) {
+      if (!(nibble & 1)) {
+        sd->dat = DAT_WRITE;
+        sd->pos = 0;
+        memset(sd->block, 0, sizeof(sd->block));
+      }
+    }
+    else if (sd->dat == DAT_WRITE) {
+      if (sd->pos < sizeof(sd->block) * 2) {
+        sd->block[sd->pos / 2] |= nibble << ((sd->pos & 1) ? 0 : 4);
+        sd->pos++;
+        continue;
+      }
+
+      // End bit: check the data CRC and answer with the status token.
+      uint8_t crc[CRC_NIBBLES / 2];
+      memcpy(crc, &sd->block[BLOCK_SIZE], sizeof(crc));
+      corrupt_block(sd);
+      block_crc(sd->block);
+      bool ok = (nibble & 1) && !memcmp(crc, &sd->block[BLOCK_SIZE], sizeof(crc));
+      if (ok) {
+        memcpy(&sd->data[(uint64_t)sd->addr * BLOCK_SIZE], sd->block, BLOCK_SIZE);
+        sd->stats.blocks_written++;
+      }
+      sd->token = ok ? TOKEN_ACCEPTED : TOKEN_CRC_ERROR;
+      sd->token_pos = 0;
+      sd->dat = DAT_TOKEN;
+    }
+  }
+}
@@ -0,0 +1,80 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SD card simulator, behind the SuperCard SD interface (see source/scsd.h).
+//
+// Models the card side of the bus one clock at a time, as the interface
+// registers drive it: command framing (CRC7 checked, commands with a bad CRC
+// get no response), the card states for the identification sequence (CMD0,
+// CMD8, ACMD41, CMD2, CMD3, CMD9, CMD7, ACMD6 and CMD16) and single/multiple
+// block transfers (CMD17/18/24/25, stopped with CMD12) on the 4 bit bus, with
+// per line CRC16, CRC status tokens and busy signalling. Read access and
+// programming times are modeled in simulated time.
+//
+// Data blocks can be corrupted on the bus (both ways), derived from a seed,
+// to exercise the CRC checks and retries.
+
+#ifndef _SDSIM_H_
+#define _SDSIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+  uint64_t commands;
+  uint64_t bad_commands;        // Commands dropped (CRC/framing errors)
+  uint64_t blocks_read, blocks_written;
+  uint64_t corrupted;           // Injected data block errors
+} t_sdsim_stats;
+
+typedef struct t_sdsim {
+  uint8_t *data;
+  uint32_t sectors;
+  bool hc;                      // High capacity (block addressed) card
+
+  // Timings
+  uint64_t access_ns;           // First block of a read
+  uint64_t next_block_ns;       // Following blocks of a multi-block read
+  uint64_t program_ns;          // Busy time per written block
+  unsigned init_polls;          // ACMD41 polls until the card is ready
+
+  unsigned error_ppm;           // Corrupted data blocks, per million
+  uint64_t rng;
+
+  // Card state
+  unsigned state;
+  uint16_t rca;
+  bool app_cmd, wide;
+  unsigned acmd41_count;
+
+  // CMD line
+  uint8_t cmd[6];
+  unsigned cmd_bits;
+  uint8_t resp[17];
+  unsigned resp_bits, resp_pos, resp_delay;
+
+  // DAT lines
+  unsigned dat;
+  bool multi;
+  uint32_t addr;                // Current sector
+  uint64_t ready_at;            // Next block start / end of busy
+  uint8_t block[512 + 8];       // Data and CRC
+  unsigned pos;                 // Bytes (reads) or nibbles (writes) transferred
+  uint16_t shift;
+  uint8_t token;
+  unsigned token_pos;
+
+  t_sdsim_stats stats;
+} t_sdsim;
+
+// Creates a blank (zero filled) card, high capacity cards use the v2 CSD.
+t_sdsim *sdsim_create(uint32_t sectors, bool hc);
+void sdsim_destroy(t_sdsim *sd);
+void sdsim_set_errors(t_sdsim *sd, uint32_t seed, unsigned ppm);
+
+// One clock per access, see the register model in scsd.h.
+uint16_t sdsim_cmd_read(t_sdsim *sd);
+void sdsim_cmd_write(t_sdsim *sd, uint64_t now_ns, uint16_t value);
+uint16_t sdsim_data_read(t_sdsim *sd, uint64_t now_ns);
+void sdsim_data_write(t_sdsim *sd, uint64_t now_ns, uint16_t value);
+
+#endif
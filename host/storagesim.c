@@ -0,0 +1,263 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SD card storage simulator, see storagesim.h
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flashsim.h"
+#include "storagesim.h"
+
+// Rough numbers for a DLDI SD driver on a DS.
+const t_storagecfg storagesim_defaults = {
+  .root = ".",
+  .mount_us = 250000,
+  .open_us = 5000,
+  .op_us = 400,
+  .read_kbps = 2000,
+  .write_kbps = 1000,
+  .block = 512,
+  .misalign_us = 300,
+};
+
+struct t_storage_file {
+  FILE *fd;
+  long pos;
+  bool write;
+};
+
+static t_storagecfg cfg = storagesim_defaults;
+static __thread t_storagestats stats;
+
+void storagesim_config(const t_storagecfg *c) {
+  cfg = *c;
+}
+
+bool storagesim_parse(const char *spec, t_storagecfg *c) {
+  char tmp[512];
+  snprintf(tmp, sizeof(tmp), "%s", spec);
+  *c = storagesim_defaults;
+
+  for (char *tok = strtok(tmp, ","); tok; tok = strtok(NULL, ",")) {
+    char *val = strchr(tok, '=');
+    if (!val)
+      return false;
+    *val++ = 0;
+
+    if (!strcmp(tok, "root"))
+      snprintf(c->root, sizeof(c->root), "%s", val);
+    else if (!strcmp(tok, "mount"))
+      c->mount_us = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "open"))
+      c->open_us = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "op"))
+      c->op_us = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "read"))
+      c->read_kbps = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "write"))
+      c->write_kbps = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "block"))
+      c->block = strtoul(val, NULL, 0);
+    else if (!strcmp(tok, "misalign"))
+      c->misalign_us = strtoul(val, NULL, 0);
+    else
+      return false;
+  }
+  return c->block != 0;
+}
+
+const t_storagestats *storagesim_stats() {
+  return &stats;
+}
+
+void storagesim_reset_stats() {
+  memset(&stats, 0, sizeof(stats));
+}
+
+static void spend(uint64_t ns) {
+  stats.busy_ns += ns;
+  flashsim_advance(ns);
+}
+
+// Time spent transferring a chunk at a given file position.
+static void transfer(long pos, unsigned size, unsigned kbps) {
+  uint64_t ns = cfg.op_us * 1000ULL;
+  if (kbps)
+    ns += size * 1000000000ULL / (kbps * 1024ULL);
+  if (pos % cfg.block || size % cfg.block) {
+    stats.misaligned++;
+    ns += cfg.misalign_us * 1000ULL;
+  }
+  spend(ns);
+}
+
+bool storage_mount() {
+  if (!stats.mounted) {
+    stats.mounted = true;
+    spend(cfg.mount_us * 1000ULL);
+  }
+  return true;
+}
+
+static unsigned target = STORAGE_DLDI;
+
+// The simulated card stands for either of them.
+bool storage_select(unsigned t) {
+  if (stats.mounted)
+    return t == target;
+  target = t;
+  return true;
+}
+
+unsigned storage_target() {
+  return target;
+}
+
+bool storage_is_slot2() {
+  return target == STORAGE_SLOT2;
+}
+
+// Maps "fat:/" paths to the root directory.
+static void host_path(char *fn, unsigned maxlen, const char *path) {
+  const char *sep = strstr(path, ":/");
+  if (sep)
+    snprintf(fn, maxlen, "%s/%s", cfg.root, sep + 2);
+  else
+    snprintf(fn, maxlen, "%s", path);
+}
+
+t_sfile *storage_open(const char *path, const char *mode) {
+  storage_mount();
+
+  char fn[1024];
+  host_path(fn, sizeof(fn), path);
+
+  FILE *fd = fopen(fn, mode);
+  if (!fd)
+    return NULL;
+
+  stats.opens++;
+  spend(cfg.open_us * 1000ULL);
+
+  t_sfile *ret = (t_sfile*)malloc(sizeof(t_sfile));
+  ret->fd = fd;
+  ret->pos = 0;
+  ret->write = strchr(mode, 'w') || strchr(mode, 'a');
+  return ret;
+}
+
+unsigned storage_read(t_sfile *fd, void *buf, unsigned size) {
+  unsigned ret = fread(buf, 1, size, fd->fd);
+  stats.reads++;
+  stats.bytes_read += ret;
+  transfer(fd->pos, size, cfg.read_kbps);
+  fd->pos += ret;
+  return ret;
+}
+
+unsigned storage_write(t_sfile *fd, const void *buf, unsigned size) {
+  unsigned ret = fwrite(buf, 1, size, fd->fd);
+  stats.writes++;
+  stats.bytes_written += ret;
+  transfer(fd->pos, size, cfg.write_kbps);
+  fd->pos += ret;
+  return ret;
+}
+
+bool storage_seek(t_sfile *fd, uint32_t offset) {
+  if (fseek(fd->fd, offset, SEEK_SET))
+    return false;
+  fd->pos = offset;
+  spend(cfg.op_us * 1000ULL);
+  return true;
+}
+
+long storage_size(t_sfile *fd) {
+  long cur = ftell(fd->fd);
+  if (fseek(fd->fd, 0, SEEK_END))
+    return -1;
+  long ret = ftell(fd->fd);
+  fseek(fd->fd, cur, SEEK_SET);
+  return ret;
+}
+
+bool storage_flush(t_sfile *fd) {
+  // Same cost as the directory entry and FAT update on close.
+  spend(cfg.open_us * 1000ULL);
+  return !fflush(fd->fd);
+}
+
+bool storage_close(t_sfile *fd) {
+  // Writers update the directory entry and the FAT on close.
+  if (fd->write)
+    spend(cfg.open_us * 1000ULL);
+  bool ok = !fclose(fd->fd);
+  free(fd);
+  return ok;
+}
+
+// Directory operations are charged as one command each.
+t_sdir *storage_opendir(const char *path) {
+  storage_mount();
+
+  char fn[1024];
+  host_path(fn, sizeof(fn), path);
+  spend(cfg.op_us * 1000ULL);
+  return (t_sdir*)opendir(fn);
+}
+
+bool storage_readdir(t_sdir *dir, char *name, unsigned maxlen, bool *isdir) {
+  struct dirent *cur = readdir((DIR*)dir);
+  spend(cfg.op_us * 1000ULL);
+  if (!cur)
+    return false;
+
+  snprintf(name, maxlen, "%s", cur->d_name);
+  *isdir = cur->d_type == DT_DIR;
+  return true;
+}
+
+void storage_closedir(t_sdir *dir) {
+  closedir((DIR*)dir);
+}
+
+bool storage_stat(const char *path, uint32_t *size, uint32_t *mtime) {
+  storage_mount();
+
+  char fn[1024];
+  host_path(fn, sizeof(fn), path);
+  spend(cfg.op_us * 1000ULL);
+
+  struct stat st;
+  if (stat(fn, &st))
+    return false;
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+  return true;
+}
+
+// Directory entry updates, charged like an open.
+bool storage_rename(const char *from, const char *to) {
+  storage_mount();
+
+  char ffn[1024], tfn[1024];
+  host_path(ffn, sizeof(ffn), from);
+  host_path(tfn, sizeof(tfn), to);
+  spend(cfg.open_us * 1000ULL);
+  // FAT renames do not replace an existing file.
+  struct stat st;
+  return stat(tfn, &st) && !rename(ffn, tfn);
+}
+
+bool storage_remove(const char *path) {
+  storage_mount();
+
+  char fn[1024];
+  host_path(fn, sizeof(fn), path);
+  spend(cfg.open_us * 1000ULL);
+  return !unlink(fn);
+}
@@ -0,0 +1,48 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SD card (libfat/DLDI) storage simulator for the host tools.
+//
+// Provides the storage_* primitives used by the shared code in source/,
+// mapping "fat:/" paths to a host directory. Every operation advances the
+// selected flash simulator clock by a modeled SD card time: the mount time
+// (on first access), a fixed cost per open/close and per read/write call, a throughput limit and a penalty for
+// accesses that are not aligned to the card block size.
+
+#ifndef _STORAGESIM_H_
+#define _STORAGESIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "storage.h"
+
+typedef struct {
+  char root[256];               // Host directory mapped to "fat:/"
+  unsigned mount_us;            // Mount time (on first access)
+  unsigned open_us;             // Per open/close (directory lookup, FAT update)
+  unsigned op_us;               // Per read/write call (command overhead)
+  unsigned read_kbps;           // Read throughput in KiB/s (0: unlimited)
+  unsigned write_kbps;          // Write throughput in KiB/s (0: unlimited)
+  unsigned block;               // Card block size
+  unsigned misalign_us;         // Extra cost of an unaligned access
+} t_storagecfg;
+
+typedef struct {
+  bool mounted;
+  uint64_t opens, reads, writes;
+  uint64_t bytes_read, bytes_written;
+  uint64_t misaligned;          // Accesses not aligned to the block size
+  uint64_t busy_ns;             // Modeled storage time
+} t_storagestats;
+
+extern const t_storagecfg storagesim_defaults;
+
+// Sets the configuration (shared by all threads, stats are per thread).
+void storagesim_config(const t_storagecfg *cfg);
+// Parses a spec like "root=out,mount=200000,op=500,read=2000,write=1000,block=512,misalign=300"
+// on top of the defaults.
+bool storagesim_parse(const char *spec, t_storagecfg *cfg);
+const t_storagestats *storagesim_stats();
+void storagesim_reset_stats();
+
+#endif
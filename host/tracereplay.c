@@ -0,0 +1,187 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Bus trace replay tool.
+//
+// Replays a bus trace captured on the NDS (see source/trace.h) against the
+// flash simulator, following the recorded timestamps. Reports the reads that
+// returned something different from what the real cart returned and, for
+// every traced operation, the recorded duration versus the chip busy time
+// modeled by the simulator.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "flashsim.h"
+#include "trace.h"
+
+#define MAX_REPORTED  20
+
+static void usage() {
+  fprintf(stderr, "Usage: tracereplay [-c chip] [-i flash.bin] [-v] trace.bin\n");
+  fprintf(stderr, "  -c chip   Simulated chip (name or hex ID), defaults to %s\n", chipdb[0].name);
+  fprintf(stderr, "  -i file   Initial flash contents\n");
+  fprintf(stderr, "  -v        Print every event\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const t_flash_chip *chip = &chipdb[0];
+  const char *imgfn = NULL;
+  bool verbose = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:i:v")) != -1) {
+    switch (opt) {
+    case 'c':
+      if (!(chip = parse_chip(optarg))) {
+        fprintf(stderr, "Unknown chip %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'i': imgfn = optarg; break;
+    case 'v': verbose = true; break;
+    default:  usage();
+    };
+  }
+  if (optind + 1 != argc)
+    usage();
+
+  unsigned tsize;
+  uint8_t *tdata = load_file(argv[optind], &tsize);
+  const t_trace_header *hdr = (t_trace_header*)tdata;
+  if (!tdata || tsize < sizeof(*hdr) || hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION ||
+      tsize < sizeof(*hdr) + hdr->count * sizeof(t_trace_entry)) {
+    fprintf(stderr, "Could not load a valid trace from %s\n", argv[optind]);
+    return 1;
+  }
+  const t_trace_entry *ev = (t_trace_entry*)&tdata[sizeof(*hdr)];
+
+  t_flashsim *sim = flashsim_create(chip);
+  flashsim_select(sim);
+  if (imgfn) {
+    unsigned isize;
+    uint8_t *img = load_file(imgfn, &isize);
+    if (!img) {
+      fprintf(stderr, "Could not load %s\n", imgfn);
+      return 1;
+    }
+    flashsim_load(sim, img, isize);
+    free(img);
+  }
+
+  printf("Replaying %u events (%u dropped) against %s\n", hdr->count, hdr->dropped, chip->name);
+
+  // Recorded timestamps, converted to (accumulated) nanoseconds.
+  uint64_t *ev_ns = (uint64_t*)malloc((hdr->count + 1) * sizeof(uint64_t));
+  uint64_t acc = 0;
+  for (unsigned i = 0; i < hdr->count; i++) {
+    if (i)
+      acc += (uint64_t)(uint32_t)(ev[i].ts - ev[i-1].ts) * 1000000000ULL / hdr->tick_rate;
+    ev_ns[i] = acc;
+  }
+  ev_ns[hdr->count] = acc;
+
+  unsigned mismatches = 0, op_mismatches = 0;
+  unsigned cur_op = TRACE_OP_END;
+  uint64_t op_start = 0, op_busy = 0;
+  uint16_t *blockbuf = NULL;
+
+  for (unsigned i = 0; i < hdr->count; i++) {
+    const t_trace_entry *e = &ev[i];
+    uint32_t waddr = TRACE_ADDR(e);
+
+    if (sim->now_ns < ev_ns[i])
+      sim->now_ns = ev_ns[i];
+
+    if (verbose)
+      printf("%12.3f us  type %u addr %06x value %04x repeat %u\n",
+             ev_ns[i] / 1000.0, TRACE_TYPE(e), waddr, e->value, e->repeat);
+
+    switch (TRACE_TYPE(e)) {
+    case TRACE_MODE:
+      // The event holds the mode register address, the magic comes from the
+      // simulated cart profile.
+      slot2_raw_write16(waddr, sim->profile->mode_magic);
+      slot2_raw_write16(waddr, sim->profile->mode_magic);
+      slot2_raw_write16(waddr, e->value);
+      slot2_raw_write16(waddr, e->value);
+      break;
+    case TRACE_WRITE:
+      slot2_raw_write16(waddr, e->value);
+      break;
+    case TRACE_READ:
+      {
+        // Merged reads are spread evenly, the last one right before the next event.
+        unsigned n = e->repeat + 1;
+        uint64_t step = n > 1 ? (ev_ns[i+1] - ev_ns[i]) / (n - 1) : 0;
+        uint16_t value = 0;
+        bool busy = false;
+        for (unsigned j = 0; j < n; j++) {
+          if (sim->now_ns < ev_ns[i] + j * step)
+            sim->now_ns = ev_ns[i] + j * step;
+          busy = flashsim_busy(sim);
+          value = slot2_raw_read16(waddr);
+        }
+        // The toggle bit phase is not reproducible, ignore it for status reads.
+        uint16_t mask = busy ? ~0x40 : 0xFFFF;
+        if ((value & mask) != (e->value & mask)) {
+          if (mismatches < MAX_REPORTED)
+            printf("Read mismatch at %.3f us (event %u): addr %06x, cart %04x, simulator %04x\n",
+                   ev_ns[i] / 1000.0, i, waddr, e->value, value);
+          mismatches++;
+          op_mismatches++;
+        }
+      }
+      break;
+    case TRACE_BLOCK_READ:
+      {
+        uint32_t count = e->value | (e->repeat << 16);
+        blockbuf = (uint16_t*)realloc(blockbuf, count * 2 + 2);
+        slot2_raw_read(blockbuf, waddr * 2, count * 2);
+      }
+      break;
+    case TRACE_BLOCK_WRITE:
+      {
+        // The data is not traced, only the bus time matters.
+        uint32_t count = e->value | (e->repeat << 16);
+        blockbuf = (uint16_t*)realloc(blockbuf, count * 2 + 2);
+        memset(blockbuf, 0, count * 2);
+        slot2_raw_write(waddr * 2, blockbuf, count * 2);
+      }
+      break;
+    case TRACE_TIMING:
+      slot2_raw_set_timing(e->value);
+      break;
+    case TRACE_MARK:
+      if (e->value == TRACE_OP_END) {
+        if (cur_op != TRACE_OP_END)
+          printf("%-12s recorded %10.3f ms, modeled chip busy %10.3f ms, %u read mismatches\n",
+                 trace_op_names[cur_op], (ev_ns[i] - op_start) / 1e6,
+                 (sim->stats.busy_ns - op_busy) / 1e6, op_mismatches);
+        cur_op = TRACE_OP_END;
+      } else if (e->value < TRACE_OP_COUNT) {
+        cur_op = e->value;
+        op_start = ev_ns[i];
+        op_busy = sim->stats.busy_ns;
+        op_mismatches = 0;
+      }
+      break;
+    };
+  }
+
+  printf("Recorded duration: %.3f ms, replay duration: %.3f ms\n", acc / 1e6, sim->now_ns / 1e6);
+  printf("Bus reads: %llu, writes: %llu, block words: %llu, programs: %llu, erases: %llu\n",
+         (unsigned long long)sim->stats.reads, (unsigned long long)sim->stats.writes,
+         (unsigned long long)sim->stats.block_words, (unsigned long long)sim->stats.programs,
+         (unsigned long long)sim->stats.erases);
+  printf("%u read mismatches\n", mismatches);
+
+  free(blockbuf);
+  free(ev_ns);
+  free(tdata);
+  flashsim_destroy(sim);
+  return mismatches ? 2 : 0;
+}
@@ -0,0 +1,77 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Static memory arena, see arena.h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define ALIGN_UP(x)   (((x) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+// The host tools run several simulations in parallel, one arena per thread.
+#ifdef SUPERFW_HOST
+  #define ARENA_TLS  __thread
+#else
+  #define ARENA_TLS
+#endif
+
+static ARENA_TLS uint8_t iobuf_mem[IOBUF_COUNT][IOBUF_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+static ARENA_TLS uint8_t scratch_mem[SCRATCH_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+
+static ARENA_TLS unsigned iobuf_used = 0;      // Bitmap of buffers in use
+static ARENA_TLS unsigned scratch_top = 0;     // Next free byte
+static ARENA_TLS unsigned scratch_last = 0;    // Offset of the last allocation
+
+void *iobuf_get() {
+  for (unsigned i = 0; i < IOBUF_COUNT; i++) {
+    if (!(iobuf_used & (1 << i))) {
+      iobuf_used |= (1 << i);
+      return iobuf_mem[i];
+    }
+  }
+  return NULL;
+}
+
+void iobuf_put(void *buf) {
+  // Anything that is not one of the pool buffers (NULL included) is ignored.
+  uintptr_t off = (uintptr_t)buf - (uintptr_t)&iobuf_mem[0][0];
+  if (off >= sizeof(iobuf_mem) || off % IOBUF_SIZE)
+    return;
+  iobuf_used &= ~(1 << (off / IOBUF_SIZE));
+}
+
+void *scratch_alloc(unsigned size) {
+  if (size > SCRATCH_SIZE - scratch_top)
+    return NULL;
+
+  scratch_last = scratch_top;
+  scratch_top = ALIGN_UP(scratch_top + size);
+  if (scratch_top > SCRATCH_SIZE)
+    scratch_top = SCRATCH_SIZE;
+  return &scratch_mem[scratch_last];
+}
+
+void *scratch_extend(void *ptr, unsigned newsize) {
+  // Only the last allocation can be resized.
+  if ((uint8_t*)ptr != &scratch_mem[scratch_last] || scratch_top == scratch_last)
+    return NULL;
+  if (newsize > SCRATCH_SIZE - scratch_last)
+    return NULL;
+
+  scratch_top = ALIGN_UP(scratch_last + newsize);
+  if (scratch_top > SCRATCH_SIZE)
+    scratch_top = SCRATCH_SIZE;
+  return ptr;
+}
+
+unsigned scratch_mark() {
+  return scratch_top;
+}
+
+void scratch_release(unsigned mark) {
+  if (mark < scratch_top) {
+    scratch_top = mark;
+    scratch_last = mark;
+  }
+}
@@ -0,0 +1,36 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Static memory arena.
+//
+// All the big buffers used by the tool live in a single static arena, so that
+// the (small) DS heap is never fragmented by dump/flash operations. The arena
+// is split in two parts:
+//  - A pool of fixed size I/O buffers, aligned to the cache line size so that
+//    they can be used as DMA targets directly.
+//  - A scratch bump allocator, for per-operation temporaries (firmware images,
+//    directory listings...). Allocations are released in LIFO order by going
+//    back to a previously taken mark.
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stdint.h>
+
+#define ARENA_ALIGN            32          // ARM946E-S cache line size
+#define IOBUF_SIZE     (128*1024)
+#define IOBUF_COUNT             4
+#define SCRATCH_SIZE  (1536*1024)
+
+// I/O buffer pool. Returns NULL if all buffers are in use.
+void *iobuf_get();
+void iobuf_put(void *buf);
+
+// Scratch allocator. Returns NULL if there is not enough space left.
+void *scratch_alloc(unsigned size);
+// Grows (or shrinks) the last allocation in place. Returns NULL on failure.
+void *scratch_extend(void *ptr, unsigned newsize);
+// Current allocation point, used to release everything allocated after it.
+unsigned scratch_mark();
+void scratch_release(unsigned mark);
+
+#endif
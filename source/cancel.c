@@ -0,0 +1,61 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Cancellation of long operations, see cancel.h
+
+#include <string.h>
+#include <time.h>
+
+#include "cancel.h"
+#include "platform.h"
+#include "storage.h"
+
+static bool (*check_fn)() = NULL;
+static bool cancelled = false;
+
+void cancel_set_check(bool (*fn)()) {
+  check_fn = fn;
+}
+
+bool cancel_requested() {
+  if (!cancelled && check_fn)
+    cancelled = check_fn();
+  return cancelled;
+}
+
+bool cancel_reset() {
+  bool ret = cancelled;
+  cancelled = false;
+  return ret;
+}
+
+void resume_save(const t_resume *r) {
+  t_sfile *fd = storage_open(RESUME_FILE, "wb");
+  if (fd) {
+    storage_write(fd, r, sizeof(*r));
+    storage_close(fd);
+  }
+}
+
+bool resume_load(t_resume *r) {
+  t_sfile *fd = storage_open(RESUME_FILE, "rb");
+  if (!fd)
+    return false;
+  bool ok = storage_read(fd, r, sizeof(*r)) == sizeof(*r);
+  storage_close(fd);
+  return ok && r->op != OP_NONE;
+}
+
+void resume_clear(uint32_t op, const char *path) {
+  t_resume r;
+  if (resume_load(&r) && r.op == op && !strncmp(r.path, path, sizeof(r.path) - 1)) {
+    memset(&r, 0, sizeof(r));
+    resume_save(&r);
+  }
+}
+
+uint32_t resume_session() {
+  static uint32_t session = 0;
+  while (!session)
+    session = (uint32_t)time(NULL) ^ (platform_ticks() << 12);
+  return session;
+}
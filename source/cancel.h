@@ -0,0 +1,52 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Cancellation of long operations.
+//
+// The UI installs a check function (ie. "is B held?") that the long running
+// operations (dumps, flashing) call at every chunk. Cancelled operations
+// restore the cart state and close their files, flash and ROM dumps also
+// save a resume record with how far they got. The record lives on the card
+// across power cycles and cart swaps, so it also identifies the cart and the
+// boot session (the SDRAM contents are lost on power off).
+
+#ifndef _CANCEL_H_
+#define _CANCEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RESUME_FILE        "fat:/sc_resume.bin"
+#define RESUME_PATH_MAX    160
+
+// Operations
+#define OP_NONE            0
+#define OP_FLASH_DUMP      1
+#define OP_ROM_DUMP        2
+
+typedef struct {
+  uint32_t op;
+  uint32_t done, total;         // Bytes
+  char path[RESUME_PATH_MAX];   // Output file
+  uint32_t flash_id;            // Cart identity: flash ID and header CRC
+  uint32_t header_crc;
+  uint32_t session;             // See resume_session()
+  uint32_t last_crc;            // CRC of the last committed chunk
+} t_resume;
+
+// Sets the check function (NULL disables cancellation).
+void cancel_set_check(bool (*fn)());
+// Checkpoint, returns true if the operation must stop. Once true it stays
+// so until cancel_reset is called, which returns whether it was cancelled.
+bool cancel_requested();
+bool cancel_reset();
+
+// Saves/loads the resume record (a single one is kept). Loading returns false
+// if there is none.
+void resume_save(const t_resume *r);
+bool resume_load(t_resume *r);
+// Drops the record if it is the one for op and path (others are kept).
+void resume_clear(uint32_t op, const char *path);
+// Boot session identifier (RTC time and ticks at the first call).
+uint32_t resume_session();
+
+#endif
@@ -0,0 +1,41 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Cart profiles, see cartprof.h
+
+#include <strings.h>
+
+#include "cartprof.h"
+#include "flash.h"
+#include "slot2.h"
+
+// The host tools run a simulated cart per thread.
+#ifdef SUPERFW_HOST
+  #define CARTPROF_TLS  __thread
+#else
+  #define CARTPROF_TLS
+#endif
+
+const t_cart_profile cart_profiles[] = {
+  { "SuperCard", CART_WIRING_SUPERCARD, SLOT2_MODE_WADDR, 0xA55A, FLASH_FW_SIZE, SLOT2_ROM_SIZE, SLOT2_SRAM_SIZE },
+  // Same mode register protocol, flash address lines wired in order.
+  { "Generic",   CART_WIRING_STRAIGHT,  SLOT2_MODE_WADDR, 0xA55A, FLASH_FW_SIZE, SLOT2_ROM_SIZE, SLOT2_SRAM_SIZE },
+};
+
+const unsigned cart_profile_count = sizeof(cart_profiles) / sizeof(cart_profiles[0]);
+
+static CARTPROF_TLS const t_cart_profile *current = &cart_profiles[0];
+
+const t_cart_profile *cart_profile_lookup(const char *name) {
+  for (unsigned i = 0; i < cart_profile_count; i++)
+    if (!strcasecmp(cart_profiles[i].name, name))
+      return &cart_profiles[i];
+  return NULL;
+}
+
+const t_cart_profile *cart_profile() {
+  return current;
+}
+
+void cart_set_profile(const t_cart_profile *prof) {
+  current = prof;
+}
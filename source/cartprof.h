@@ -0,0 +1,56 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Cart profiles: how each supported SuperCard variant is wired and switched
+// (flash address wiring, mode register protocol and memory windows).
+//
+// The profile is picked at runtime once the cart is identified (see
+// cart_detect in flash.h). The per-word flash paths are compiled once per
+// wiring, so that the address permutation is folded into them instead of
+// being dispatched on every access.
+
+#ifndef _CARTPROF_H_
+#define _CARTPROF_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Flash address wirings
+#define CART_WIRING_SUPERCARD   0     // The 9 LSB of the word address are permuted
+#define CART_WIRING_STRAIGHT    1     // Address lines connected in order
+
+typedef struct {
+  const char *name;
+  unsigned wiring;               // CART_WIRING_*
+  uint32_t mode_waddr;           // Mode register (word address in the ROM space)
+  uint16_t mode_magic;           // Written twice before the mode value (twice)
+  uint32_t fw_size;              // Firmware flash size, up to FLASH_FW_SIZE
+  uint32_t sdram_size;           // SDRAM (ROM space) window
+  uint32_t sram_size;            // Save SRAM window
+} t_cart_profile;
+
+extern const t_cart_profile cart_profiles[];
+extern const unsigned cart_profile_count;
+
+const t_cart_profile *cart_profile_lookup(const char *name);
+
+// Currently selected profile (the first one until another one is set).
+const t_cart_profile *cart_profile();
+void cart_set_profile(const t_cart_profile *prof);
+
+// Maps a flash word address to the bus word address that reaches it. Meant to
+// be called with a constant wiring, so that it folds into a few shifts.
+static inline uint32_t cart_wire_addr(unsigned wiring, uint32_t addr) {
+  if (wiring == CART_WIRING_STRAIGHT)
+    return addr;
+  return (addr & 0xFFFFFE02) |
+         ((addr & 0x001) << 7) |
+         ((addr & 0x004) << 4) |
+         ((addr & 0x008) << 2) |
+         ((addr & 0x010) >> 4) |
+         ((addr & 0x020) >> 3) |
+         ((addr & 0x040) << 2) |
+         ((addr & 0x080) >> 3) |
+         ((addr & 0x100) >> 5);
+}
+
+#endif
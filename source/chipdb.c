@@ -0,0 +1,66 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Flash chip database, see chipdb.h
+// Timings are typical datasheet values, worst case can be an order of
+// magnitude slower.
+
+#include <stddef.h>
+
+#include "chipdb.h"
+
+#define TOP_BOOT_4M     { {7, 64*1024}, {1, 32*1024}, {2, 8*1024}, {1, 16*1024} }
+#define BOTTOM_BOOT_4M  { {1, 16*1024}, {2, 8*1024}, {1, 32*1024}, {7, 64*1024} }
+
+const t_flash_chip chipdb[] = {
+  { 0x00C222B9, "MX29LV400T",  512*1024, CHIP_FLAG_UNLOCK_BYPASS, 0, TOP_BOOT_4M,    11, 0,  700,  4000 },
+  { 0x00C222BA, "MX29LV400B",  512*1024, CHIP_FLAG_UNLOCK_BYPASS, 0, BOTTOM_BOOT_4M, 11, 0,  700,  4000 },
+  { 0x000122B9, "AM29LV400BT", 512*1024, CHIP_FLAG_UNLOCK_BYPASS, 0, TOP_BOOT_4M,     9, 0,  700, 11000 },
+  { 0x000122BA, "AM29LV400BB", 512*1024, CHIP_FLAG_UNLOCK_BYPASS, 0, BOTTOM_BOOT_4M,  9, 0,  700, 11000 },
+  { 0x000422B9, "MBM29LV400TC", 512*1024, CHIP_FLAG_UNLOCK_BYPASS, 0, TOP_BOOT_4M,   16, 0, 1000,  8000 },
+  { 0x000422BA, "MBM29LV400BC", 512*1024, CHIP_FLAG_UNLOCK_BYPASS, 0, BOTTOM_BOOT_4M, 16, 0, 1000,  8000 },
+  { 0x0001227E, "S29GL032N",  4*1024*1024, CHIP_FLAG_UNLOCK_BYPASS | CHIP_FLAG_WRITE_BUFFER, 16,
+    { {64, 64*1024} },                                                                60, 240, 500, 32000 },
+};
+
+const unsigned chipdb_count = sizeof(chipdb) / sizeof(chipdb[0]);
+
+const t_flash_chip *chipdb_lookup(uint32_t id) {
+  for (unsigned i = 0; i < chipdb_count; i++)
+    if (chipdb[i].id == id)
+      return &chipdb[i];
+  return NULL;
+}
+
+unsigned chip_sector_count(const t_flash_chip *chip) {
+  unsigned ret = 0;
+  for (unsigned i = 0; i < 4; i++)
+    ret += chip->regions[i].count;
+  return ret;
+}
+
+bool chip_sector(const t_flash_chip *chip, unsigned idx, uint32_t *start, uint32_t *size) {
+  uint32_t offset = 0;
+  for (unsigned i = 0; i < 4; i++) {
+    if (idx < chip->regions[i].count) {
+      *start = offset + idx * chip->regions[i].size;
+      *size = chip->regions[i].size;
+      return true;
+    }
+    idx -= chip->regions[i].count;
+    offset += chip->regions[i].count * chip->regions[i].size;
+  }
+  return false;
+}
+
+int chip_sector_at(const t_flash_chip *chip, uint32_t offset) {
+  uint32_t start = 0;
+  int idx = 0;
+  for (unsigned i = 0; i < 4; i++) {
+    uint32_t regsize = chip->regions[i].count * chip->regions[i].size;
+    if (offset < start + regsize)
+      return idx + (offset - start) / chip->regions[i].size;
+    start += regsize;
+    idx += chip->regions[i].count;
+  }
+  return -1;
+}
@@ -0,0 +1,44 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Flash chip database: geometry, capabilities and typical timings of the
+// (AMD command set compatible) flash chips found on SuperCard carts.
+
+#ifndef _CHIPDB_H_
+#define _CHIPDB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CHIP_FLAG_UNLOCK_BYPASS   0x1     // Supports the 0x20 unlock bypass mode
+#define CHIP_FLAG_WRITE_BUFFER    0x2     // Supports 0x25/0x29 buffered programming
+
+typedef struct {
+  uint16_t count;        // Number of sectors
+  uint32_t size;         // Sector size (in bytes)
+} t_sector_region;
+
+typedef struct {
+  uint32_t id;                   // (manufacturer << 16) | device, as flash_ident()
+  const char *name;
+  uint32_t size;                 // Chip size in bytes
+  unsigned flags;
+  unsigned wbuf_words;           // Write buffer size (CHIP_FLAG_WRITE_BUFFER)
+  t_sector_region regions[4];    // Sector layout, from address zero up
+  // Typical timings
+  unsigned word_prog_us;
+  unsigned buf_prog_us;
+  unsigned sector_erase_ms;
+  unsigned chip_erase_ms;
+} t_flash_chip;
+
+extern const t_flash_chip chipdb[];
+extern const unsigned chipdb_count;
+
+const t_flash_chip *chipdb_lookup(uint32_t id);
+unsigned chip_sector_count(const t_flash_chip *chip);
+// Returns the start offset and size of the sector with index idx.
+bool chip_sector(const t_flash_chip *chip, unsigned idx, uint32_t *start, uint32_t *size);
+// Returns the index of the sector containing the offset (or -1).
+int chip_sector_at(const t_flash_chip *chip, uint32_t offset);
+
+#endif
@@ -0,0 +1,31 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// CRC32 implementation, see crc32.h
+
+#include <stdbool.h>
+
+#include "crc32.h"
+
+static uint32_t crc_table[256];
+static bool table_ready = false;
+
+static void build_table() {
+  for (unsigned i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (unsigned j = 0; j < 8; j++)
+      c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+    crc_table[i] = c;
+  }
+  table_ready = true;
+}
+
+uint32_t crc32(uint32_t crc, const void *data, unsigned length) {
+  if (!table_ready)
+    build_table();
+
+  const uint8_t *p = (const uint8_t*)data;
+  crc = ~crc;
+  for (unsigned i = 0; i < length; i++)
+    crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
@@ -0,0 +1,13 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// CRC32 (IEEE 802.3, as in zlib), table driven.
+
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <stdint.h>
+
+// Updates a running CRC (start with zero).
+uint32_t crc32(uint32_t crc, const void *data, unsigned length);
+
+#endif
@@ -0,0 +1,394 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Flash and ROM dumps, see dump.h
+
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "cancel.h"
+#include "crc32.h"
+#include "dump.h"
+#include "flash.h"
+#include "sha256.h"
+#include "slot2.h"
+#include "storage.h"
+#include "trace.h"
+
+// Chunks are read back this many chunks behind the one being written.
+#define VERIFY_LAG   2
+
+// Header bytes in the cart identity of resume records.
+#define RESUME_SIG_SIZE   0xC0
+
+// Dual read: block size and reads before giving up on an unstable block.
+#define DUAL_BLOCK        4096
+#define DUAL_MAX_READS    8
+
+bool dump_verify = false;
+bool dump_dual_read = false;
+uint32_t dump_rereads = 0;
+
+// Dump writer. Regions are read straight into the free space of a single
+// staging buffer, which is only written once full. This way the card always
+// gets big aligned writes, also across the (small) SRAM region.
+//
+// With verification enabled, the CRC of every chunk is taken from the bus
+// data before writing it, and the chunk is read back from the file (through
+// a second handle) once the writer is VERIFY_LAG chunks ahead. The file is
+// flushed before every read back so that the second handle sees it, but the
+// data might still come from the filesystem sector cache: this checks the
+// write path (buffers, cluster chain and file size), not the card media.
+//
+// Dumps can be appended to an existing (partial) file, base being its size.
+typedef struct {
+  const char *filename;
+  t_sfile *fd, *rfd;
+  uint8_t *buf, *vbuf;
+  uint8_t *dbuf;                // Dual read block
+  unsigned smark;
+  unsigned fill;
+  uint32_t base, offset;        // Initial file size, bytes committed so far
+  bool ok, cancelled;
+
+  // Chunks written but not verified yet (ring indexed by chunk number)
+  unsigned written, verified;
+  uint32_t crc[VERIFY_LAG + 1];
+  unsigned csize[VERIFY_LAG + 1];
+} t_writer;
+
+// Opens the output file, or appends to it when resuming (from offset).
+static bool writer_open(t_writer *w, const char *filename, uint32_t offset) {
+  memset(w, 0, sizeof(*w));
+  w->filename = filename;
+  w->base = w->offset = offset;
+  w->ok = true;
+  w->smark = scratch_mark();
+  w->buf = (uint8_t*)iobuf_get();
+  if (dump_verify)
+    w->vbuf = (uint8_t*)iobuf_get();
+  if (dump_dual_read)
+    w->dbuf = (uint8_t*)scratch_alloc(DUAL_BLOCK);
+  dump_rereads = 0;
+  if (w->buf && (!dump_verify || w->vbuf) && (!dump_dual_read || w->dbuf) &&
+      (w->fd = storage_open(filename, offset ? "ab" : "wb")))
+    return true;
+
+  iobuf_put(w->buf);
+  iobuf_put(w->vbuf);
+  scratch_release(w->smark);
+  return false;
+}
+
+// The read back handle starts at the first byte written by this writer.
+static bool open_readback(t_writer *w) {
+  w->rfd = storage_open(w->filename, "rb");
+  return w->rfd && (!w->base || storage_seek(w->rfd, w->base));
+}
+
+static void verify_chunk(t_writer *w) {
+  unsigned slot = w->verified++ % (VERIFY_LAG + 1);
+  if (!w->ok)
+    return;
+
+  if (!storage_flush(w->fd) ||
+      (!w->rfd && !open_readback(w)) ||
+      storage_read(w->rfd, w->vbuf, w->csize[slot]) != w->csize[slot] ||
+      crc32(0, w->vbuf, w->csize[slot]) != w->crc[slot])
+    w->ok = false;
+}
+
+static void writer_flush(t_writer *w) {
+  if (!w->fill)
+    return;
+
+  if (dump_verify) {
+    unsigned slot = w->written % (VERIFY_LAG + 1);
+    w->crc[slot] = crc32(0, w->buf, w->fill);
+    w->csize[slot] = w->fill;
+  }
+  if (storage_write(w->fd, w->buf, w->fill) != w->fill)
+    w->ok = false;
+  w->fill = 0;
+  w->written++;
+
+  if (dump_verify && w->written - w->verified > VERIFY_LAG)
+    verify_chunk(w);
+}
+
+static void writer_commit(t_writer *w, t_sha256_ctx *ctx, unsigned size) {
+  if (ctx)
+    sha256_update(ctx, &w->buf[w->fill], size);
+  w->fill += size;
+  w->offset += size;
+  if (w->fill == IOBUF_SIZE)
+    writer_flush(w);
+}
+
+// Flushes and verifies the pending chunks, closes the file.
+static bool writer_close(t_writer *w) {
+  writer_flush(w);
+  while (dump_verify && w->verified < w->written)
+    verify_chunk(w);
+
+  if (w->rfd)
+    storage_close(w->rfd);
+  bool ok = storage_close(w->fd) && w->ok;
+  iobuf_put(w->buf);
+  iobuf_put(w->vbuf);
+  scratch_release(w->smark);
+  return ok;
+}
+
+static void read_flash(uint8_t *dst, uint32_t offset, unsigned size) {
+  flash_read(dst, offset, size);
+}
+
+static void read_sram(uint8_t *dst, uint32_t offset, unsigned size) {
+  bool pmode = slot2_acquire();
+  slot2_slow_timing();
+  for (unsigned i = 0; i < size; i++)
+    dst[i] = slot2_sram_read8(offset + i);
+  slot2_release(pmode);
+}
+
+static void read_sdram(uint8_t *dst, uint32_t offset, unsigned size) {
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_SDRAM, true, false);
+  slot2_read_block(dst, offset, size);
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+}
+
+static const struct {
+  unsigned flag;
+  const char *name;
+  void (*read)(uint8_t *dst, uint32_t offset, unsigned size);
+} archive_regions[ARCHIVE_REGIONS] = {
+  { ARCHIVE_FLASH, "flash", read_flash },
+  { ARCHIVE_SRAM,  "sram",  read_sram },
+  { ARCHIVE_SDRAM, "sdram", read_sdram },
+};
+
+// Region sizes depend on the cart profile.
+static uint32_t region_size(unsigned idx) {
+  const t_cart_profile *prof = cart_profile();
+  switch (archive_regions[idx].flag) {
+  case ARCHIVE_FLASH:
+    return prof->fw_size;
+  case ARCHIVE_SRAM:
+    return prof->sram_size;
+  default:
+    return prof->sdram_size;
+  };
+}
+
+// Reads every block of a chunk again (with the slowest bus timing) and
+// compares the CRCs of both reads. Blocks that differ are read again until
+// any CRC comes up twice (errors are intermittent, a good read can be
+// followed by a bad one), keeping the data of a read with that CRC. Returns
+// false if no two reads agree.
+static bool dual_read(t_writer *w, unsigned idx, uint8_t *data, uint32_t offset, unsigned size) {
+  uint32_t crcs[DUAL_MAX_READS];
+  for (unsigned boff = 0; boff < size; boff += DUAL_BLOCK) {
+    unsigned bsize = size - boff < DUAL_BLOCK ? size - boff : DUAL_BLOCK;
+    crcs[0] = crc32(0, &data[boff], bsize);   // The data holds this read
+    for (unsigned reads = 1; ; reads++) {
+      if (reads == DUAL_MAX_READS)
+        return false;
+      if (reads > 1)
+        dump_rereads++;
+
+      bool pmode = slot2_acquire();
+      slot2_slow_timing();
+      archive_regions[idx].read(w->dbuf, offset + boff, bsize);
+      slot2_release(pmode);
+
+      uint32_t rcrc = crc32(0, w->dbuf, bsize);
+      unsigned match = 0;
+      while (match < reads && crcs[match] != rcrc)
+        match++;
+      if (match < reads) {
+        if (match)
+          memcpy(&data[boff], w->dbuf, bsize);
+        break;
+      }
+      crcs[reads] = rcrc;
+    }
+  }
+  return true;
+}
+
+// Streams a region range [start, end) into the writer, and its hash if ctx
+// is not NULL. Checks for cancellation before every chunk.
+static void write_region(t_writer *w, unsigned idx, t_sha256_ctx *ctx, uint32_t start, uint32_t end) {
+  for (uint32_t off = start; off < end && w->ok; ) {
+    if (cancel_requested()) {
+      w->cancelled = true;
+      break;
+    }
+    unsigned csize = IOBUF_SIZE - w->fill;
+    if (csize > end - off)
+      csize = end - off;
+    archive_regions[idx].read(&w->buf[w->fill], off, csize);
+    if (dump_dual_read && !dual_read(w, idx, &w->buf[w->fill], off, csize)) {
+      w->ok = false;
+      break;
+    }
+    writer_commit(w, ctx, csize);
+    off += csize;
+  }
+}
+
+// Fills the cart identity of a resume record: flash ID and header CRC, boot
+// session and the CRC of the last committed chunk (read from the source
+// region, the file holds the same data). Returns false if it cannot be read.
+static bool resume_ident(t_resume *r, unsigned idx) {
+  uint8_t *buf = (uint8_t*)iobuf_get();
+  if (!buf)
+    return false;
+  r->flash_id = flash_ident();
+  read_flash(buf, 0, RESUME_SIG_SIZE);
+  r->header_crc = crc32(0, buf, RESUME_SIG_SIZE);
+  r->session = resume_session();
+  r->last_crc = 0;
+  if (r->done) {
+    archive_regions[idx].read(buf, r->done - IOBUF_SIZE, IOBUF_SIZE);
+    r->last_crc = crc32(0, buf, IOBUF_SIZE);
+  }
+  iobuf_put(buf);
+  return true;
+}
+
+// Dumps a region starting at a given offset (appending to the file if not
+// zero). Cancelled dumps save a resume record with the committed size.
+static bool dump_region(const char *filename, unsigned idx, uint32_t op, uint32_t start) {
+  t_writer w;
+  if (!writer_open(&w, filename, start))
+    return false;
+
+  trace_mark(TRACE_OP_DUMP);
+  write_region(&w, idx, NULL, start, region_size(idx));
+  trace_mark(TRACE_OP_END);
+
+  bool ok = writer_close(&w);
+  t_resume r;
+  memset(&r, 0, sizeof(r));
+  r.op = op;
+  r.done = w.offset;
+  r.total = region_size(idx);
+  strncpy(r.path, filename, sizeof(r.path) - 1);
+  if (ok && w.cancelled && resume_ident(&r, idx))
+    resume_save(&r);
+  else
+    resume_clear(op, filename);
+  return ok && !w.cancelled;
+}
+
+bool flash_dump(const char *filename) {
+  return dump_region(filename, 0, OP_FLASH_DUMP, 0);
+}
+
+bool rom_dump(const char *filename) {
+  return dump_region(filename, 2, OP_ROM_DUMP, 0);
+}
+
+bool range_dump(const char *filename, unsigned region, uint32_t start,
+                uint32_t size, uint8_t *sha256) {
+  unsigned idx = 0;
+  while (idx < ARCHIVE_REGIONS && archive_regions[idx].flag != region)
+    idx++;
+  if (idx == ARCHIVE_REGIONS || !size || start >= region_size(idx) ||
+      size > region_size(idx) - start)
+    return false;
+
+  t_writer w;
+  if (!writer_open(&w, filename, 0))
+    return false;
+
+  t_sha256_ctx ctx;
+  sha256_init(&ctx);
+  trace_mark(TRACE_OP_DUMP);
+  write_region(&w, idx, &ctx, start, start + size);
+  trace_mark(TRACE_OP_END);
+  if (sha256)
+    sha256_final(&ctx, sha256);
+
+  return writer_close(&w) && !w.cancelled;
+}
+
+static unsigned resume_region(const t_resume *r) {
+  return r->op == OP_FLASH_DUMP ? 0 : r->op == OP_ROM_DUMP ? 2 : ARCHIVE_REGIONS;
+}
+
+bool dump_resumable(const t_resume *r) {
+  unsigned idx = resume_region(r);
+  if (idx == ARCHIVE_REGIONS)
+    return false;
+
+  // The file must be exactly as it was left (and chunk aligned), and the cart
+  // the same one (and boot, for the SDRAM), with the last committed chunk
+  // still holding the same data. Otherwise the record is dropped so that the
+  // next dump starts over.
+  t_resume cur = *r;
+  uint32_t size, mtime;
+  bool ok = r->done < r->total && r->total == region_size(idx) &&
+            storage_stat(r->path, &size, &mtime) && size == r->done && !(size % IOBUF_SIZE) &&
+            resume_ident(&cur, idx) &&
+            cur.flash_id == r->flash_id && cur.header_crc == r->header_crc &&
+            (r->op != OP_ROM_DUMP || cur.session == r->session) &&
+            cur.last_crc == r->last_crc;
+  if (!ok)
+    resume_clear(r->op, r->path);
+  return ok;
+}
+
+bool dump_resume(const t_resume *r) {
+  if (!dump_resumable(r))
+    return false;
+  return dump_region(r->path, resume_region(r), r->op, r->done);
+}
+
+bool cart_archive(const char *filename, unsigned regions) {
+  t_archive_manifest man;
+  memset(&man, 0, sizeof(man));
+  man.magic = ARCHIVE_MAGIC;
+  man.version = ARCHIVE_VERSION;
+  man.flash_id = flash_ident();
+
+  t_writer w;
+  if (!writer_open(&w, filename, 0))
+    return false;
+
+  trace_mark(TRACE_OP_DUMP);
+  for (unsigned i = 0; i < ARCHIVE_REGIONS && w.ok && !w.cancelled; i++) {
+    if (!(regions & archive_regions[i].flag))
+      continue;
+
+    t_archive_region *r = &man.regions[man.count++];
+    strcpy(r->name, archive_regions[i].name);
+    r->offset = w.offset;
+    r->size = region_size(i);
+
+    t_sha256_ctx ctx;
+    sha256_init(&ctx);
+    write_region(&w, i, &ctx, 0, r->size);
+    sha256_final(&ctx, r->sha256);
+  }
+  trace_mark(TRACE_OP_END);
+
+  // The manifest goes through the same buffer, so it usually shares the last
+  // write. Cancelled archives get none, and they leave no resume record (the
+  // hashes would need the regions again): a pending dump one is kept.
+  const uint8_t *mp = (const uint8_t*)&man;
+  for (unsigned off = 0; off < sizeof(man) && w.ok && !w.cancelled; ) {
+    unsigned csize = IOBUF_SIZE - w.fill;
+    if (csize > sizeof(man) - off)
+      csize = sizeof(man) - off;
+    memcpy(&w.buf[w.fill], &mp[off], csize);
+    writer_commit(&w, NULL, csize);
+    off += csize;
+  }
+
+  return writer_close(&w) && !w.cancelled;
+}
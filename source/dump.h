@@ -0,0 +1,75 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Flash and ROM dumps to files, and full cart archives.
+
+#ifndef _DUMP_H_
+#define _DUMP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cancel.h"
+
+// Cart archive: the selected regions back to back (in this order), followed
+// by the manifest (at the very end of the file, since the hashes are only
+// known once everything was written).
+#define ARCHIVE_MAGIC      0x52414353   // "SCAR"
+#define ARCHIVE_VERSION    1
+
+#define ARCHIVE_FLASH      0x1          // Firmware flash
+#define ARCHIVE_SRAM       0x2          // Save SRAM
+#define ARCHIVE_SDRAM      0x4          // SDRAM (ROM area)
+#define ARCHIVE_ALL        0x7
+#define ARCHIVE_REGIONS    3
+
+typedef struct {
+  char name[8];
+  uint32_t offset, size;        // Location in the archive file
+  uint8_t sha256[32];
+} t_archive_region;
+
+typedef struct {
+  uint32_t magic, version;
+  uint32_t flash_id;
+  uint32_t count;               // Valid region entries
+  t_archive_region regions[ARCHIVE_REGIONS];
+} t_archive_manifest;
+
+// Reads every dumped chunk back from the file and checks its CRC against the
+// data read from the cart (the read back lags a couple of chunks behind the
+// writes). A mismatch makes the dump fail. Recently written sectors can be
+// served by the filesystem cache, so card media errors are not caught.
+extern bool dump_verify;
+
+// Reads every block twice (the second time with the slowest bus timing) and
+// compares their CRCs, reading the blocks that differ again until any two
+// reads agree (for carts with dirty contacts). The dump fails if no two of
+// DUAL_MAX_READS reads agree. dump_rereads counts the extra reads of the last
+// dump.
+extern bool dump_dual_read;
+extern uint32_t dump_rereads;
+
+// Dumps check cancel_requested() at every chunk. A cancelled dump returns
+// false, leaving the data dumped so far in the file and a resume record.
+
+// Dumps the firmware flash contents.
+bool flash_dump(const char *filename);
+// Dumps the whole SDRAM (ROM) area.
+bool rom_dump(const char *filename);
+// Dumps size bytes of a region (one of the ARCHIVE_* flags) from start, also
+// returning the sha256 of the data (if sha256 is not NULL). Fails if the
+// range does not fit the region. Cancelled range dumps are not resumable.
+bool range_dump(const char *filename, unsigned region, uint32_t start,
+                uint32_t size, uint8_t *sha256);
+// Checks that a cancelled flash or ROM dump can be continued: same file
+// size, cart (flash ID, header and the data of the last committed chunk) and,
+// for ROM dumps, boot session. Drops the record if not.
+bool dump_resumable(const t_resume *r);
+// Continues a cancelled flash or ROM dump, appending to its file. Returns
+// false if the record is not resumable.
+bool dump_resume(const t_resume *r);
+// Writes the selected regions (ARCHIVE_* mask) and the manifest to a single
+// archive file, in one pass.
+bool cart_archive(const char *filename, unsigned regions);
+
+#endif
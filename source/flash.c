@@ -0,0 +1,922 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SuperCard firmware flash routines. All bus accesses go through slot2.h
+
+#include <string.h>
+
+#include "arena.h"
+#include "cancel.h"
+#include "cartprof.h"
+#include "chipdb.h"
+#include "flash.h"
+#include "platform.h"
+#include "sha256.h"
+#include "slot2.h"
+
+#define MAX(a, b)   ((a) < (b) ? (b) : (a))
+#define MIN(a, b)   ((a) > (b) ? (b) : (a))
+
+// Functions with a wiring argument are instantiated once per wiring (always
+// called with a constant), see cartprof.h
+#define WIRED_INLINE   static inline __attribute__((always_inline))
+
+unsigned flash_write_retries = 2;
+unsigned flash_prog_polls = 32*1024;
+unsigned flash_erase_timeout_ms = 60*1000;
+
+// Per operation block digest cache (dropped by cart_detect). Blocks are
+// small enough to track sector erases precisely, and their digests are only
+// used to skip work (the verification step always reads the flash back).
+#define CACHE_BLOCK      (8*1024)
+#define CACHE_BLOCKS     (FLASH_FW_SIZE / CACHE_BLOCK)
+#define CACHE_SIG_SIZE   0xC0           // Header bytes in the cart signature
+
+// The host tools run a simulated cart per thread.
+#ifdef SUPERFW_HOST
+  #define CACHE_TLS  __thread
+#else
+  #define CACHE_TLS
+#endif
+
+static CACHE_TLS struct {
+  // Cart signature (flash ID and image header)
+  uint32_t flash_id;
+  bool header_valid;
+  uint8_t header[CACHE_SIG_SIZE];
+  // Contents
+  uint64_t block_valid;                 // Bitmap of valid block digests
+  uint64_t block_digest[CACHE_BLOCKS];
+} fcache;
+
+// Bumped whenever the cached contents are dropped (flash plans check it).
+static CACHE_TLS uint32_t cache_gen;
+
+// FNV-1a over 32 bit words (buffers are word aligned), much cheaper than a
+// sha256 on the ARM9.
+static uint64_t block_digest(const uint8_t *data) {
+  const uint32_t *w = (const uint32_t*)data;
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for (unsigned i = 0; i < CACHE_BLOCK / 4; i++) {
+    h ^= w[i];
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+// Drops the cached data for a [start, end) byte range that is about to be
+// erased or programmed.
+static void cache_drop(uint32_t start, uint32_t end) {
+  cache_gen++;
+  if (start < CACHE_SIG_SIZE)
+    fcache.header_valid = false;
+  for (uint32_t b = start / CACHE_BLOCK; b < CACHE_BLOCKS && b * CACHE_BLOCK < end; b++)
+    fcache.block_valid &= ~(1ULL << b);
+}
+
+void flash_cache_invalidate() {
+  cache_gen++;
+  memset(&fcache, 0, sizeof(fcache));
+}
+
+// The flash address bus might be wired with some permutation (see
+// cartprof.h). In general we do not care unless we need to send a specific
+// address or play with sector/page erase. The per-word paths use their
+// wired instance instead.
+static uint32_t addr_perm(uint32_t addr) {
+  return cart_wire_addr(cart_profile()->wiring, addr);
+}
+
+// Waits for an embedded program/erase operation to finish. We rely on Q6
+// toggling, Q5 going high means the chip gave up (the toggle bit is checked
+// one more time, as per the datasheets). Returns false on failure/timeout.
+// Long (erase) operations confirm completion with a second read pair, since
+// nothing else would catch a toggle bit glitch there. Programs are verified by
+// reading the word back.
+static bool flash_wait(unsigned maxpolls, bool longop) {
+  for (unsigned i = 0; i < maxpolls; i++) {
+    if (longop)
+      sleep_1ms();
+    uint16_t st = slot2_read16(0);
+    if (st == slot2_read16(0) && (!longop || slot2_read16(0) == slot2_read16(0)))
+      return true;
+    if (st & 0x20)
+      break;
+  }
+  return (slot2_read16(0) == slot2_read16(0));
+}
+
+WIRED_INLINE void wired_unlock(unsigned wiring) {
+  slot2_write16(cart_wire_addr(wiring, 0x555), 0x00AA);
+  slot2_write16(cart_wire_addr(wiring, 0x2AA), 0x0055);
+}
+
+static void flash_unlock() {
+  wired_unlock(cart_profile()->wiring);
+}
+
+static void chip_erase_issue() {
+  cache_drop(0, FLASH_FW_SIZE);
+  for (unsigned i = 0; i < 32; i++)
+    slot2_write16(0, 0x00F0);            // Reset for a few cycles
+
+  flash_unlock();
+  slot2_write16(addr_perm(0x555), 0x0080); // Erase command
+  flash_unlock();
+  slot2_write16(addr_perm(0x555), 0x0010); // Full chip erase!
+}
+
+static void chip_erase_end() {
+  for (unsigned i = 0; i < 32; i++)
+    slot2_write16(0, 0x00F0);            // Reset for a few cycles
+}
+
+static bool do_chip_erase() {
+  chip_erase_issue();
+  // Wait for the erase operation to finish.
+  bool retok = flash_wait(flash_erase_timeout_ms, true);
+  chip_erase_end();
+  return retok;
+}
+
+// Sector start addresses are not affected by the address permutation.
+static void sector_erase_issue(uint32_t offset, uint32_t size) {
+  cache_drop(offset, offset + size);
+  slot2_write16(0, 0x00F0);
+  flash_unlock();
+  slot2_write16(addr_perm(0x555), 0x0080); // Erase command
+  flash_unlock();
+  slot2_write16(offset / 2, 0x0030);       // Sector erase
+}
+
+// Non-blocking flash_wait for erase operations (a single poll). Returns 1
+// once finished, 0 while busy and -1 on failure or timeout.
+static int erase_poll(uint32_t start_ticks) {
+  uint16_t st = slot2_read16(0);
+  if (st == slot2_read16(0) && slot2_read16(0) == slot2_read16(0))
+    return 1;
+  uint32_t elapsed_ms = (platform_ticks() - start_ticks) / (PLATFORM_TICKS_PER_SEC / 1000);
+  if ((st & 0x20) || elapsed_ms >= flash_erase_timeout_ms)
+    return (slot2_read16(0) == slot2_read16(0)) ? 1 : -1;
+  return 0;
+}
+
+static void bypass_enter() {
+  flash_unlock();
+  slot2_write16(addr_perm(0x555), 0x0020);
+}
+
+static void bypass_exit() {
+  slot2_write16(0, 0x0090);
+  slot2_write16(0, 0x0000);
+}
+
+// Programs a single word, retrying as per the retry policy.
+WIRED_INLINE bool program_word(unsigned wiring, uint32_t waddr, uint16_t value, bool bypass) {
+  for (unsigned t = 0; t <= flash_write_retries; t++) {
+    if (!bypass)
+      wired_unlock(wiring);
+    slot2_write16(cart_wire_addr(wiring, 0x555), 0x00A0); // Program command
+
+    // Perform the actual write operation
+    slot2_write16(waddr, value);
+
+    // It should take less than 1ms usually (in the order of us).
+    bool finished = flash_wait(flash_prog_polls, false);
+
+    if (!bypass)
+      slot2_write16(0, 0x00F0);   // Finish operation or abort.
+    else if (!finished) {
+      slot2_write16(0, 0x00F0);   // Abort, which also leaves bypass mode
+      bypass_enter();
+    }
+
+    // If the polling ended early (or the chip failed) the readback will be
+    // wrong, and the program command is just issued again.
+    if (finished && slot2_read16(waddr) == value)
+      return true;
+  }
+  return false;
+}
+
+// Programs a write buffer page. Pages are contiguous in the chip address
+// space, so the bus addresses are permutated.
+WIRED_INLINE bool program_page(unsigned wiring, uint32_t chip_waddr, const uint16_t *data, unsigned count) {
+  uint32_t sa = cart_wire_addr(wiring, chip_waddr);
+  for (unsigned t = 0; t <= flash_write_retries; t++) {
+    wired_unlock(wiring);
+    slot2_write16(sa, 0x0025);                // Write to buffer
+    slot2_write16(sa, count - 1);
+    for (unsigned i = 0; i < count; i++)
+      slot2_write16(cart_wire_addr(wiring, chip_waddr + i), data[i]);
+    slot2_write16(sa, 0x0029);                // Program buffer
+
+    bool finished = flash_wait(flash_prog_polls, false);
+    slot2_write16(0, 0x00F0);
+
+    bool ok = finished;
+    for (unsigned i = 0; i < count && ok; i++)
+      ok = slot2_read16(cart_wire_addr(wiring, chip_waddr + i)) == data[i];
+    if (ok)
+      return true;
+  }
+  return false;
+}
+
+static inline uint16_t img_word(const uint8_t *buf, uint32_t waddr) {
+  return buf[waddr*2] | (buf[waddr*2+1] << 8);
+}
+
+WIRED_INLINE bool program_range_wired(unsigned wiring, const t_flash_chip *chip, const uint8_t *buf,
+                                      uint32_t start, uint32_t end, const uint8_t *old,
+                                      unsigned method, unsigned opts) {
+  bool sparse = (opts & FLASH_OPT_SPARSE) || old;
+  bool ok = true;
+
+  if (method == FLASH_PROG_BUFFERED && chip && (chip->flags & CHIP_FLAG_WRITE_BUFFER)) {
+    uint16_t data[64];
+    unsigned pwords = MIN(chip->wbuf_words, 64);
+    for (uint32_t cw = start / 2; cw < end / 2 && ok; cw += pwords) {
+      bool skip = true;
+      for (unsigned i = 0; i < pwords; i++) {
+        uint32_t bw = cart_wire_addr(wiring, cw + i);
+        if (bw >= end / 2)
+          data[i] = 0xFFFF;   // Past the end of the range, leave it as is
+        else
+          data[i] = img_word(buf, bw);
+        if (bw < end / 2 && !(sparse && data[i] == (old ? img_word(old, bw - start / 2) : 0xFFFF)))
+          skip = false;
+      }
+      if (!skip)
+        ok = program_page(wiring, cw, data, pwords);
+    }
+    return ok;
+  }
+
+  bool bypass = method == FLASH_PROG_BYPASS && chip && (chip->flags & CHIP_FLAG_UNLOCK_BYPASS);
+  if (bypass)
+    bypass_enter();
+  else
+    slot2_write16(0, 0x00F0);   // Force IDLE
+
+  for (uint32_t w = start / 2; w < end / 2 && ok; w++) {
+    uint16_t value = img_word(buf, w);
+    if (sparse && value == (old ? img_word(old, w - start / 2) : 0xFFFF))
+      continue;
+    ok = program_word(wiring, w, value, bypass);
+  }
+
+  if (bypass)
+    bypass_exit();
+  return ok;
+}
+
+// Programs the [start, end) byte range of the image. Words that match the
+// current contents (if known) are skipped, as well as erased words (0xFFFF)
+// in sparse mode. The current contents (old) are in bus order and relative to
+// the range start.
+static bool program_range(const t_flash_chip *chip, const uint8_t *buf, uint32_t start, uint32_t end,
+                          const uint8_t *old, unsigned method, unsigned opts) {
+  cache_drop(start, end);
+  if (cart_profile()->wiring == CART_WIRING_STRAIGHT)
+    return program_range_wired(CART_WIRING_STRAIGHT, chip, buf, start, end, old, method, opts);
+  return program_range_wired(CART_WIRING_SUPERCARD, chip, buf, start, end, old, method, opts);
+}
+
+uint32_t flash_ident() {
+  trace_mark(TRACE_OP_IDENT);
+
+  // Map the GBA cart into the ARM9, enter flash mode with write enable.
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, true, false);
+
+  slot2_slow_timing();
+  for (unsigned i = 0; i < 32; i++)
+    slot2_write16(0, 0x00F0);            // Reset for a few cycles
+
+  slot2_write16(addr_perm(0x555), 0x00AA);
+  slot2_write16(addr_perm(0x2AA), 0x0055);
+  slot2_write16(addr_perm(0x555), 0x0090);
+
+  uint32_t ret = slot2_read16(addr_perm(0x000)) << 16;
+  ret |= slot2_read16(addr_perm(0x001));
+
+  for (unsigned i = 0; i < 32; i++)
+    slot2_write16(0, 0x00F0);            // Reset for a few cycles
+
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+
+  trace_mark(TRACE_OP_END);
+  return ret;
+}
+
+const t_cart_profile *cart_detect(uint32_t *flash_id) {
+  // Every operation starts by detecting the cart, which might have been
+  // swapped for a lookalike one (same chip and header): nothing cached
+  // before is trusted, whether a known chip answers or not.
+  flash_cache_invalidate();
+  const t_cart_profile *prev = cart_profile();
+  for (int i = -1; i < (int)cart_profile_count; i++) {
+    const t_cart_profile *prof = i < 0 ? prev : &cart_profiles[i];
+    if (i >= 0 && prof == prev)
+      continue;
+
+    cart_set_profile(prof);
+    uint32_t id = flash_ident();
+    if (chipdb_lookup(id)) {
+      if (flash_id)
+        *flash_id = id;
+      return prof;
+    }
+  }
+  cart_set_profile(prev);
+  return NULL;
+}
+
+bool flash_erase() {
+  trace_mark(TRACE_OP_ERASE);
+
+  // Map the GBA cart into the ARM9, enter flash mode with write enable.
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, true, false);
+  slot2_slow_timing();
+
+  bool retok = do_chip_erase();
+
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+
+  trace_mark(TRACE_OP_END);
+  return retok;
+}
+
+bool flash_erase_check() {
+  trace_mark(TRACE_OP_ERASECHK);
+
+  // Map the GBA cart into the ARM9, enter flash mode with write enable.
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, true, false);
+  slot2_slow_timing();
+
+  bool errf = false;
+  for (unsigned i = 0; i < cart_profile()->fw_size; i+= 2) {
+    errf = (slot2_read16(i / 2) != 0xFFFF);
+    if (errf)
+      break;
+  }
+
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+
+  trace_mark(TRACE_OP_END);
+  return errf;
+}
+
+bool flash_write(const uint8_t *buf, unsigned size) {
+  trace_mark(TRACE_OP_WRITE);
+
+  // Map the GBA cart into the ARM9, enter flash mode with write enable.
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, true, false);
+  slot2_slow_timing();
+
+  bool ok = program_range(NULL, buf, 0, size & ~1, NULL, FLASH_PROG_WORD, 0);
+
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+
+  trace_mark(TRACE_OP_END);
+  return ok;
+}
+
+// Time model (planner and job slices): chip datasheet timings plus the bus overhead of every
+// program command and read (measured at the slow cart timing).
+#define PLAN_WORD_BUS_NS     4000    // Regular program: unlock, command, polling, read back
+#define PLAN_BYPASS_BUS_NS   2500
+#define PLAN_PAGE_BUS_NS     1000    // Per write buffer word
+#define PLAN_READ_KBPS       4000
+
+// Flash job state machine. Every step call maps the flash with write access,
+// does work until the time budget runs out (or an erase is in progress) and
+// unmaps it again, so other slot-2 users (ie. the SD card) can run in between.
+// Erases are polled once per step instead of waiting for them. Program slices
+// are sized to the time left, using the typical chip timings.
+#define JOB_PROG_SLICE     1024      // Aligned to the address permutation span
+#define JOB_DEF_WORD_US    60        // Unknown chips (slowest in the database)
+#define JOB_VERIFY_SLICE   (4*1024)
+// Programmed data is read back every window (or sector, for differential
+// updates, since the sector contents buffer is in use until then), so that
+// errors stop the job early and no full read pass is left for the end.
+#define JOB_VERIFY_WINDOW  (64*1024)
+
+enum { ERASING_NONE, ERASING_CHIP, ERASING_SECTOR };
+
+static const char *job_state_names[] = {"erase", "compare", "program", "verify", "done", "failed", "cancelled"};
+
+const char *flash_job_state_name(unsigned state) {
+  return state < sizeof(job_state_names) / sizeof(job_state_names[0]) ? job_state_names[state] : "?";
+}
+
+bool flash_job_start(t_flash_job *job, const t_flash_chip *chip, const uint8_t *buf,
+                     unsigned size, unsigned method, unsigned opts, bool verify) {
+  memset(job, 0, sizeof(*job));
+  // Differential updates need to know the sector layout
+  if ((opts & FLASH_OPT_DIFF) && !chip)
+    return false;
+  // Sector contents (differential updates) or read back buffer (verification)
+  if (((opts & FLASH_OPT_DIFF) || verify) && !(job->tmp = (uint8_t*)iobuf_get()))
+    return false;
+
+  job->chip = chip;
+  job->buf = buf;
+  job->size = size & ~1;
+  job->method = method;
+  job->opts = opts;
+  job->verify = verify;
+  job->state = (opts & FLASH_OPT_DIFF) ? FLASH_JOB_COMPARE : FLASH_JOB_ERASE;
+
+  trace_mark(TRACE_OP_WRITE);
+  return true;
+}
+
+static void job_finish(t_flash_job *job, unsigned state) {
+  if (state != FLASH_JOB_DONE)
+    job->failed_state = job->state;
+  job->state = state;
+  iobuf_put(job->tmp);
+  job->tmp = NULL;
+  trace_mark(TRACE_OP_END);
+}
+
+// The current range is programmed (and verified).
+static void job_range_done(t_flash_job *job) {
+  if (job->opts & FLASH_OPT_DIFF)
+    job->state = FLASH_JOB_COMPARE;    // Next sector
+  else
+    job_finish(job, FLASH_JOB_DONE);
+}
+
+// Differential updates cover the whole firmware area, the flash past the end
+// of the image must be blank (as after a chip erase), otherwise the leftovers
+// of the previous firmware change the flash hash.
+static uint32_t diff_end(const t_flash_chip *chip, uint32_t size) {
+  return MAX(size, MIN(cart_profile()->fw_size, chip->size));
+}
+
+static bool is_blank(const uint8_t *data, uint32_t size) {
+  for (uint32_t i = 0; i < size; i++)
+    if (data[i] != 0xFF)
+      return false;
+  return true;
+}
+
+// Differential updates: checks the next sector, starting its erase and/or
+// program if it does not match the image.
+static void job_compare(t_flash_job *job) {
+  uint32_t sstart, ssize, fend = diff_end(job->chip, job->size);
+  if (job->sector >= chip_sector_count(job->chip) ||
+      !chip_sector(job->chip, job->sector, &sstart, &ssize) || sstart >= fend) {
+    job_finish(job, FLASH_JOB_DONE);
+    return;
+  }
+  uint64_t sbit = 1ULL << job->sector;
+  uint32_t send = MIN(sstart + ssize, fend);
+  job->sector++;
+  job->sstart = job->pos = job->vpos = sstart;
+  job->end = MAX(sstart, MIN(send, job->size));    // Image part (if any)
+
+  // Planned jobs only read the sectors that differ (programming needs them).
+  if (job->planned && !(job->program_mask & sbit))
+    return;
+  slot2_read_block(job->tmp, sstart, send - sstart);
+  bool tail_blank = is_blank(&job->tmp[job->end - sstart], send - job->end);
+  if (!job->planned && tail_blank && !memcmp(job->tmp, &job->buf[sstart], job->end - sstart))
+    return;
+
+  // Sectors are only erased when some bit needs to go from 0 to 1.
+  bool needs_erase = false;
+  if (job->planned)
+    needs_erase = job->erase_mask & sbit;
+  else {
+    needs_erase = !tail_blank;
+    for (uint32_t i = 0; i < job->end - sstart && !needs_erase; i++)
+      needs_erase = (job->tmp[i] & job->buf[sstart + i]) != job->buf[sstart + i];
+  }
+
+  if (needs_erase) {
+    sector_erase_issue(sstart, ssize);
+    job->erasing = ERASING_SECTOR;
+    job->erase_start = platform_ticks();
+    job->state = FLASH_JOB_ERASE;
+    memset(job->tmp, 0xFF, job->end - sstart);
+  }
+  else
+    job->state = FLASH_JOB_PROGRAM;
+}
+
+// Programming time (in ticks) of a slice unit, as per the time model.
+// Buffered programming works on whole permutation spans (pages are contiguous
+// in the chip address space), word programming on single words.
+static uint32_t job_unit(const t_flash_job *job, uint32_t *ticks) {
+  const t_flash_chip *chip = job->chip;
+  uint64_t ns;
+  uint32_t size;
+  if (job->method == FLASH_PROG_BUFFERED && chip && (chip->flags & CHIP_FLAG_WRITE_BUFFER)) {
+    unsigned pwords = MIN(chip->wbuf_words, 64);
+    size = JOB_PROG_SLICE;
+    ns = (uint64_t)(JOB_PROG_SLICE / 2 / pwords) * (chip->buf_prog_us * 1000ULL + pwords * PLAN_PAGE_BUS_NS);
+  } else {
+    bool bypass = job->method == FLASH_PROG_BYPASS && chip && (chip->flags & CHIP_FLAG_UNLOCK_BYPASS);
+    size = 2;
+    ns = (chip ? chip->word_prog_us : JOB_DEF_WORD_US) * 1000ULL +
+         (bypass ? PLAN_BYPASS_BUS_NS : PLAN_WORD_BUS_NS);
+  }
+  *ticks = MAX(1, ns * PLATFORM_TICKS_PER_SEC / 1000000000ULL);
+  return size;
+}
+
+// Programs as many units as fit in the time left (at least one if the step
+// did no other work, so that the job always progresses). Returns false if
+// there was no time for the next unit.
+static bool job_program(t_flash_job *job, uint32_t left, bool first) {
+  uint32_t uticks;
+  uint32_t usize = job_unit(job, &uticks);
+  uint32_t units = MIN(left / uticks, JOB_PROG_SLICE / usize);
+  if (!units) {
+    if (!first)
+      return false;
+    units = 1;
+  }
+  uint32_t slice = MIN(units * usize, job->end - job->pos);
+  const uint8_t *old = (job->opts & FLASH_OPT_DIFF) ? &job->tmp[job->pos - job->sstart] : NULL;
+  if (!program_range(job->chip, job->buf, job->pos, job->pos + slice, old, job->method, job->opts)) {
+    job_finish(job, FLASH_JOB_FAILED);
+    return true;
+  }
+  job->pos += slice;
+  bool window = !(job->opts & FLASH_OPT_DIFF) && job->pos - job->vpos >= JOB_VERIFY_WINDOW;
+  if (job->verify && (window || job->pos >= job->end))
+    job->state = FLASH_JOB_VERIFY;
+  else if (job->pos >= job->end)
+    job_range_done(job);
+  return true;
+}
+
+// Reads back the data programmed since the last verification.
+static void job_verify(t_flash_job *job) {
+  uint32_t slice = MIN(JOB_VERIFY_SLICE, job->pos - job->vpos);
+  slot2_read_block(job->tmp, job->vpos, slice);
+  if (memcmp(job->tmp, &job->buf[job->vpos], slice)) {
+    job_finish(job, FLASH_JOB_FAILED);
+    return;
+  }
+  job->vpos += slice;
+  if (job->vpos < job->pos)
+    return;
+  if (job->pos < job->end)
+    job->state = FLASH_JOB_PROGRAM;
+  else
+    job_range_done(job);
+}
+
+bool flash_job_step(t_flash_job *job, uint32_t budget) {
+  if (job->state >= FLASH_JOB_DONE)
+    return false;
+
+  uint32_t start = platform_ticks();
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, true, false);
+  slot2_slow_timing();
+
+  bool first = true, yield = false;
+  do {
+    if (job->erasing) {
+      int st = erase_poll(job->erase_start);
+      if (!st)
+        break;            // Still erasing, come back later
+      if (job->erasing == ERASING_CHIP)
+        chip_erase_end();
+      else
+        slot2_write16(0, 0x00F0);
+      job->erasing = ERASING_NONE;
+      if (st < 0) {
+        job_finish(job, FLASH_JOB_FAILED);
+        break;
+      }
+      job->state = FLASH_JOB_PROGRAM;
+    }
+
+    if (cancel_requested()) {
+      job_finish(job, FLASH_JOB_CANCELLED);
+      break;
+    }
+
+    switch (job->state) {
+    case FLASH_JOB_ERASE:
+      chip_erase_issue();
+      job->erasing = ERASING_CHIP;
+      job->erase_start = platform_ticks();
+      job->pos = 0;
+      job->end = job->size;
+      break;
+    case FLASH_JOB_COMPARE:
+      job_compare(job);
+      break;
+    case FLASH_JOB_PROGRAM:
+      yield = !job_program(job, budget - (platform_ticks() - start), first);
+      break;
+    case FLASH_JOB_VERIFY:
+      job_verify(job);
+      break;
+    };
+    first = false;
+  } while (!yield && job->state < FLASH_JOB_DONE && platform_ticks() - start < budget);
+
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+  return job->state < FLASH_JOB_DONE;
+}
+
+unsigned flash_job_progress(const t_flash_job *job) {
+  if (job->state == FLASH_JOB_DONE)
+    return 100;
+  unsigned state = job->state > FLASH_JOB_DONE ? job->failed_state : job->state;
+  if (state == FLASH_JOB_ERASE || !job->size)
+    return 0;
+  return MIN(100, (uint64_t)job->pos * 100 / job->size);
+}
+
+bool flash_job_run(t_flash_job *job) {
+  while (flash_job_step(job, FLASH_JOB_NO_LIMIT))
+    if (job->erasing)
+      sleep_1ms();
+  return job->state == FLASH_JOB_DONE;
+}
+
+bool flash_update(const t_flash_chip *chip, const uint8_t *buf, unsigned size,
+                  unsigned method, unsigned opts) {
+  t_flash_job job;
+  return flash_job_start(&job, chip, buf, size, method, opts, false) && flash_job_run(&job);
+}
+
+bool flash_validate(const uint8_t *fwimg, unsigned fwsize) {
+  uint8_t *tmp = (uint8_t*)iobuf_get();
+  if (!tmp)
+    return false;
+
+  trace_mark(TRACE_OP_VALIDATE);
+
+  // Map the GBA cart into the ARM9, enter flash mode with write enable.
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, true, false);
+
+  bool ok = true;
+  for (unsigned off = 0; off < fwsize && ok; off += IOBUF_SIZE) {
+    unsigned csize = MIN(IOBUF_SIZE, fwsize - off);
+    slot2_read_block(tmp, off, csize);
+    ok = !memcmp(&fwimg[off], tmp, csize);
+  }
+
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+
+  trace_mark(TRACE_OP_END);
+  iobuf_put(tmp);
+  return ok;
+}
+
+// Checks the cart signature (flash ID and image header), the cache is dropped
+// if it changed (the cart was swapped). The header is not checked after the
+// first sector was rewritten, it is just read again.
+static void cache_check() {
+  uint32_t id = flash_ident();
+  uint8_t header[CACHE_SIG_SIZE];
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_read_block(header, 0, sizeof(header));
+  slot2_release(pmode);
+
+  if (id != fcache.flash_id ||
+      (fcache.header_valid && memcmp(header, fcache.header, sizeof(header))))
+    flash_cache_invalidate();
+
+  fcache.flash_id = id;
+  fcache.header_valid = true;
+  memcpy(fcache.header, header, sizeof(header));
+}
+
+void flash_read(void *dst, uint32_t offset, unsigned size) {
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_read_block(dst, offset, size);
+  slot2_release(pmode);
+}
+
+bool flash_hash(void *hash, uint8_t *header, unsigned hdrsize) {
+  cache_check();
+  uint8_t *data = (uint8_t*)iobuf_get();
+  if (!data)
+    return false;
+
+  t_sha256_ctx ctx;
+  sha256_init(&ctx);
+  for (unsigned off = 0; off < cart_profile()->fw_size; off += IOBUF_SIZE) {
+    bool pmode = slot2_acquire();
+    set_supercard_mode(MAPPED_FIRMWARE, false, false);
+    slot2_read_block(data, off, IOBUF_SIZE);
+    slot2_release(pmode);
+
+    if (!off && header)
+      memcpy(header, data, hdrsize);
+    sha256_update(&ctx, data, IOBUF_SIZE);
+
+    // The block digests come for free while the data is at hand.
+    for (unsigned b = 0; b < IOBUF_SIZE / CACHE_BLOCK; b++) {
+      unsigned bn = off / CACHE_BLOCK + b;
+      fcache.block_digest[bn] = block_digest(&data[b * CACHE_BLOCK]);
+      fcache.block_valid |= 1ULL << bn;
+    }
+  }
+  iobuf_put(data);
+
+  sha256_final(&ctx, hash);
+  return true;
+}
+
+bool flash_compare(const uint8_t *img, unsigned size) {
+  uint8_t *tmp = (uint8_t*)iobuf_get();
+  if (!tmp)
+    return false;
+
+  cache_check();
+  trace_mark(TRACE_OP_VALIDATE);
+
+  bool ok = true;
+  for (unsigned off = 0; off < size && ok; off += CACHE_BLOCK) {
+    unsigned bn = off / CACHE_BLOCK;
+    unsigned csize = MIN(CACHE_BLOCK, size - off);
+    if (csize == CACHE_BLOCK && (fcache.block_valid & (1ULL << bn))) {
+      ok = block_digest(&img[off]) == fcache.block_digest[bn];
+      continue;
+    }
+
+    bool pmode = slot2_acquire();
+    set_supercard_mode(MAPPED_FIRMWARE, false, false);
+    slot2_read_block(tmp, off, csize);
+    slot2_release(pmode);
+
+    ok = !memcmp(&img[off], tmp, csize);
+    if (csize == CACHE_BLOCK) {
+      fcache.block_digest[bn] = block_digest(tmp);
+      fcache.block_valid |= 1ULL << bn;
+    }
+  }
+
+  trace_mark(TRACE_OP_END);
+  iobuf_put(tmp);
+  return ok;
+}
+
+// Counts the words (and write buffer pages) program_range would program in
+// the [start, end) range, same arguments.
+static void plan_range(t_flash_plan *plan, const uint8_t *buf, uint32_t start, uint32_t end,
+                       const uint8_t *old, bool sparse, unsigned pwords) {
+  for (uint32_t w = start / 2; w < end / 2; w++)
+    if (!(sparse && img_word(buf, w) == (old ? img_word(old, w - start / 2) : 0xFFFF)))
+      plan->program_words++;
+
+  unsigned wiring = cart_profile()->wiring;
+  for (uint32_t cw = start / 2; pwords && cw < end / 2; cw += pwords) {
+    bool skip = true;
+    for (unsigned i = 0; i < pwords && skip; i++) {
+      uint32_t bw = cart_wire_addr(wiring, cw + i);
+      if (bw < end / 2 && !(sparse && img_word(buf, bw) == (old ? img_word(old, bw - start / 2) : 0xFFFF)))
+        skip = false;
+    }
+    if (!skip)
+      plan->program_pages++;
+  }
+}
+
+// Differential plan for a sector: blocks with a cached digest that matches
+// the image (or blank, past the image end) are not read. The image covers the
+// sector up to iend.
+static void plan_sector(t_flash_plan *plan, const uint8_t *buf, unsigned idx, uint32_t sstart,
+                        uint32_t iend, uint32_t send, uint8_t *tmp, unsigned pwords, uint64_t blank) {
+  bool differs = false;
+  for (uint32_t off = sstart; off < send && !differs; off += CACHE_BLOCK) {
+    unsigned bn = off / CACHE_BLOCK;
+    if (send - off < CACHE_BLOCK || !(fcache.block_valid & (1ULL << bn)))
+      differs = true;
+    else if (off + CACHE_BLOCK <= iend)
+      differs = block_digest(&buf[off]) != fcache.block_digest[bn];
+    else
+      differs = off < iend || fcache.block_digest[bn] != blank;
+  }
+  if (!differs)
+    return;
+
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_read_block(tmp, sstart, send - sstart);
+  slot2_release(pmode);
+  for (uint32_t off = sstart; off + CACHE_BLOCK <= send; off += CACHE_BLOCK) {
+    unsigned bn = off / CACHE_BLOCK;
+    fcache.block_digest[bn] = block_digest(&tmp[off - sstart]);
+    fcache.block_valid |= 1ULL << bn;
+  }
+
+  bool tail_blank = is_blank(&tmp[iend - sstart], send - iend);
+  if (tail_blank && !memcmp(tmp, &buf[sstart], iend - sstart))
+    return;
+
+  bool needs_erase = !tail_blank;
+  for (uint32_t i = 0; i < iend - sstart && !needs_erase; i++)
+    needs_erase = (tmp[i] & buf[sstart + i]) != buf[sstart + i];
+
+  plan->program_mask |= 1ULL << idx;
+  plan->program_sectors++;
+  plan->read_bytes += (send - sstart) + (plan->verify ? iend - sstart : 0);
+  if (needs_erase) {
+    plan->erase_mask |= 1ULL << idx;
+    plan->erase_sectors++;
+  }
+  plan_range(plan, buf, sstart, iend, needs_erase ? NULL : tmp, true, pwords);
+}
+
+bool flash_plan(t_flash_plan *plan, const t_flash_chip *chip, const uint8_t *buf,
+                unsigned size, unsigned method, unsigned opts, bool verify) {
+  memset(plan, 0, sizeof(*plan));
+  if ((opts & FLASH_OPT_DIFF) && !chip)
+    return false;
+
+  plan->chip = chip;
+  plan->size = size & ~1;
+  plan->method = method;
+  plan->opts = opts;
+  plan->verify = verify;
+
+  // Same fallbacks as program_range.
+  bool buffered = method == FLASH_PROG_BUFFERED && chip && (chip->flags & CHIP_FLAG_WRITE_BUFFER);
+  bool bypass = method == FLASH_PROG_BYPASS && chip && (chip->flags & CHIP_FLAG_UNLOCK_BYPASS);
+  unsigned pwords = buffered ? MIN(chip->wbuf_words, 64) : 0;
+
+  if (opts & FLASH_OPT_DIFF) {
+    uint8_t *tmp = (uint8_t*)iobuf_get();
+    if (!tmp)
+      return false;
+
+    // Digest of a blank block, for the blocks past the image end.
+    memset(tmp, 0xFF, CACHE_BLOCK);
+    uint64_t blank = block_digest(tmp);
+
+    cache_check();
+    trace_mark(TRACE_OP_VALIDATE);
+    uint32_t sstart, ssize, fend = diff_end(chip, plan->size);
+    for (unsigned i = 0; i < chip_sector_count(chip) && chip_sector(chip, i, &sstart, &ssize) &&
+                         sstart < fend; i++) {
+      uint32_t send = MIN(sstart + ssize, fend);
+      plan_sector(plan, buf, i, sstart, MAX(sstart, MIN(send, plan->size)), send, tmp, pwords, blank);
+    }
+    trace_mark(TRACE_OP_END);
+    iobuf_put(tmp);
+  }
+  else {
+    plan->chip_erase = true;
+    plan->erase_sectors = chip ? chip_sector_count(chip) : 0;
+    plan->program_sectors = plan->erase_sectors;
+    plan_range(plan, buf, 0, plan->size, NULL, opts & FLASH_OPT_SPARSE, pwords);
+    if (verify)
+      plan->read_bytes = plan->size;
+  }
+  plan->cache_gen = cache_gen;
+
+  if (chip) {
+    uint64_t us = plan->chip_erase ? chip->chip_erase_ms * 1000ULL :
+                                     plan->erase_sectors * chip->sector_erase_ms * 1000ULL;
+    if (buffered)
+      us += plan->program_pages * (chip->buf_prog_us + pwords * PLAN_PAGE_BUS_NS / 1000);
+    else
+      us += plan->program_words * (chip->word_prog_us * 1000ULL +
+                                   (bypass ? PLAN_BYPASS_BUS_NS : PLAN_WORD_BUS_NS)) / 1000;
+    us += plan->read_bytes * 1000ULL / PLAN_READ_KBPS;
+    plan->est_ms = us / 1000;
+  }
+  return true;
+}
+
+bool flash_job_start_plan(t_flash_job *job, const t_flash_plan *plan, const uint8_t *buf) {
+  // Only differential plans hold work that a job would otherwise redo.
+  bool valid = true;
+  if (plan->opts & FLASH_OPT_DIFF) {
+    cache_check();
+    valid = plan->cache_gen == cache_gen;
+  }
+  if (!flash_job_start(job, plan->chip, buf, plan->size, plan->method, plan->opts, plan->verify))
+    return false;
+
+  job->planned = valid && (plan->opts & FLASH_OPT_DIFF);
+  job->erase_mask = plan->erase_mask;
+  job->program_mask = plan->program_mask;
+  return true;
+}
@@ -0,0 +1,144 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SuperCard firmware flash routines.
+
+#ifndef _FLASH_H_
+#define _FLASH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cartprof.h"
+#include "chipdb.h"
+
+// Largest firmware size (of any cart profile)
+#define FLASH_FW_SIZE     (512*1024)
+
+// Programming methods
+#define FLASH_PROG_WORD        0     // Regular (4 cycle) word program
+#define FLASH_PROG_BYPASS      1     // Unlock bypass (2 cycle) word program
+#define FLASH_PROG_BUFFERED    2     // Write buffer program
+
+// Programming options
+#define FLASH_OPT_SPARSE     0x1     // Skip words that are already erased (0xFFFF)
+#define FLASH_OPT_DIFF       0x2     // Only erase/program the sectors that differ
+                                     // (past the image end they must be blank)
+
+// Retry/timeout policy
+extern unsigned flash_write_retries;       // Extra program attempts per word
+extern unsigned flash_prog_polls;          // Status polls before a program times out
+extern unsigned flash_erase_timeout_ms;
+
+uint32_t flash_ident();
+// Finds the cart profile the flash answers the ID command to (trying the
+// current one first) and selects it, also returning the flash ID. Returns
+// NULL (keeping the current profile) if no known chip answers.
+const t_cart_profile *cart_detect(uint32_t *flash_id);
+// Performs a flash full-chip erase.
+bool flash_erase();
+// Checks that the erase operation actually erased the memory (returns true on error).
+bool flash_erase_check();
+bool flash_write(const uint8_t *buf, unsigned size);
+// Flashes an image using the given method/options (falls back to word
+// programming if the chip does not support the method). Unless FLASH_OPT_DIFF
+// is used, the chip is fully erased first. Blocking version of a flash job.
+bool flash_update(const t_flash_chip *chip, const uint8_t *buf, unsigned size,
+                  unsigned method, unsigned opts);
+bool flash_validate(const uint8_t *fwimg, unsigned fwsize);
+
+// Step driven flashing, so that the callers can keep the UI running (and do
+// other work) while flashing. A job goes through these states:
+#define FLASH_JOB_ERASE       0     // Chip (or sector) erase
+#define FLASH_JOB_COMPARE     1     // Differential update: checking the next sector
+#define FLASH_JOB_PROGRAM     2
+#define FLASH_JOB_VERIFY      3     // Reading the programmed data back
+#define FLASH_JOB_DONE        4
+#define FLASH_JOB_FAILED      5
+#define FLASH_JOB_CANCELLED   6     // See cancel_requested()
+
+#define FLASH_JOB_NO_LIMIT    0xFFFFFFFF
+
+// Flash plan: the work a job will do, computed up front from the image (and
+// the current flash contents for differential updates), with an estimate of
+// its duration based on the chip database timings. Jobs started from a plan
+// do not compare the sectors again.
+typedef struct {
+  const t_flash_chip *chip;
+  unsigned size, method, opts;
+  bool verify;
+
+  bool chip_erase;              // Full chip erase (regular updates)
+  uint64_t erase_mask;          // Sectors to erase (differential updates)
+  uint64_t program_mask;        // Sectors that differ (differential updates)
+  unsigned erase_sectors, program_sectors;
+  uint32_t program_words;       // Words programmed (word and bypass methods)
+  uint32_t program_pages;       // Write buffer programs (buffered method)
+  uint32_t read_bytes;          // Bytes read back (differing sectors, twice if verified)
+  uint32_t est_ms;              // Estimated duration (zero if the chip is unknown)
+  uint32_t cache_gen;           // Flash contents the plan was computed for
+} t_flash_plan;
+
+typedef struct {
+  const t_flash_chip *chip;
+  const uint8_t *buf;
+  unsigned size, method, opts;
+  bool verify;
+
+  unsigned state;
+  unsigned failed_state;        // State where the job failed (or was cancelled)
+  unsigned erasing;             // Erase in progress (polled by every step)
+  uint32_t erase_start;         // Erase start time (platform ticks)
+  uint32_t pos, end;            // Current position and end of the current range
+  uint32_t vpos;                // Programmed data is verified up to here
+  unsigned sector;              // Next sector to compare (differential updates)
+  uint32_t sstart;              // Current sector start
+  uint8_t *tmp;                 // Sector contents / read back buffer
+  bool planned;                 // Sector masks below come from a plan
+  uint64_t erase_mask, program_mask;
+} t_flash_job;
+
+// Prepares a job, same parameters as flash_update, plus verification: the
+// programmed data is read back as the job goes (sectors that already matched
+// the image are not read again).
+bool flash_job_start(t_flash_job *job, const t_flash_chip *chip, const uint8_t *buf,
+                     unsigned size, unsigned method, unsigned opts, bool verify);
+// Computes the plan for a job (reading the flash for differential updates).
+// Does not modify the flash, returns false if the job could not be started.
+bool flash_plan(t_flash_plan *plan, const t_flash_chip *chip, const uint8_t *buf,
+                unsigned size, unsigned method, unsigned opts, bool verify);
+// Prepares a job from a plan (same image and chip). If the flash changed
+// since the plan was computed (or the cart was swapped) the sectors are
+// compared again as usual.
+bool flash_job_start_plan(t_flash_job *job, const t_flash_plan *plan, const uint8_t *buf);
+// Runs a job to completion, polling the erases every millisecond.
+bool flash_job_run(t_flash_job *job);
+// Does work for about budget platform ticks, or less if the job is waiting
+// for an erase to complete. Returns true while the job is not finished.
+// Cancellation is checked before every slice (erases in progress cannot be
+// aborted, the job is cancelled once they complete). The cart is always left
+// in read mode.
+bool flash_job_step(t_flash_job *job, uint32_t budget);
+// Progress (0-100) of the current state (or the one it stopped at).
+unsigned flash_job_progress(const t_flash_job *job);
+const char *flash_job_state_name(unsigned state);
+// Reads the flash contents (uncached).
+void flash_read(void *dst, uint32_t offset, unsigned size);
+// Calculates the sha256 of the whole flash, also copies the first hdrsize
+// bytes to header (if not NULL).
+bool flash_hash(void *hash, uint8_t *header, unsigned hdrsize);
+// Checks whether the flash already holds the image (word aligned buffer).
+// Unlike flash_validate it uses the cached block digests when available, so
+// it is meant for skip-if-identical checks rather than verification.
+bool flash_compare(const uint8_t *img, unsigned size);
+
+// Per-block digests of the flash contents are cached for the current
+// operation only (from cart_detect on), so that identifying, planning,
+// comparing and flashing do not read the same data several times. Nothing
+// is kept across operations: cart_detect drops the cache. Erasing/programming
+// through this module drops the affected blocks, and a cheap cart signature
+// (flash ID and header) is checked on every use to catch a cart swapped in
+// the middle of an operation. Call flash_cache_invalidate when a different
+// cart might have been inserted without a cart_detect.
+void flash_cache_invalidate();
+
+#endif
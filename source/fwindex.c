@@ -0,0 +1,240 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Firmware image index, see fwindex.h
+
+#include <string.h>
+
+#include "flash.h"
+#include "fwindex.h"
+#include "image.h"
+#include "platform.h"
+#include "sha256.h"
+#include "storage.h"
+
+#define FWINDEX_MAGIC     0x58444946   // "FIDX"
+#define FWINDEX_VERSION   1
+
+#define FLAG_SEEN         0x1          // Found during the current scan
+
+#define HASH_CHUNK        (4*1024)     // Keeps every step short
+
+typedef struct {
+  uint32_t magic, version, count;
+} t_fwindex_header;
+
+enum { IDX_IDLE, IDX_SCAN, IDX_HASH };
+
+static t_fwindex_entry entries[FWINDEX_MAX];
+static unsigned num_entries = 0;
+
+static struct {
+  unsigned state;
+  bool modified;                     // Needs to be saved
+  unsigned depth;
+  t_sdir *dirs[FWINDEX_DEPTH];
+  unsigned plen[FWINDEX_DEPTH];      // Path length of every directory level
+  char path[FWINDEX_PATH_MAX];
+
+  // File being hashed
+  t_sfile *fd;
+  t_sha256_ctx ctx;
+  uint32_t remaining;
+  t_fwindex_entry cur;
+} idx;
+
+static uint8_t chunk[HASH_CHUNK];
+
+static t_fwindex_entry *find_entry(const char *path) {
+  for (unsigned i = 0; i < num_entries; i++)
+    if (!strcmp(entries[i].path, path))
+      return &entries[i];
+  return NULL;
+}
+
+static void load_index() {
+  num_entries = 0;
+  t_sfile *fd = storage_open(FWINDEX_FILE, "rb");
+  if (!fd)
+    return;
+
+  t_fwindex_header hdr;
+  if (storage_read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+      hdr.magic == FWINDEX_MAGIC && hdr.version == FWINDEX_VERSION &&
+      hdr.count <= FWINDEX_MAX) {
+    unsigned bytes = hdr.count * sizeof(t_fwindex_entry);
+    if (storage_read(fd, entries, bytes) == bytes)
+      num_entries = hdr.count;
+  }
+  storage_close(fd);
+}
+
+static void save_index() {
+  t_sfile *fd = storage_open(FWINDEX_FILE, "wb");
+  if (!fd)
+    return;
+
+  t_fwindex_header hdr = {
+    .magic = FWINDEX_MAGIC, .version = FWINDEX_VERSION, .count = num_entries,
+  };
+  storage_write(fd, &hdr, sizeof(hdr));
+  storage_write(fd, entries, num_entries * sizeof(t_fwindex_entry));
+  storage_close(fd);
+}
+
+void fwindex_start() {
+  if (idx.state != IDX_IDLE)
+    return;
+
+  load_index();
+  for (unsigned i = 0; i < num_entries; i++)
+    entries[i].flags &= ~FLAG_SEEN;
+
+  idx.modified = false;
+  idx.depth = 0;
+  strcpy(idx.path, FWINDEX_ROOT);
+  idx.plen[0] = strlen(idx.path);
+  if ((idx.dirs[0] = storage_opendir(idx.path)))
+    idx.state = IDX_SCAN;
+}
+
+static void finish_scan() {
+  // Drop the entries for files that are gone.
+  unsigned n = 0;
+  for (unsigned i = 0; i < num_entries; i++) {
+    if (entries[i].flags & FLAG_SEEN)
+      entries[n++] = entries[i];
+  }
+  idx.modified |= n != num_entries;
+  num_entries = n;
+
+  if (idx.modified)
+    save_index();
+  idx.state = IDX_IDLE;
+}
+
+// Checks a file found during the scan, starts hashing it if it is a new (or
+// modified) firmware image.
+static void check_file() {
+  uint32_t size, mtime;
+  if (!storage_stat(idx.path, &size, &mtime) || size < IMAGE_HEADER_SIZE || size > FLASH_FW_SIZE)
+    return;
+
+  t_fwindex_entry *e = find_entry(idx.path);
+  if (e && e->size == size && e->mtime == mtime) {
+    e->flags |= FLAG_SEEN;
+    return;
+  }
+
+  t_sfile *fd = storage_open(idx.path, "rb");
+  if (!fd)
+    return;
+  if (storage_read(fd, chunk, IMAGE_HEADER_SIZE) != IMAGE_HEADER_SIZE || !valid_header(chunk)) {
+    storage_close(fd);
+    return;
+  }
+
+  memset(&idx.cur, 0, sizeof(idx.cur));
+  strcpy(idx.cur.path, idx.path);
+  idx.cur.size = size;
+  idx.cur.mtime = mtime;
+  idx.fd = fd;
+  idx.remaining = size - IMAGE_HEADER_SIZE;
+  sha256_init(&idx.ctx);
+  sha256_update(&idx.ctx, chunk, IMAGE_HEADER_SIZE);
+  idx.state = IDX_HASH;
+}
+
+static void hash_step() {
+  unsigned csize = idx.remaining < HASH_CHUNK ? idx.remaining : HASH_CHUNK;
+  if (csize) {
+    if (storage_read(idx.fd, chunk, csize) != csize) {
+      storage_close(idx.fd);    // Read error, skip the file
+      idx.state = IDX_SCAN;
+      return;
+    }
+    sha256_update(&idx.ctx, chunk, csize);
+    idx.remaining -= csize;
+    return;
+  }
+
+  storage_close(idx.fd);
+  idx.state = IDX_SCAN;
+
+  uint8_t hash[32];
+  sha256_final(&idx.ctx, hash);
+  memcpy(idx.cur.sha256, hash, sizeof(idx.cur.sha256));
+  idx.cur.flags = FLAG_SEEN;
+
+  // Replace the old entry (if the file was modified), or add a new one.
+  t_fwindex_entry *e = find_entry(idx.cur.path);
+  if (!e && num_entries < FWINDEX_MAX)
+    e = &entries[num_entries++];
+  if (e) {
+    *e = idx.cur;
+    idx.modified = true;
+  }
+}
+
+static void scan_step() {
+  char name[FWINDEX_PATH_MAX];
+  bool isdir;
+  unsigned plen = idx.plen[idx.depth];
+
+  if (!storage_readdir(idx.dirs[idx.depth], name, sizeof(name), &isdir)) {
+    // Done with this directory, go back up.
+    storage_closedir(idx.dirs[idx.depth]);
+    if (!idx.depth)
+      finish_scan();
+    else
+      idx.path[idx.plen[--idx.depth]] = 0;
+    return;
+  }
+
+  // Skip ".", ".." and hidden files, and paths that do not fit.
+  if (name[0] == '.' || plen + strlen(name) + 2 > FWINDEX_PATH_MAX)
+    return;
+
+  strcpy(&idx.path[plen], name);
+  if (!isdir)
+    check_file();
+  else if (idx.depth + 1 < FWINDEX_DEPTH) {
+    strcat(idx.path, "/");
+    t_sdir *d = storage_opendir(idx.path);
+    if (d) {
+      // Descend, the path now points to the subdirectory.
+      idx.depth++;
+      idx.dirs[idx.depth] = d;
+      idx.plen[idx.depth] = strlen(idx.path);
+      return;
+    }
+  }
+  idx.path[plen] = 0;
+}
+
+bool fwindex_step(uint32_t budget) {
+  uint32_t start = platform_ticks();
+  while (idx.state != IDX_IDLE && platform_ticks() - start < budget) {
+    if (idx.state == IDX_SCAN)
+      scan_step();
+    else
+      hash_step();
+  }
+  return idx.state != IDX_IDLE;
+}
+
+bool fwindex_busy() {
+  return idx.state != IDX_IDLE;
+}
+
+unsigned fwindex_count() {
+  return num_entries;
+}
+
+const t_fwindex_entry *fwindex_get(unsigned i) {
+  return i < num_entries ? &entries[i] : NULL;
+}
+
+const t_fwindex_entry *fwindex_lookup(const char *path, uint32_t size, uint32_t mtime) {
+  const t_fwindex_entry *e = find_entry(path);
+  return e && e->size == size && e->mtime == mtime ? e : NULL;
+}
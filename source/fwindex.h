@@ -0,0 +1,46 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Firmware image index.
+//
+// Recursively scans the SD card for firmware images (files that fit the
+// flash and have a valid header) and keeps a list with their path, size,
+// modification time and hash. The index is saved to the card, later scans
+// only hash new or modified files. Scanning is incremental (see
+// fwindex_step) so that it can run in the background of the UI loops.
+
+#ifndef _FWINDEX_H_
+#define _FWINDEX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "platform.h"
+
+#define FWINDEX_FILE       "fat:/sc_fwindex.bin"
+#define FWINDEX_ROOT       "fat:/"
+#define FWINDEX_MAX        256      // Max indexed images
+#define FWINDEX_PATH_MAX   160
+#define FWINDEX_DEPTH      8        // Max directory depth
+#define FWINDEX_BUDGET     (PLATFORM_TICKS_PER_SEC / 100)   // Max indexing time per frame
+
+typedef struct {
+  char path[FWINDEX_PATH_MAX];
+  uint32_t size, mtime;
+  uint8_t sha256[16];           // Truncated hash (like the known images table)
+  uint32_t flags;               // Internal use
+} t_fwindex_entry;
+
+// Loads the saved index (if any) and starts a rescan.
+void fwindex_start();
+// Does some scanning work, for up to budget platform ticks. Returns true if
+// there is more work pending.
+bool fwindex_step(uint32_t budget);
+bool fwindex_busy();
+
+unsigned fwindex_count();
+const t_fwindex_entry *fwindex_get(unsigned idx);
+// Entry for a file (path as built by the scan, like "fat:/dir/file.gba") if
+// it is indexed with the same size and modification time, NULL otherwise.
+const t_fwindex_entry *fwindex_lookup(const char *path, uint32_t size, uint32_t mtime);
+
+#endif
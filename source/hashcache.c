@@ -0,0 +1,106 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Persistent image hash cache, see hashcache.h
+
+#include <string.h>
+
+#include "hashcache.h"
+#include "storage.h"
+
+#define HASHCACHE_MAGIC     0x48435348   // "HSCH"
+#define HASHCACHE_VERSION   1
+
+typedef struct {
+  uint32_t magic, version, count, stamp;
+} t_hashcache_header;
+
+static t_hashcache_entry entries[HASHCACHE_MAX];
+static unsigned num_entries = 0;
+static uint32_t stamp = 0;
+static bool loaded = false;
+
+static void load_cache() {
+  if (loaded)
+    return;
+  loaded = true;
+
+  t_sfile *fd = storage_open(HASHCACHE_FILE, "rb");
+  if (!fd)
+    return;
+
+  t_hashcache_header hdr;
+  if (storage_read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+      hdr.magic == HASHCACHE_MAGIC && hdr.version == HASHCACHE_VERSION &&
+      hdr.count <= HASHCACHE_MAX) {
+    unsigned bytes = hdr.count * sizeof(t_hashcache_entry);
+    if (storage_read(fd, entries, bytes) == bytes) {
+      num_entries = hdr.count;
+      stamp = hdr.stamp;
+    }
+  }
+  storage_close(fd);
+}
+
+static void save_cache() {
+  t_sfile *fd = storage_open(HASHCACHE_FILE, "wb");
+  if (!fd)
+    return;
+
+  t_hashcache_header hdr = {
+    .magic = HASHCACHE_MAGIC, .version = HASHCACHE_VERSION,
+    .count = num_entries, .stamp = stamp,
+  };
+  storage_write(fd, &hdr, sizeof(hdr));
+  storage_write(fd, entries, num_entries * sizeof(t_hashcache_entry));
+  storage_close(fd);
+}
+
+static t_hashcache_entry *find_entry(const char *path) {
+  for (unsigned i = 0; i < num_entries; i++)
+    if (!strcmp(entries[i].path, path))
+      return &entries[i];
+  return NULL;
+}
+
+bool hashcache_lookup(const char *path, uint32_t size, uint32_t mtime,
+                      uint8_t *sha256, uint32_t *flags) {
+  load_cache();
+  t_hashcache_entry *e = find_entry(path);
+  if (!e || e->size != size || e->mtime != mtime)
+    return false;
+
+  // The use stamp is only updated in memory, it is saved on the next store.
+  e->stamp = ++stamp;
+  memcpy(sha256, e->sha256, sizeof(e->sha256));
+  *flags = e->flags;
+  return true;
+}
+
+void hashcache_store(const char *path, uint32_t size, uint32_t mtime,
+                     const uint8_t *sha256, uint32_t flags) {
+  if (strlen(path) >= HASHCACHE_PATH_MAX)
+    return;
+
+  load_cache();
+  t_hashcache_entry *e = find_entry(path);
+  if (!e) {
+    if (num_entries < HASHCACHE_MAX)
+      e = &entries[num_entries++];
+    else {
+      // Replace the least recently used entry.
+      e = &entries[0];
+      for (unsigned i = 1; i < num_entries; i++)
+        if (entries[i].stamp < e->stamp)
+          e = &entries[i];
+    }
+  }
+
+  memset(e, 0, sizeof(*e));
+  strcpy(e->path, path);
+  e->size = size;
+  e->mtime = mtime;
+  memcpy(e->sha256, sha256, sizeof(e->sha256));
+  e->flags = flags;
+  e->stamp = ++stamp;
+  save_cache();
+}
@@ -0,0 +1,39 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Persistent image hash cache.
+//
+// Maps a file (path, size and modification time) to its sha256 hash and
+// header status, so that selecting an image that was already seen does not
+// need to hash it again. The cache is small (least recently used entries are
+// replaced) and it is saved to the card on every update.
+
+#ifndef _HASHCACHE_H_
+#define _HASHCACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define HASHCACHE_FILE      "fat:/sc_hashcache.bin"
+#define HASHCACHE_MAX       32
+#define HASHCACHE_PATH_MAX  160
+
+// Entry flags
+#define HASHCACHE_HDR_OK    0x1      // valid_header() passed
+
+typedef struct {
+  char path[HASHCACHE_PATH_MAX];
+  uint32_t size, mtime;
+  uint8_t sha256[32];
+  uint32_t flags;
+  uint32_t stamp;                   // Last use (for replacement)
+} t_hashcache_entry;
+
+// Looks up a file, returns true (and fills the hash and flags) if the cache
+// has an entry for it with the same size and modification time.
+bool hashcache_lookup(const char *path, uint32_t size, uint32_t mtime,
+                      uint8_t *sha256, uint32_t *flags);
+// Adds (or updates) the entry for a file.
+void hashcache_store(const char *path, uint32_t size, uint32_t mtime,
+                     const uint8_t *sha256, uint32_t flags);
+
+#endif
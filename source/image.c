@@ -0,0 +1,82 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Firmware image checks and identification, see image.h
+
+#include <string.h>
+
+#include "arena.h"
+#include "image.h"
+#include "sha256.h"
+#include "storage.h"
+
+static const struct {
+  const char *fw_name;
+  uint8_t sha256[16];
+} known_images[] = {
+  {
+    "Empty/Zeroed",   // All 0x00
+    {0x07,0x85,0x4d,0x2f,0xef,0x29,0x7a,0x06,0xba,0x81,0x68,0x5e,0x66,0x0c,0x33,0x2d}
+  },
+  {
+    "Empty/Cleared",   // All 0xFF
+    {0x04,0x3e,0x23,0x8a,0x76,0x5f,0x7c,0xfb,0xc6,0x25,0x96,0xa5,0x0e,0x53,0xc8,0xff}
+  },
+  {
+    "Official firmware v1.85 (EN)",
+    {0xc1,0x1d,0x86,0x4d,0x39,0xa4,0x58,0x60,0xa7,0xc5,0xc3,0x4c,0xa6,0x65,0xa9,0xc1}
+  },
+};
+
+const char *image_lookup(const uint8_t *hash) {
+  for (unsigned i = 0; i < sizeof(known_images)/sizeof(known_images[0]); i++) {
+    if (!memcmp(hash, known_images[i].sha256, sizeof(known_images[i].sha256)))
+      return known_images[i].fw_name;
+  }
+
+  return NULL;
+}
+
+const char *image_ident(const uint8_t *img, unsigned size) {
+  uint8_t hash[32];
+  sha256sum(img, size, hash);
+  return image_lookup(hash);
+}
+
+bool valid_header(const uint8_t *fw) {
+  const uint8_t logo_hash[] = {0x08,0xa0,0x15,0x3c,0xfd,0x6b,0x0e,0xa5,0x4b,0x93,0x8f,0x7d,0x20,0x99,0x33,0xfa};
+
+  // Check the logo
+  uint8_t hash[32];
+  sha256sum(&fw[0x4], 156, hash);
+  bool logo_ok = !memcmp(hash, logo_hash, sizeof(logo_hash));
+
+  // Check that the checksum is also valid
+  uint8_t checksum = 0x19;
+  for (unsigned i = 0xA0; i < 0xBD; i++)
+    checksum += fw[i];
+  checksum = -checksum;
+  bool checksum_ok = checksum == fw[0xBD];
+
+  return logo_ok && checksum_ok;
+}
+
+unsigned image_load(const char *path, unsigned maxsize, uint8_t **img, unsigned *size) {
+  t_sfile *fd = storage_open(path, "rb");
+  if (!fd)
+    return IMAGE_LOAD_NOFILE;
+
+  long fsize = storage_size(fd);
+  unsigned ret = IMAGE_LOAD_OK;
+  if (fsize < 0)
+    ret = IMAGE_LOAD_IOERR;
+  else if (fsize > maxsize)
+    ret = IMAGE_LOAD_TOOBIG;
+  else if (!(*img = (uint8_t*)scratch_alloc(fsize)))
+    ret = IMAGE_LOAD_NOMEM;
+  else if (storage_read(fd, *img, fsize) != fsize)
+    ret = IMAGE_LOAD_IOERR;
+
+  storage_close(fd);
+  *size = fsize;
+  return ret;
+}
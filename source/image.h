@@ -0,0 +1,33 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Firmware image checks and identification (shared by the NDS tool and the
+// host tools).
+
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// image_load() results
+#define IMAGE_LOAD_OK        0
+#define IMAGE_LOAD_NOFILE    1     // Could not open the file
+#define IMAGE_LOAD_TOOBIG    2     // Bigger than the allowed size
+#define IMAGE_LOAD_NOMEM     3     // Does not fit the scratch arena
+#define IMAGE_LOAD_IOERR     4     // Read error
+
+// Bytes that valid_header() looks at.
+#define IMAGE_HEADER_SIZE   0xC0
+
+// Checks the GBA header (logo and header checksum).
+bool valid_header(const uint8_t *fw);
+// Returns the name of a well-known image given its sha256 hash (or NULL).
+const char *image_lookup(const uint8_t *hash);
+// Hashes and looks up a whole image.
+const char *image_ident(const uint8_t *img, unsigned size);
+
+// Loads an image file (up to maxsize bytes) into the scratch arena. The
+// caller releases the scratch memory (also on error).
+unsigned image_load(const char *path, unsigned maxsize, uint8_t **img, unsigned *size);
+
+#endif
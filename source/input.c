@@ -0,0 +1,51 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Input handling, see input.h
+
+#include <nds.h>
+
+#include "input.h"
+
+#define MIN(a, b)   ((a) > (b) ? (b) : (a))
+
+t_input_config input_config = {
+  .delay = 20,
+  .rate = 4,
+  .accel = 8,
+  .max_step = 8,
+};
+
+static const uint32_t dpad_keys[4] = {KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT};
+
+static struct {
+  unsigned frames;        // Frames held
+  unsigned repeats;       // Repeats so far
+  unsigned steps;         // Steps for the current frame
+} dpad[4];
+
+void input_update() {
+  scanKeys();
+  uint32_t down = keysDown(), held = keysHeld();
+
+  for (unsigned i = 0; i < 4; i++) {
+    dpad[i].steps = 0;
+    if (down & dpad_keys[i]) {
+      dpad[i].frames = dpad[i].repeats = 0;
+      dpad[i].steps = 1;
+    }
+    else if (held & dpad_keys[i]) {
+      unsigned f = ++dpad[i].frames;
+      if (f >= input_config.delay && !((f - input_config.delay) % input_config.rate)) {
+        unsigned shift = MIN(dpad[i].repeats++ / input_config.accel, 16);
+        dpad[i].steps = MIN(1U << shift, input_config.max_step);
+      }
+    }
+  }
+}
+
+unsigned input_steps(uint32_t key) {
+  for (unsigned i = 0; i < 4; i++)
+    if (dpad_keys[i] == key)
+      return dpad[i].steps;
+  return 0;
+}
@@ -0,0 +1,26 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Input handling: held D-pad keys autorepeat, speeding up the longer they
+// are held (to scroll long lists quickly).
+
+#ifndef _INPUT_H_
+#define _INPUT_H_
+
+#include <stdint.h>
+
+typedef struct {
+  unsigned delay;         // Frames held before repeating
+  unsigned rate;          // Frames between repeats
+  unsigned accel;         // Repeats before the step size doubles
+  unsigned max_step;      // Maximum step size
+} t_input_config;
+
+extern t_input_config input_config;
+
+// Scans the keys and updates the autorepeat state, call it once per frame.
+void input_update();
+// Steps to move this frame for a D-pad key: 1 when pressed, then repeats
+// (with acceleration) while held, 0 otherwise.
+unsigned input_steps(uint32_t key);
+
+#endif
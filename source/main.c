@@ -1,4 +1,3 @@
-
 // Copyright 2024 David Guillen Fandos <david@davidgf.net>
 
 // SuperCard firmware flashing tool.
@@ -6,396 +5,364 @@
 // This NDS tool handles certain operations (like read/flash) on the Supercard
 // firmware flash memory.
 
+#include <ctype.h>
 #include <dirent.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <strings.h>
 #include <nds.h>
-#include <fat.h>
 #include <nds/arm9/dldi.h>
 #include <nds/memory.h>
-#include <sys/stat.h>
 
-#define MAPPED_FIRMWARE      0
-#define MAPPED_SDRAM         1
+#include "arena.h"
+#include "cancel.h"
+#include "chipdb.h"
+#include "dump.h"
+#include "flash.h"
+#include "fwindex.h"
+#include "hashcache.h"
+#include "image.h"
+#include "input.h"
+#include "platform.h"
+#include "production.h"
+#include "sched.h"
+#include "sha256.h"
+#include "slot2.h"
+#include "stage.h"
+#include "storage.h"
+#include "trace.h"
+
+#define TRACE_FILE  "fat:/sc_bus_trace.bin"
+#define ARCHIVE_FILE  "fat:/sc_cart_archive.bin"
+#define MENU_ENTRIES  11
+#define PROD_POLL_FRAMES  15   // Cart detection polling period (in frames)
+#define FLASH_JOB_BUDGET  (PLATFORM_TICKS_PER_SEC / 100)   // Flashing time per frame
 
 #define MAX(a, b)   ((a) < (b) ? (b) : (a))
 #define MIN(a, b)   ((a) > (b) ? (b) : (a))
 
-void sha256sum(const uint8_t *inbuffer, unsigned length, void *output);
-
-void sleep_1ms() {
-  for (unsigned i = 0; i < (1<<14); i++)
-    asm volatile ("nop");
-}
+// Hashes the flash contents and tries to identify them as a well-known
+// firmware, also checks the image header.
+static const char *firmware_ident(bool *header_ok) {
+  uint8_t hash[32], header[IMAGE_HEADER_SIZE];
+  *header_ok = false;
+  if (!flash_hash(hash, header, sizeof(header)))
+    return NULL;
 
-// The flash device address bus is connected with some permutated wires.
-// The permutation seems to only apply to the 9 LSB.
-// In general we do not care unless we need to send a specifc address or play
-// with sector/page erase.
-static uint32_t addr_perm(uint32_t addr) {
-  return (addr & 0xFFFFFE02) |
-         ((addr & 0x001) << 7) | 
-         ((addr & 0x004) << 4) | 
-         ((addr & 0x008) << 2) | 
-         ((addr & 0x010) >> 4) | 
-         ((addr & 0x020) >> 3) | 
-         ((addr & 0x040) << 2) | 
-         ((addr & 0x080) >> 3) | 
-         ((addr & 0x100) >> 5);
+  *header_ok = valid_header(header);
+  return image_lookup(hash);
 }
 
-void set_supercard_mode(unsigned mapped_area, bool write_access, bool sdcard_interface) {
-  // Bit0: Controls SDRAM vs internal Flash mapping
-  // Bit1: Controls whether the SD card interface is mapped into the ROM addresspace.
-  // Bit2: Controls read-only/write access.
-  uint16_t value = mapped_area | (sdcard_interface ? 0x2 : 0x0) | (write_access ? 0x4 : 0x0);
-  const uint16_t MODESWITCH_MAGIC = 0xA55A;
-  volatile uint16_t *REG_SD_MODE = (volatile uint16_t*)(0x09FFFFFE);
-
-  // Write magic value and then the mode value (twice) to trigger the mode change.
-  *REG_SD_MODE = MODESWITCH_MAGIC;
-  *REG_SD_MODE = MODESWITCH_MAGIC;
-  *REG_SD_MODE = value;
-  *REG_SD_MODE = value;
+// Runs the background tasks in the time left until the next VBlank, then
+// waits for it.
+static void idle_wait() {
+  sched_idle();
+  swiWaitForVBlank();
 }
 
-#define SLOT2_BASE_U16 ((volatile uint16_t*)(0x08000000))
-#define SLOT2_SRAM_U8  ((volatile uint8_t*)( 0x0A000000))
-
-static unsigned test_sram() {
-  bool pmode = sysGetCartOwner();
-  sysSetCartOwner(BUS_OWNER_ARM9);
-
-  // Just write the SRAM with some well-known data, and read it back
-  REG_EXMEMCNT |= 0x3;   // Use the slowest possible access time.
-  for (unsigned i = 0; i < 64*1024; i++)
-    SLOT2_SRAM_U8[i] = 0x00;
-  for (unsigned i = 0; i < 64*1024; i++)
-    SLOT2_SRAM_U8[i] = i ^ (i * i) ^ 0x5A;
-  unsigned numerrs = 0;
-  for (unsigned i = 0; i < 64*1024; i++)
-    if (SLOT2_SRAM_U8[i] != ((i ^ (i * i) ^ 0x5A) & 0xFF))
-      numerrs++;
-
-  sysSetCartOwner(pmode);
-  return numerrs;
+// Long operations are cancelled by holding B (read straight from the
+// registers, the operations do not scan the keys).
+static bool cancel_check() {
+  return keysCurrent() & KEY_B;
 }
 
-static uint32_t flash_ident() {
-  // Map the GBA cart into the ARM9, enter flash mode with write enable.
-  bool pmode = sysGetCartOwner();
-  sysSetCartOwner(BUS_OWNER_ARM9);
-  set_supercard_mode(MAPPED_FIRMWARE, true, false);
-
-  REG_EXMEMCNT |= 0xF;  // use slow mode
-  for (unsigned i = 0; i < 32; i++)
-    SLOT2_BASE_U16[0] = 0x00F0;            // Reset for a few cycles
-
-  SLOT2_BASE_U16[addr_perm(0x555)] = 0x00AA;
-  SLOT2_BASE_U16[addr_perm(0x2AA)] = 0x0055;
-  SLOT2_BASE_U16[addr_perm(0x555)] = 0x0090;
-
-  uint32_t ret = SLOT2_BASE_U16[addr_perm(0x000)] << 16;
-  ret |= SLOT2_BASE_U16[addr_perm(0x001)];
-
-  for (unsigned i = 0; i < 32; i++)
-    SLOT2_BASE_U16[0] = 0x00F0;            // Reset for a few cycles
-
-  set_supercard_mode(MAPPED_FIRMWARE, false, false);
-  sysSetCartOwner(pmode);
-
-  return ret;
-}
+// Listing entries are packed back to back, every one taking the size of its
+// name followed by its sort key (see natural_key).
+typedef struct {
+  bool isdir;
+  char fn[];
+} t_fs_entry;
 
-// Performs a flash full-chip erase.
-static bool flash_erase() {
-  // Map the GBA cart into the ARM9, enter flash mode with write enable.
-  bool pmode = sysGetCartOwner();
-  sysSetCartOwner(BUS_OWNER_ARM9);
-  set_supercard_mode(MAPPED_FIRMWARE, true, false);
-
-  REG_EXMEMCNT |= 0xF;  // use slow mode
-  for (unsigned i = 0; i < 32; i++)
-    SLOT2_BASE_U16[0] = 0x00F0;            // Reset for a few cycles
-
-  SLOT2_BASE_U16[addr_perm(0x555)] = 0x00AA;
-  SLOT2_BASE_U16[addr_perm(0x2AA)] = 0x0055;
-  SLOT2_BASE_U16[addr_perm(0x555)] = 0x0080; // Erase command
-  SLOT2_BASE_U16[addr_perm(0x555)] = 0x00AA;
-  SLOT2_BASE_U16[addr_perm(0x2AA)] = 0x0055;
-  SLOT2_BASE_U16[addr_perm(0x555)] = 0x0010; // Full chip erase!
-
-  // Wait for the erase operation to finish. We rely on Q6 toggling:
-  for (unsigned i = 0; i < 60*1000; i++) {
-    sleep_1ms();
-    if (SLOT2_BASE_U16[0] == SLOT2_BASE_U16[0])
-      break;
+// Sorting is done on an index (pointers plus precomputed sort keys), the
+// entries are left in place.
+typedef struct {
+  const char *key;
+  t_fs_entry *ent;
+} t_fs_index;
+
+// Builds the sort key for a file name: case folded, and with every digit run
+// prefixed by its length, so that comparing keys with strcmp results in a
+// natural ordering ("file9" before "file10"). Returns the key size (including
+// the terminator), dst can be NULL to just calculate it.
+static unsigned natural_key(char *dst, const char *name) {
+  unsigned len = 0;
+  while (*name) {
+    if (isdigit((unsigned char)*name)) {
+      while (*name == '0' && isdigit((unsigned char)name[1]))
+        name++;           // Leading zeros do not count
+      unsigned n = 0;
+      while (isdigit((unsigned char)name[n]))
+        n++;
+      if (dst) {
+        dst[len] = '0';
+        dst[len + 1] = '0' + MIN(n, 0x4F);
+        memcpy(&dst[len + 2], name, n);
+      }
+      len += n + 2;
+      name += n;
+    } else {
+      if (dst)
+        dst[len] = tolower((unsigned char)*name);
+      len++;
+      name++;
+    }
   }
-  bool retok = (SLOT2_BASE_U16[0] == SLOT2_BASE_U16[0]);
-
-  for (unsigned i = 0; i < 32; i++)
-    SLOT2_BASE_U16[0] = 0x00F0;            // Reset for a few cycles
-
-  set_supercard_mode(MAPPED_FIRMWARE, false, false);
-  sysSetCartOwner(pmode);
-
-  return retok;
+  if (dst)
+    dst[len] = 0;
+  return len + 1;
 }
 
-// Checks that the erase operation actually erased the memory.
-static bool flash_erase_check() {
-  // Map the GBA cart into the ARM9, enter flash mode with write enable.
-  bool pmode = sysGetCartOwner();
-  sysSetCartOwner(BUS_OWNER_ARM9);
-  set_supercard_mode(MAPPED_FIRMWARE, true, false);
-  REG_EXMEMCNT |= 0xF;  // use slow mode
-
-  bool errf = false;
-  for (unsigned i = 0; i < 512*1024; i+= 2) {
-    errf = (SLOT2_BASE_U16[i / 2] != 0xFFFF);
-    if (errf)
-      break;
-  }
-
-  set_supercard_mode(MAPPED_FIRMWARE, false, false);
-  sysSetCartOwner(pmode);
-
-  return errf;
+static int fncomp(const void* a, const void* b) {
+  return strcmp(((const t_fs_index*)a)->key, ((const t_fs_index*)b)->key);
 }
 
+// Directory listings are allocated in the scratch arena: the entries are
+// grown in place (always keeping room for the index), then the sort index is
+// allocated. The returned index is sorted and terminated by an entry with a
+// NULL entry pointer. If the arena fills up, the rest of the directory is
+// left out and truncated is set.
+t_fs_index *listdir(const char *path, unsigned *nume, bool *truncated) {
+  unsigned cap = 1024, used = 0, nument = 0;
+  uint8_t *ents = (uint8_t*)scratch_alloc(cap);
+  *truncated = false;
+  if (!ents)
+    return NULL;
 
-static bool flash_write(const uint8_t *buf, unsigned size) {
-  bool ok = true;
-  // Map the GBA cart into the ARM9, enter flash mode with write enable.
-  bool pmode = sysGetCartOwner();
-  sysSetCartOwner(BUS_OWNER_ARM9);
-  set_supercard_mode(MAPPED_FIRMWARE, true, false);
-  REG_EXMEMCNT |= 0xF;  // use slow mode
-
-  SLOT2_BASE_U16[0] = 0x00F0;   // Force IDLE
-
-  for (unsigned i = 0; i < size; i+= 2) {
-    uint16_t value = buf[i] | (buf[i+1] << 8);
-
-    SLOT2_BASE_U16[addr_perm(0x555)] = 0x00AA;
-    SLOT2_BASE_U16[addr_perm(0x2AA)] = 0x0055;
-    SLOT2_BASE_U16[addr_perm(0x555)] = 0x00A0; // Program command
-
-    // Perform the actual write operation
-    SLOT2_BASE_U16[i / 2] = value;
+  DIR *dirp = opendir(path);
+  while (dirp) {
+    struct dirent *cur = readdir(dirp);
+    if (!cur || !cur->d_name[0])
+      break;
+    if (cur->d_name[0] == '.' && !cur->d_name[1])
+      continue;
 
-    // It should take less than 1ms usually (in the order of us).
-    for (unsigned j = 0; j < 32*1024; j++) {
-      if (SLOT2_BASE_U16[0] == SLOT2_BASE_U16[0])
+    bool isdir = cur->d_type == DT_DIR;
+    unsigned nlen = strlen(cur->d_name) + (isdir ? 1 : 0);
+    // The directory '/' adds a character to the key too.
+    unsigned esize = sizeof(t_fs_entry) + nlen + 1 + natural_key(NULL, cur->d_name) + (isdir ? 1 : 0);
+    unsigned need = used + esize + (nument + 2) * sizeof(t_fs_index) + ARENA_ALIGN;
+    if (need > cap) {
+      unsigned ncap = MAX(need, cap * 2);
+      if (!scratch_extend(ents, ncap) && !scratch_extend(ents, ncap = need)) {
+        *truncated = true;
         break;
+      }
+      cap = ncap;
     }
-    bool notfinished = (SLOT2_BASE_U16[0] != SLOT2_BASE_U16[0]);
 
-    SLOT2_BASE_U16[0] = 0x00F0;   // Finish operation or abort.
-
-    // Timed out or the write was incorrect
-    if (notfinished || SLOT2_BASE_U16[i / 2] != value) {
-      ok = false;
-      break;
-    }
+    t_fs_entry *e = (t_fs_entry*)&ents[used];
+    e->isdir = isdir;
+    strcpy(e->fn, cur->d_name);
+    if (isdir)
+      strcat(e->fn, "/");
+    used += sizeof(t_fs_entry) + nlen + 1;
+    used += natural_key((char*)&ents[used], e->fn);
+    nument++;
+  }
+  if (dirp)
+    closedir(dirp);
+
+  // The room kept for the index is always there.
+  scratch_extend(ents, used);
+  t_fs_index *ret = (t_fs_index*)scratch_alloc((nument + 1) * sizeof(t_fs_index));
+  if (!ret)
+    return NULL;
+
+  for (unsigned i = 0, off = 0; i < nument; i++) {
+    t_fs_entry *e = (t_fs_entry*)&ents[off];
+    ret[i].ent = e;
+    ret[i].key = &e->fn[strlen(e->fn) + 1];
+    off += sizeof(t_fs_entry) + strlen(e->fn) + 1 + strlen(ret[i].key) + 1;
   }
+  ret[nument].ent = NULL;
 
-  set_supercard_mode(MAPPED_FIRMWARE, false, false);
-  sysSetCartOwner(pmode);
+  qsort(ret, nument, sizeof(t_fs_index), fncomp);
 
-  return ok;
+  if (nume) *nume = nument;
+  return ret;
 }
 
-static bool flash_validate(const uint8_t *fwimg, unsigned fwsize) {
-  // Map the GBA cart into the ARM9, enter flash mode with write enable.
-  bool pmode = sysGetCartOwner();
-  sysSetCartOwner(BUS_OWNER_ARM9);
-  set_supercard_mode(MAPPED_FIRMWARE, true, false);
-
-  return (!memcmp(fwimg, (uint8_t*)0x08000000, fwsize));
-
-  set_supercard_mode(MAPPED_FIRMWARE, false, false);
-  sysSetCartOwner(pmode);
+// Moves the selection of a list (8 visible rows). Up/down move one entry,
+// left/right a page (both accelerate when held). Returns true if it moved.
+static bool list_navigate(unsigned *cur, unsigned *top, unsigned count) {
+  unsigned prev = *cur;
+  unsigned fwd = input_steps(KEY_DOWN) + 8 * input_steps(KEY_RIGHT);
+  unsigned bwd = input_steps(KEY_UP) + 8 * input_steps(KEY_LEFT);
+  if (count)
+    *cur = MIN(*cur + fwd, count - 1);
+  *cur = *cur > bwd ? *cur - bwd : 0;
+
+  if (*cur >= *top + 8)
+    *top = *cur - 7;
+  if (*cur < *top)
+    *top = *cur;
+  return *cur != prev;
 }
 
-static bool flash_dump(const char *filename) {
-  // Map the GBA cart into the ARM9, enter flash mode with write enable.
-  bool pmode = sysGetCartOwner();
-  sysSetCartOwner(BUS_OWNER_ARM9);
-  set_supercard_mode(MAPPED_FIRMWARE, true, false);
-
-  char *data = (char*)malloc(512*1024);
-  memcpy(data, (void*)0x08000000, 512*1024);
-
-  set_supercard_mode(MAPPED_FIRMWARE, false, false);
-  sysSetCartOwner(pmode);
-
-  FILE *fd = fopen(filename, "wb");
-  if (!fd) {
-    free(data);
-    return false;
+// Runs the planned flash job (erase, program and verify), one step per frame
+// so that the progress can be shown. Returns false if the job failed (or was
+// cancelled) after modifying the flash.
+static bool flash_image(const t_flash_plan *plan, const uint8_t *fwimg,
+                        PrintConsole *tops, PrintConsole *bots) {
+  t_flash_job job;
+  consoleSelect(bots);
+  if (chipdb_lookup(flash_ident()) != plan->chip) {
+    printf("The cart changed, select the image again!\n");
+    return true;
   }
-
-  fwrite(data, 1, 512*1024, fd);
-
-  fclose(fd);
-  free(data);
-  return true;
-}
-
-static bool rom_dump(const char *filename) {
-  // Map the GBA cart into the ARM9, enter flash mode with write enable.
-  FILE *fd = fopen(filename, "wb");
-  if (!fd)
-    return false;
-
-  char *data = (char*)malloc(512*1024);
-  bool pmode = sysGetCartOwner();
-  sysSetCartOwner(BUS_OWNER_ARM9);
-  set_supercard_mode(MAPPED_SDRAM, true, false);
-
-  for (unsigned i = 0; i < 64; i++) {
-    memcpy(data, (void*)(0x08000000 + i*512*1024), 512*1024);
-    fwrite(data, 1, 512*1024, fd);
+  if (!flash_job_start_plan(&job, plan, fwimg)) {
+    printf("Not enough memory to flash!\n");
+    return true;
   }
 
-  set_supercard_mode(MAPPED_FIRMWARE, false, false);
-  sysSetCartOwner(pmode);
-
-  fclose(fd);
-  free(data);
-  return true;
-}
-
-const struct {
-  const char *fw_name;
-  uint8_t sha256[16];
-} known_images[] = {
-  {
-    "Empty/Zeroed",   // All 0x00
-    {0x07,0x85,0x4d,0x2f,0xef,0x29,0x7a,0x06,0xba,0x81,0x68,0x5e,0x66,0x0c,0x33,0x2d}
-  },
-  {
-    "Empty/Cleared",   // All 0xFF
-    {0x04,0x3e,0x23,0x8a,0x76,0x5f,0x7c,0xfb,0xc6,0x25,0x96,0xa5,0x0e,0x53,0xc8,0xff}
-  },
-  {
-    "Official firmware v1.85 (EN)",
-    {0xc1,0x1d,0x86,0x4d,0x39,0xa4,0x58,0x60,0xa7,0xc5,0xc3,0x4c,0xa6,0x65,0xa9,0xc1}
-  },
-};
-
-const char * firmware_ident() {
-  // Calculate the Firmware hash, attempt to identify it as a well-known firmware.
-  uint8_t hash[32];
-  sha256sum((uint8_t*)0x08000000, 512*1024, hash);
-
-  for (unsigned i = 0; i < sizeof(known_images)/sizeof(known_images[0]); i++) {
-    if (!memcmp(hash, known_images[i].sha256, sizeof(known_images[i].sha256)))
-      return known_images[i].fw_name;
+  consoleSelect(tops);
+  printf("\x1b[12;2H%-28s", "");
+  printf("\x1b[14;2H%-28s", "Hold B to cancel");
+  while (flash_job_step(&job, FLASH_JOB_BUDGET)) {
+    consoleSelect(tops);
+    printf("\x1b[9;2H%-9s %3u%%%14s", flash_job_state_name(job.state), flash_job_progress(&job), "");
+    swiWaitForVBlank();
   }
 
-  return NULL;
-}
-
-bool valid_header(const uint8_t *fw) {
-  const uint8_t logo_hash[] = {0x08,0xa0,0x15,0x3c,0xfd,0x6b,0x0e,0xa5,0x4b,0x93,0x8f,0x7d,0x20,0x99,0x33,0xfa};
-
-  // Check the logo
-  uint8_t hash[32];
-  sha256sum(&fw[0x4], 156, hash);
-  bool logo_ok = !memcmp(hash, logo_hash, sizeof(logo_hash));
-
-  // Check that the checksum is also valid
-  uint8_t checksum = 0x19;
-  for (unsigned i = 0xA0; i < 0xBD; i++)
-    checksum += fw[i];
-  checksum = -checksum;
-  bool checksum_ok = checksum == fw[0xBD];
-
-  return logo_ok && checksum_ok;
+  consoleSelect(tops);
+  printf("\x1b[9;2H%-28s", "");
+  printf("\x1b[14;2H%-28s", "");
+  consoleSelect(bots);
+  if (cancel_reset()) {
+    printf("\x1b[31;1mCancelled while in %s (%u%%), the firmware is incomplete!\x1b[37;1m\n",
+           flash_job_state_name(job.failed_state), flash_job_progress(&job));
+  }
+  else if (job.state == FLASH_JOB_DONE)
+    printf("\x1b[32;1mFirmware flashed and verified!\x1b[37;1m\n");
+  else if (job.failed_state == FLASH_JOB_VERIFY)
+    printf("\x1b[31;1mValidation error!\x1b[37;1m\n");
+  else if (job.failed_state == FLASH_JOB_PROGRAM)
+    printf("\x1b[31;1mFlashing operation failed!\x1b[37;1m\n");
+  else
+    printf("\x1b[31;1mErase failed!\x1b[37;1m\n");
+  return job.state == FLASH_JOB_DONE;
 }
 
-typedef struct {
-  char fn[PATH_MAX];
-  bool isdir;
-} t_fs_entry;
+// Copies the current firmware to the cart SDRAM (see stage.h), so that it
+// can be restored without keeping it in main RAM. The copy is read back and
+// checked against the flash contents hash (returned in hash), so that a
+// missing or faulty SDRAM is found before flashing. Returns STAGE_NONE if the
+// cart has no room for it or the copy failed.
+static t_stage stage_firmware(uint8_t *hash) {
+  uint32_t size = cart_profile()->fw_size;
+  t_stage st = stage_alloc(size);
+  uint8_t *buf = (uint8_t*)iobuf_get();
+  if (st == STAGE_NONE || !buf) {
+    iobuf_put(buf);
+    return STAGE_NONE;
+  }
 
-int fncomp(const void* a, const void* b) {
-  const t_fs_entry* ea = (t_fs_entry*)a;
-  const t_fs_entry* eb = (t_fs_entry*)b;
-  return strcmp(ea->fn, eb->fn);
+  t_sha256_ctx ctx;
+  sha256_init(&ctx);
+  bool ok = true;
+  for (uint32_t off = 0; off < size && ok; off += IOBUF_SIZE) {
+    unsigned csize = MIN(IOBUF_SIZE, size - off);
+    flash_read(buf, off, csize);
+    sha256_update(&ctx, buf, csize);
+    ok = stage_write(st, off, buf, csize);
+  }
+  sha256_final(&ctx, hash);
+
+  uint8_t rhash[32];
+  sha256_init(&ctx);
+  for (uint32_t off = 0; off < size && ok; off += IOBUF_SIZE) {
+    unsigned csize = MIN(IOBUF_SIZE, size - off);
+    ok = stage_read(st, off, buf, csize);
+    sha256_update(&ctx, buf, csize);
+  }
+  sha256_final(&ctx, rhash);
+  iobuf_put(buf);
+  return ok && !memcmp(hash, rhash, sizeof(rhash)) ? st : STAGE_NONE;
 }
 
-t_fs_entry *listdir(const char *path, unsigned *nume) {
-  unsigned cap = 8, nument = 0;
-  t_fs_entry *ret = (t_fs_entry*)malloc(cap * sizeof(t_fs_entry));
-  ret[0].fn[0] = 0;
-
-  DIR *dirp = opendir(path);
+// Offers flashing back the staged firmware after a failed update. The copy
+// is checked again (hash of the flash contents when staged), the SDRAM might
+// have been overwritten or lost its contents since.
+static void restore_firmware(t_stage st, const uint8_t *hash, PrintConsole *tops, PrintConsole *bots) {
+  consoleSelect(bots);
+  printf("Press A to restore the previous firmware, B to leave it as is\n");
   while (1) {
-    struct dirent *cur = readdir(dirp);
-    if (!cur || !cur->d_name[0])
+    swiWaitForVBlank();
+    scanKeys();
+    if (keysDown() & KEY_B)
+      return;
+    if (keysDown() & KEY_A)
       break;
-    if (cur->d_name[0] == '.' && !cur->d_name[1])
-      continue;
-
-    strcpy(ret[nument].fn, cur->d_name);
-    ret[nument].isdir = cur->d_type == DT_DIR;
-    if (cur->d_type == DT_DIR)
-      strcat(ret[nument].fn, "/");
-    nument++;
-
-    if (nument >= cap) {
-      cap += 8;
-      ret = (t_fs_entry*)realloc(ret, cap * sizeof(t_fs_entry));
-    }
-    ret[nument].fn[0] = 0;
   }
 
-  qsort(ret, nument, sizeof(t_fs_entry), fncomp);
-
-  if (nume) *nume = nument;
-  return ret;
+  unsigned smark = scratch_mark();
+  uint32_t size = cart_profile()->fw_size;
+  uint8_t *fwimg = (uint8_t*)scratch_alloc(size);
+  uint8_t rhash[32];
+  const t_flash_chip *chip = chipdb_lookup(flash_ident());
+  t_flash_plan plan;
+  bool read_ok = fwimg && stage_read(st, 0, fwimg, size);
+  if (read_ok)
+    sha256sum(fwimg, size, rhash);
+  if (!fwimg)
+    printf("Not enough memory to restore the firmware!\n");
+  else if (!read_ok)
+    printf("Could not read the previous firmware back from the cart SDRAM!\n");
+  else if (memcmp(hash, rhash, sizeof(rhash)))
+    printf("The previous firmware copy is corrupted, not restoring it!\n");
+  else if (!flash_plan(&plan, chip, fwimg, size, FLASH_PROG_WORD, chip ? FLASH_OPT_DIFF : 0, true))
+    printf("Not enough memory to restore the firmware!\n");
+  else
+    flash_image(&plan, fwimg, tops, bots);
+  scratch_release(smark);
 }
 
 void select_image(const char *path, PrintConsole *tops, PrintConsole *bots) {
   consoleSelect(bots);
 
-  struct stat st;
-  if (stat(path, &st)) {
-    printf("Could not stat() the selected file (%s)\n", path);
-    return;
-  }
-  if (st.st_size > 512*1024) {
-    printf("The file is bigger than 512KiB!\n");
-    return;  
-  }
-
-  FILE *fd = fopen(path, "rb");
-  if (!fd) {
-    printf("Could not open the selected file!\n");
-    return;  
-  }
-
   printf("Reading file ...\n");
-  uint8_t *fwimg = (uint8_t*)malloc(st.st_size);
-  size_t ret = fread(fwimg, 1, st.st_size, fd);
-  fclose(fd);
-  if (ret != st.st_size) {
-    free(fwimg);
-    printf("Could not read the file correctly!\n");
+  unsigned smark = scratch_mark();
+  uint8_t *fwimg;
+  unsigned fwsize;
+  unsigned err = image_load(path, cart_profile()->fw_size, &fwimg, &fwsize);
+  if (err != IMAGE_LOAD_OK) {
+    scratch_release(smark);
+    if (err == IMAGE_LOAD_NOFILE)
+      printf("Could not open the selected file (%s)\n", path);
+    else if (err == IMAGE_LOAD_TOOBIG)
+      printf("The file is bigger than the flash (%luKiB)!\n", (unsigned long)cart_profile()->fw_size / 1024);
+    else if (err == IMAGE_LOAD_NOMEM)
+      printf("Not enough memory to load the file!\n");
+    else
+      printf("Could not read the file correctly!\n");
     return;
   }
 
-  uint8_t hash[32];
-  sha256sum(fwimg, st.st_size, hash);
+  // The header is always checked on the loaded data (it is cheap). Images
+  // seen before (same size and mtime) are not hashed again: indexed images
+  // reuse the index hash (truncated, like the known images table), the rest
+  // go through the hash cache.
+  bool header_ok = valid_header(fwimg);
+  uint8_t hash[32] = {0};
+  uint32_t fsize, fmtime, hflags;
+  bool stat_ok = storage_stat(path, &fsize, &fmtime);
+  const t_fwindex_entry *ie = stat_ok ? fwindex_lookup(path, fsize, fmtime) : NULL;
+  if (ie)
+    memcpy(hash, ie->sha256, sizeof(ie->sha256));
+  else if (!stat_ok || !hashcache_lookup(path, fsize, fmtime, hash, &hflags)) {
+    sha256sum(fwimg, fwsize, hash);
+    if (stat_ok)
+      hashcache_store(path, fsize, fmtime, hash, header_ok ? HASHCACHE_HDR_OK : 0);
+  }
   printf("File loaded with hash: %02x%02x%02x%02x%02x%02x%02x%02x!\n",
          hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
+  const char *known = image_lookup(hash);
+  if (known)
+    printf("Known image: %s\n", known);
 
-  if (!valid_header(fwimg)) {
-    free(fwimg);
+  if (!header_ok) {
+    scratch_release(smark);
     printf("Invalid firmware file detected (invalid header)\n");
     return;
   } else {
@@ -404,15 +371,45 @@ void select_image(const char *path, PrintConsole *tops, PrintConsole *bots) {
 
   // TODO: Parse SuperFW firmware images for more info.
 
+  // Known chips get a differential update (only the sectors that differ are
+  // rewritten). The plan tells the work and its duration before confirming.
+  uint32_t flashid = 0;
+  cart_detect(&flashid);
+  const t_flash_chip *chip = chipdb_lookup(flashid);
+  t_flash_plan plan;
+  if (!flash_plan(&plan, chip, fwimg, fwsize, FLASH_PROG_WORD, chip ? FLASH_OPT_DIFF : 0, true)) {
+    scratch_release(smark);
+    printf("Not enough memory to plan the flashing!\n");
+    return;
+  }
+
   consoleSelect(tops);
   consoleClear();
   printf("\x1b[1;5HSuperFW flashing tool");
 
   printf("\x1b[4;2HFile: %s", path);
-  printf("\x1b[5;2HSize: %ld bytes", st.st_size);
+  printf("\x1b[5;2HSize: %u bytes", fwsize);
+  if (plan.chip_erase)
+    printf("\x1b[6;2HErase: whole chip");
+  else
+    printf("\x1b[6;2HErase: %u sectors", plan.erase_sectors);
+  printf("\x1b[7;2HProgram: %lu KiB (%u sectors)",
+         (unsigned long)plan.program_words * 2 / 1024, plan.program_sectors);
+  if (chip)
+    printf("\x1b[8;2HEstimated time: %lu.%lu s",
+           (unsigned long)plan.est_ms / 1000, (unsigned long)plan.est_ms % 1000 / 100);
+  else
+    printf("\x1b[8;2HUnknown flash chip!");
 
   printf("\x1b[9;9HReady to flash");
   printf("\x1b[12;2HPress L + R + A to begin");
+  // The rollback copy is optional, it overwrites part of the SDRAM.
+  bool rollback = stage_avail() >= cart_profile()->fw_size;
+  if (rollback) {
+    printf("\x1b[13;2HL + R + Y: with rollback copy");
+    printf("\x1b[16;2H(the copy overwrites the upper");
+    printf("\x1b[17;2H half of the cart SDRAM)");
+  }
 
   printf("\x1b[14;2HPress B to cancel");
 
@@ -424,36 +421,301 @@ void select_image(const char *path, PrintConsole *tops, PrintConsole *bots) {
       break;
 
     if ((keysHeld() & (KEY_L|KEY_R|KEY_A)) == (KEY_L|KEY_R|KEY_A)) {
-      consoleSelect(bots);
-      printf("Erasing flash chip ...\n");
-      if (!flash_erase()) {
-        printf("\x1b[31;1mErase failed!\x1b[37;1m\n");
-        break;
+      flash_image(&plan, fwimg, tops, bots);
+      break;
+    }
+
+    if (rollback && (keysHeld() & (KEY_L|KEY_R|KEY_Y)) == (KEY_L|KEY_R|KEY_Y)) {
+      // The current firmware is staged in the cart SDRAM while flashing, so
+      // that a failed (or cancelled) update can be rolled back.
+      printf("\x1b[13;2H%-28s", "");
+      printf("\x1b[16;2H%-28s", "");
+      printf("\x1b[17;2H%-28s", "");
+      unsigned gmark = stage_mark();
+      uint8_t bhash[32];
+      t_stage backup = stage_firmware(bhash);
+      if (backup == STAGE_NONE) {
+        consoleSelect(bots);
+        printf("Could not copy the current firmware to the cart SDRAM, not flashing!\n");
       }
-      printf("\x1b[32;1mErase operation complete\x1b[37;1m\n");
+      else if (!flash_image(&plan, fwimg, tops, bots))
+        restore_firmware(backup, bhash, tops, bots);
+      stage_release(gmark);
+      break;
+    }
+  }
 
-      if (flash_erase_check()) {
-        printf("\x1b[31;1mErase validation failed!\x1b[37;1m\n");
-        break;
+  scratch_release(smark);
+}
+
+static int idxcomp(const void *a, const void *b) {
+  return strcasecmp(fwindex_get(*(const uint16_t*)a)->path, fwindex_get(*(const uint16_t*)b)->path);
+}
+
+// Flat view of all the firmware images found on the card (the index keeps
+// being updated meanwhile). Returns true if an image was selected, copying
+// its path (FWINDEX_PATH_MAX bytes) to path.
+static bool browse_index(char *path, PrintConsole *tops, PrintConsole *bots) {
+  uint16_t order[FWINDEX_MAX];
+  unsigned cur = 0, top = 0, count = ~0U;
+  bool dirty = true, busy = false;
+
+  while (1) {
+    idle_wait();
+    input_update();
+
+    if (keysDown() & (KEY_B | KEY_SELECT))
+      return false;
+
+    if (count != fwindex_count() || busy != fwindex_busy()) {
+      count = fwindex_count();
+      busy = fwindex_busy();
+      for (unsigned i = 0; i < count; i++)
+        order[i] = i;
+      qsort(order, count, sizeof(order[0]), idxcomp);
+      cur = MIN(cur, count ? count - 1 : 0);
+      dirty = true;
+    }
+
+    if ((keysDown() & KEY_A) && count) {
+      strcpy(path, fwindex_get(order[cur])->path);
+      return true;
+    }
+
+    dirty |= list_navigate(&cur, &top, count);
+
+    if (dirty) {
+      consoleSelect(tops);
+      consoleClear();
+      printf("\x1b[1;5HSuperFW flashing tool");
+      printf("\x1b[3;1H All firmwares (%u)%s", count, busy ? " scanning..." : "");
+
+      for (unsigned i = 0; i < 8 && top + i < count; i++) {
+        const char *p = fwindex_get(order[top + i])->path;
+        const char *bn = strrchr(p, '/');
+        printf("\x1b[%d;1H %s %.28s", 5 + i*2, i + top == cur ? ">" : " ", bn ? bn + 1 : p);
       }
-      printf("Writing flash chip ...\n");
+      dirty = false;
+    }
+  }
+}
 
-      if (flash_write(fwimg, st.st_size))
-        printf("\x1b[32;1mFirmware flashed successfully!\x1b[37;1m\n");
-      else
-        printf("\x1b[31;1mFlashing operation failed!\x1b[37;1m\n");
+static const char * const dump_checks[4] = { "off", "read back", "dual read", "both" };
+static const char * const storage_names[2] = { "DLDI", "cart SD slot" };
+
+// Picks a region range (start and size edited as hex digits) and dumps it to
+// a file named after it. The last range is kept for the session.
+static void range_dump_menu(PrintConsole *tops, PrintConsole *bots) {
+  static const char * const names[ARCHIVE_REGIONS] = { "flash", "sram", "sdram" };
+  static unsigned region = 0;
+  static uint32_t start = 0, size = 0x1000;
+  const t_cart_profile *prof = cart_profile();
+  const uint32_t sizes[ARCHIVE_REGIONS] = { prof->fw_size, prof->sram_size, prof->sdram_size };
+
+  // Field 0 is the region, then the 8 start digits and the 8 size digits.
+  unsigned field = 0;
+  bool dirty = true;
+  while (1) {
+    idle_wait();
+    input_update();
+
+    if (keysDown() & KEY_B)
+      return;
+    if (keysDown() & KEY_A)
+      break;
 
-      printf("Verifying written data ...\n");
-      if (flash_validate(fwimg, st.st_size))
-        printf("\x1b[32;1mValidation passed!\x1b[37;1m\n");
+    if (input_steps(KEY_RIGHT) && field < 16) {
+      field++;
+      dirty = true;
+    }
+    if (input_steps(KEY_LEFT) && field > 0) {
+      field--;
+      dirty = true;
+    }
+    int delta = (int)input_steps(KEY_UP) - (int)input_steps(KEY_DOWN);
+    if (delta && !field)
+      region = (region + ARCHIVE_REGIONS + (delta > 0 ? 1 : -1)) % ARCHIVE_REGIONS;
+    else if (delta) {
+      uint32_t *v = field <= 8 ? &start : &size;
+      unsigned shift = (7 - (field - 1) % 8) * 4;
+      uint32_t digit = ((*v >> shift) + delta) & 0xF;
+      *v = (*v & ~(0xFU << shift)) | (digit << shift);
+    }
+    dirty |= delta != 0;
+
+    if (dirty) {
+      consoleSelect(tops);
+      consoleClear();
+      printf("\x1b[1;5HSuperFW flashing tool");
+      printf("\x1b[4;2HRegion: %-6s (%lu KiB)", names[region], (unsigned long)sizes[region] / 1024);
+      printf("\x1b[6;2HStart:  %08lx", (unsigned long)start);
+      printf("\x1b[8;2HSize:   %08lx", (unsigned long)size);
+      if (!field)
+        printf("\x1b[5;10H^");
       else
-        printf("\x1b[31;1mValidation error!\x1b[37;1m\n");
+        printf("\x1b[%u;%uH^", field <= 8 ? 7 : 9, 10 + (field - 1) % 8);
+      if (!size || start >= sizes[region] || size > sizes[region] - start)
+        printf("\x1b[11;2HThe range does not fit!");
+      printf("\x1b[14;2HPress A to dump, B to go back");
+      dirty = false;
+    }
+  }
+
+  char fn[64];
+  snprintf(fn, sizeof(fn), "fat:/sc_%s_%08lx_%08lx.bin", names[region],
+           (unsigned long)start, (unsigned long)size);
+  consoleSelect(bots);
+  printf("Dumping %s (hold B to cancel) ...\n", fn);
+  uint8_t hash[32];
+  if (range_dump(fn, 1 << region, start, size, hash))
+    printf("Done, sha256 %02x%02x%02x%02x%02x%02x%02x%02x...\n",
+           hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
+  else if (cancel_reset())
+    printf("Cancelled!\n");
+  else
+    printf("\x1b[31;1mDump failed!\x1b[37;1m\n");
+}
+
+static PrintConsole *prod_console;
+
+static void prod_progress(unsigned step) {
+  consoleSelect(prod_console);
+  printf("\x1b[9;2HRunning: %-10s", prod_step_name(step));
+}
+
+static void prod_waiting_screen(PrintConsole *tops, unsigned passed, unsigned failed) {
+  BG_PALETTE[0] = RGB15(0, 0, 0);
+  consoleSelect(tops);
+  consoleClear();
+  printf("\x1b[1;5HSuperFW production mode");
+  printf("\x1b[9;2HInsert a cart ...");
+  printf("\x1b[18;2HPassed: %u  Failed: %u", passed, failed);
+  printf("\x1b[20;2HPress B to exit");
+}
+
+// Dumps the flash or the ROM, resuming the previous dump if it was cancelled
+// (and it is still the same cart and data).
+static void run_dump(uint32_t op, const char *fn, PrintConsole *bots) {
+  consoleSelect(bots);
+  t_resume r;
+  bool ok;
+  if (resume_load(&r) && r.op == op && !strcmp(r.path, fn) && dump_resumable(&r)) {
+    printf("Resuming dump at %lu%% ...\n", (unsigned long)((uint64_t)r.done * 100 / r.total));
+    ok = dump_resume(&r);
+  }
+  else {
+    printf("Starting dump (hold B to cancel) ...\n");
+    ok = op == OP_FLASH_DUMP ? flash_dump(fn) : rom_dump(fn);
+  }
+
+  if (cancel_reset())
+    printf("Cancelled, dump again to resume\n");
+  else if (!ok)
+    printf("Failed!\n");
+  else
+    printf("Dump complete!\n");
+  if (dump_rereads)
+    printf("%lu blocks read again (unstable bus)\n", (unsigned long)dump_rereads);
+}
+
+// Waits for carts to be inserted and runs the configured pipeline on each of
+// them, showing a pass/fail screen until the cart is removed.
+static void production_mode(PrintConsole *tops, PrintConsole *bots) {
+  t_prod_config cfg;
+  consoleSelect(bots);
+  // Swapping carts would pull the card from under the mounted filesystem
+  // (stale FAT and sector cache), corrupting the next card.
+  if (storage_is_slot2()) {
+    printf("Production mode swaps carts, it cannot run with the SD card in the cart slot!\n");
+    return;
+  }
+  if (!prod_load_config(PROD_CONFIG_FILE, &cfg))
+    printf("No %s found, using defaults\n", PROD_CONFIG_FILE);
+
+  unsigned smark = scratch_mark();
+  uint8_t *img = NULL;
+  unsigned imgsize = 0;
+  if (cfg.image[0]) {
+    if (image_load(cfg.image, cart_profile()->fw_size, &img, &imgsize) != IMAGE_LOAD_OK ||
+        imgsize < IMAGE_HEADER_SIZE || !valid_header(img)) {
+      printf("Could not load a valid image from %s\n", cfg.image);
+      scratch_release(smark);
+      return;
+    }
+    printf("Production image: %s\n", cfg.image);
+  }
+  else
+    printf("No image configured, not flashing\n");
 
+  prod_console = tops;
+  unsigned passed = 0, failed = 0, frame = 0;
+  bool processed = false;        // The inserted cart has been processed already
+  bool settling = false;         // A new cart was seen in the previous poll
+  t_cart_state last;
+  memset(&last, 0, sizeof(last));
+
+  prod_waiting_screen(tops, passed, failed);
+  while (1) {
+    swiWaitForVBlank();
+    scanKeys();
+    if (keysDown() & KEY_B)
       break;
+    if (++frame % PROD_POLL_FRAMES)
+      continue;
+
+    t_cart_state st;
+    bool inserted = prod_cart_probe(&st);
+    bool changed = !inserted || memcmp(&st, &last, sizeof(st));
+    last = st;
+
+    if (processed) {
+      // Wait for the cart to be removed (or swapped for a different one).
+      if (!changed)
+        continue;
+      processed = false;
+      prod_waiting_screen(tops, passed, failed);
+    }
+
+    // Process the cart once it reads the same in two consecutive polls.
+    if (!inserted || changed || !settling) {
+      settling = inserted;
+      continue;
     }
+    settling = false;
+
+    consoleSelect(tops);
+    consoleClear();
+    printf("\x1b[1;5HSuperFW production mode");
+    t_prod_result res;
+    prod_run(&cfg, img, imgsize, &res, prod_progress);
+    if (cancel_reset())
+      break;
+    bool ok = !res.failed_step;
+    ok ? passed++ : failed++;
+
+    BG_PALETTE[0] = ok ? RGB15(0, 14, 0) : RGB15(18, 0, 0);
+    consoleSelect(tops);
+    consoleClear();
+    printf("\x1b[1;5HSuperFW production mode");
+    printf("\x1b[5;13H%s", ok ? "PASS" : "FAIL");
+    if (!ok)
+      printf("\x1b[7;2HFailed step: %s", prod_step_name(res.failed_step));
+    printf("\x1b[9;2HChip: %.24s", res.chip ? res.chip->name : "unknown");
+    printf("\x1b[10;2HFirmware: %.20s", res.fw_name ? res.fw_name : "unknown");
+    printf("\x1b[11;2HBackup: %s  Flashed: %s", res.backed_up ? "new" : "no", res.flashed ? "yes" : "no");
+    if (res.sram_errors)
+      printf("\x1b[12;2HSRAM errors: %u", res.sram_errors);
+    printf("\x1b[14;2HTime: %lu ms", res.ticks / (PLATFORM_TICKS_PER_SEC / 1000));
+    printf("\x1b[16;2HRemove the cart");
+    printf("\x1b[18;2HPassed: %u  Failed: %u", passed, failed);
+
+    // Flashing changes the header, take the final state as reference.
+    prod_cart_probe(&last);
+    processed = true;
   }
 
-  free(fwimg);
+  BG_PALETTE[0] = RGB15(0, 0, 0);
+  scratch_release(smark);
 }
 
 int main(int argc, char **argv) {
@@ -467,47 +729,69 @@ int main(int argc, char **argv) {
   consoleInit(&tops, 3, BgType_Text4bpp, BgSize_T_256x256, 31, 0, true, true);
   consoleInit(&bots, 3, BgType_Text4bpp, BgSize_T_256x256, 31, 0, false, true);
 
-  // Init FAT filesystem and slot2 ...
+  platform_init();
+  sched_add(fwindex_step, SCHED_PRIO_LOW, FWINDEX_BUDGET);
+  cancel_set_check(cancel_check);
+  cart_detect(NULL);
+
+  // The FAT filesystem is mounted on first use (see storage_mount).
   consoleSelect(&bots);
   consoleClear();
   printf("Debug console:\n\n");
-  if (!fatInitDefault()) {
-    perror("fatInitDefault()");
-  }
   printf("DLDI name:\n%s\n\n", io_dldi_data->friendlyName);
   printf("DSi mode: %d\n\n", isDSiMode());
 
   unsigned menu_sel = 0;
+  bool redraw = true, index_started = false;
   while (1) {
-    // Render menu
-    consoleSelect(&tops);
-    consoleClear();
-    printf("\x1b[36;1m");
-    printf("\x1b[1;5HSuperFW flashing tool");
-    printf("\x1b[37;1m");
-
-    printf("\x1b[5;1H %s Identify cart", menu_sel == 0 ? ">" : " ");
-    printf("\x1b[7;1H %s Dump flash",    menu_sel == 1 ? ">" : " ");
-    printf("\x1b[9;1H %s Write flash",   menu_sel == 2 ? ">" : " ");
-    printf("\x1b[11;1H %s Dump ROM",     menu_sel == 3 ? ">" : " ");
-    printf("\x1b[13;1H %s Test SRAM",    menu_sel == 4 ? ">" : " ");
+    // Render menu (only when something changed)
+    if (redraw) {
+      consoleSelect(&tops);
+      consoleClear();
+      printf("\x1b[36;1m");
+      printf("\x1b[1;5HSuperFW flashing tool v0.3");
+      printf("\x1b[37;1m");
+
+      printf("\x1b[3;1H %s Identify cart", menu_sel == 0 ? ">" : " ");
+      printf("\x1b[5;1H %s Dump flash",    menu_sel == 1 ? ">" : " ");
+      printf("\x1b[7;1H %s Write flash",   menu_sel == 2 ? ">" : " ");
+      printf("\x1b[9;1H %s Dump ROM",     menu_sel == 3 ? ">" : " ");
+      printf("\x1b[11;1H %s Test SRAM",    menu_sel == 4 ? ">" : " ");
+      printf("\x1b[13;1H %s Bus trace: %s", menu_sel == 5 ? ">" : " ", trace_enabled ? "on" : "off");
+      printf("\x1b[15;1H %s Production mode", menu_sel == 6 ? ">" : " ");
+      printf("\x1b[17;1H %s Archive cart", menu_sel == 7 ? ">" : " ");
+      printf("\x1b[19;1H %s Dump checks: %s", menu_sel == 8 ? ">" : " ",
+             dump_checks[dump_verify | (dump_dual_read << 1)]);
+      printf("\x1b[21;1H %s Dump range", menu_sel == 9 ? ">" : " ");
+      printf("\x1b[23;1H %s Storage: %s", menu_sel == 10 ? ">" : " ", storage_names[storage_target()]);
+      redraw = false;
+    }
 
-    printf("\x1b[20;8H Version 0.3");
-
-    swiWaitForVBlank();
-    scanKeys();
+    idle_wait();
+    input_update();
 
     if (keysDown() & KEY_A) {
+      redraw = true;     // Operations might use the top screen
       switch (menu_sel) {
       case 0:
         consoleSelect(&bots);
-        printf("Identified flash device ID as %08lx\n", flash_ident());
         {
-          const char *fwname = firmware_ident();
+          uint32_t flashid;
+          const t_cart_profile *prof = cart_detect(&flashid);
+          if (!prof)
+            flashid = flash_ident();
+          const t_flash_chip *chip = chipdb_lookup(flashid);
+          printf("Identified flash device ID as %08lx (%s)\n", flashid, chip ? chip->name : "unknown");
+          if (prof)
+            printf("Cart profile: %s\n", prof->name);
+        }
+        {
+          bool header_ok;
+          const char *fwname = firmware_ident(&header_ok);
           if (fwname)
             printf("Identified the firmware as %s\n", fwname);
           else {
-            if (!valid_header((uint8_t*)0x08000000))
+            if (!header_ok)
               printf("Invalid firmware header detected!\n");
             else
               printf("Unknown firmware detected!\n");
@@ -516,7 +800,7 @@ int main(int argc, char **argv) {
         break;
       case 4:
         {
-          unsigned numerrs = test_sram();
+          unsigned numerrs = slot2_sram_test();
           consoleSelect(&bots);
           if (numerrs)
             printf("\x1b[31;1mSRAM check failed with %d diffs!\x1b[37;1m\n", numerrs);
@@ -525,88 +809,168 @@ int main(int argc, char **argv) {
         }
         break;
       case 1:
-        consoleSelect(&bots);
-        printf("Starting dump ...\n");
-        if (!flash_dump("fat:/sc_flash_dump.bin"))
-          printf("Failed!\n");
-        else
-          printf("Dump complete!\n");
+        run_dump(OP_FLASH_DUMP, "fat:/sc_flash_dump.bin", &bots);
         break;
       case 3:
-        consoleSelect(&bots);
-        printf("Starting dump ...\n");
-        if (!rom_dump("fat:/sc_rom_dump.bin"))
-          printf("Failed!\n");
-        else
-          printf("Dump complete!\n");
+        run_dump(OP_ROM_DUMP, "fat:/sc_rom_dump.bin", &bots);
         break;
       case 2:
+        if (!storage_mount()) {
+          consoleSelect(&bots);
+          printf("Could not mount the SD card (%s)!\n", storage_names[storage_target()]);
+          if (storage_target() == STORAGE_DLDI)
+            printf("The cart SD slot can be selected in the menu (Storage)\n");
+          break;
+        }
+        // Index the firmware images in the background (once per session).
+        if (!index_started) {
+          fwindex_start();
+          index_started = true;
+        }
         // Present a small file browser or something.
         char curpath[PATH_MAX] = "fat:/";
         unsigned cur_entry = 0, top_entry = 0;
         unsigned num_entries;
-        t_fs_entry * l = listdir(curpath, &num_entries);
+        bool truncated;
+        unsigned smark = scratch_mark();
+        t_fs_index * l = listdir(curpath, &num_entries, &truncated);
+        if (!l) {
+          consoleSelect(&bots);
+          printf("Not enough memory to list files!\n");
+          break;
+        }
 
+        bool dirty = true;
         while (1) {
-          swiWaitForVBlank();
-          scanKeys();
+          idle_wait();
+          input_update();
 
           if (keysDown() & KEY_B)
             break;
           if (keysDown() & KEY_A) {
-            if (l[cur_entry].fn[0]) {
+            if (l[cur_entry].ent) {
               char tmp[PATH_MAX];
+              // Same path format as the index ("fat:/file", not "fat://file").
               strcpy(tmp, curpath);
-              strcat(tmp, "/");
-              strcat(tmp, l[cur_entry].fn);
+              if (tmp[strlen(tmp) - 1] != '/')
+                strcat(tmp, "/");
+              strcat(tmp, l[cur_entry].ent->fn);
 
-              if (l[cur_entry].fn[strlen(l[cur_entry].fn)-1] == '/') {
+              if (l[cur_entry].ent->isdir) {
                 // Is a directory, go down the rabbit hole
                 realpath(tmp, curpath);  // Simplify the path (like "//" or "/../")
 
                 top_entry = cur_entry = 0;
-                free(l);
-                l = listdir(curpath, &num_entries);
+                dirty = true;
+                scratch_release(smark);
+                if (!(l = listdir(curpath, &num_entries, &truncated))) {
+                  consoleSelect(&bots);
+                  printf("Not enough memory to list files!\n");
+                  break;
+                }
               }
               else {
+                // The listing is not needed anymore, leave the memory to
+                // load the image.
+                scratch_release(smark);
                 select_image(tmp, &tops, &bots);
                 break; //  Go back
               }
             }
           }
 
-          if (keysDown() & KEY_DOWN)
-            cur_entry = cur_entry + 1 < num_entries ? cur_entry + 1 : cur_entry;
-          if (keysDown() & KEY_UP)
-            cur_entry = cur_entry ? cur_entry - 1 : 0;
+          if (keysDown() & KEY_SELECT) {
+            // Flat view of all the indexed images.
+            char path[FWINDEX_PATH_MAX];
+            if (browse_index(path, &tops, &bots)) {
+              scratch_release(smark);
+              select_image(path, &tops, &bots);
+              break;
+            }
+            dirty = true;
+          }
 
-          if ((signed)cur_entry - (signed)top_entry >= 8)
-            top_entry = cur_entry - 7;
-          if (cur_entry < top_entry)
-            top_entry = cur_entry;
+          dirty |= list_navigate(&cur_entry, &top_entry, num_entries);
 
-          // Render path list
-          consoleSelect(&tops);
-          consoleClear();
-          printf("\x1b[1;5HSuperFW flashing tool");
+          // Render path list (only when the selection or the listing changed)
+          if (dirty) {
+            consoleSelect(&tops);
+            consoleClear();
+            printf("\x1b[1;5HSuperFW flashing tool");
 
-          for (unsigned i = 0; i < 8; i++) {
-            if (!l[top_entry + i].fn[0])
-              break;
-            printf("\x1b[%d;1H %s %.28s", 5 + i*2, i + top_entry == cur_entry ? ">" : " ", l[top_entry + i].fn);
+            for (unsigned i = 0; i < 8; i++) {
+              if (!l[top_entry + i].ent)
+                break;
+              printf("\x1b[%d;1H %s %.28s", 5 + i*2, i + top_entry == cur_entry ? ">" : " ", l[top_entry + i].ent->fn);
+            }
+            if (truncated)
+              printf("\x1b[22;2HListing truncated (no memory)");
+            dirty = false;
           }
         }
-        free(l);
+        scratch_release(smark);
+        break;
+      case 5:
+        consoleSelect(&bots);
+        if (trace_enabled) {
+          trace_stop();
+          printf("Bus tracing disabled\n");
+        } else {
+          trace_start();
+          printf("Bus tracing enabled\n");
+        }
         break;
-      };    
+      case 6:
+        production_mode(&tops, &bots);
+        break;
+      case 7:
+        consoleSelect(&bots);
+        printf("Archiving flash, SRAM and SDRAM ...\n");
+        if (!cart_archive(ARCHIVE_FILE, ARCHIVE_ALL))
+          printf(cancel_reset() ? "Cancelled!\n" : "Failed!\n");
+        else
+          printf("Archive written to %s\n", ARCHIVE_FILE);
+        break;
+      case 8:
+        // Cycles through off, read back, dual read and both.
+        {
+          unsigned checks = ((dump_verify | (dump_dual_read << 1)) + 1) % 4;
+          dump_verify = checks & 1;
+          dump_dual_read = checks & 2;
+        }
+        break;
+      case 9:
+        range_dump_menu(&tops, &bots);
+        break;
+      case 10:
+        // The card is picked before it is mounted (ie. after the DLDI one
+        // failed), the filesystem then stays mounted for the whole session.
+        consoleSelect(&bots);
+        if (!storage_select(!storage_target()))
+          printf("The SD card is in use, restart to change it\n");
+        break;
+      };
+
+      // Keep the trace on the SD card after every operation.
+      if (trace_enabled && menu_sel != 5 && menu_sel != 8 && menu_sel != 10) {
+        consoleSelect(&bots);
+        if (trace_save(TRACE_FILE))
+          printf("Bus trace saved to %s\n", TRACE_FILE);
+        else
+          printf("Could not save the bus trace!\n");
+      }
     }
 
     if (keysDown() & KEY_START)
       break;
-    if (keysDown() & KEY_DOWN)
-      menu_sel = (menu_sel + 1) % 4;
-    if (keysDown() & KEY_UP)
-      menu_sel = (menu_sel + 3) % 4;
+    if (input_steps(KEY_DOWN)) {
+      menu_sel = (menu_sel + 1) % MENU_ENTRIES;
+      redraw = true;
+    }
+    if (input_steps(KEY_UP)) {
+      menu_sel = (menu_sel + MENU_ENTRIES - 1) % MENU_ENTRIES;
+      redraw = true;
+    }
   }
 
   return 0;
@@ -0,0 +1,25 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// NDS timing primitives.
+
+#include <nds.h>
+
+#include "platform.h"
+
+void platform_init() {
+  // Timers 0 and 1 are cascaded into a 32 bit bus clock counter.
+  cpuStartTiming(0);
+}
+
+uint32_t platform_ticks() {
+  return cpuGetTiming();
+}
+
+uint32_t platform_ticks_to_vblank() {
+  return platform_lines_to_vblank(REG_VCOUNT) * PLATFORM_LINE_TICKS;
+}
+
+void sleep_1ms() {
+  for (unsigned i = 0; i < (1<<14); i++)
+    asm volatile ("nop");
+}
@@ -0,0 +1,33 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Timing primitives. On the NDS these use the hardware timers, when building
+// the host tools (SUPERFW_HOST) they are provided by the simulator.
+
+#ifndef _PLATFORM_H_
+#define _PLATFORM_H_
+
+#include <stdint.h>
+
+// Tick counter rate (the DS bus clock).
+#define PLATFORM_TICKS_PER_SEC   33513982
+
+// Frames are 263 lines of 2130 ticks, VBlank starts at line 192.
+#define PLATFORM_LINE_TICKS      2130
+#define PLATFORM_FRAME_LINES     263
+#define PLATFORM_VBLANK_LINE     192
+
+// Lines left until the next VBlank starts, given the current line (VCOUNT).
+// Right after a VBlank started (line 192) that is the whole next frame.
+static inline unsigned platform_lines_to_vblank(unsigned vcount) {
+  return PLATFORM_FRAME_LINES -
+         (vcount + PLATFORM_FRAME_LINES - PLATFORM_VBLANK_LINE) % PLATFORM_FRAME_LINES;
+}
+
+void platform_init();
+// Free running tick counter (wraps around every ~128 seconds).
+uint32_t platform_ticks();
+// Ticks left until the next VBlank starts.
+uint32_t platform_ticks_to_vblank();
+void sleep_1ms();
+
+#endif
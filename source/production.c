@@ -0,0 +1,165 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Production line mode, see production.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cancel.h"
+#include "dump.h"
+#include "flash.h"
+#include "platform.h"
+#include "production.h"
+#include "slot2.h"
+#include "storage.h"
+
+static const char *step_names[] = {"ident", "backup", "flash", "verify", "sram"};
+
+const char *prod_step_name(unsigned step) {
+  for (unsigned i = 0; i < sizeof(step_names) / sizeof(step_names[0]); i++)
+    if (step == (1U << i))
+      return step_names[i];
+  return "none";
+}
+
+static unsigned parse_steps(char *val) {
+  unsigned ret = 0;
+  for (char *tok = strtok(val, ", "); tok; tok = strtok(NULL, ", "))
+    for (unsigned i = 0; i < sizeof(step_names) / sizeof(step_names[0]); i++)
+      if (!strcasecmp(tok, step_names[i]))
+        ret |= 1U << i;
+  return ret;
+}
+
+bool prod_load_config(const char *path, t_prod_config *cfg) {
+  cfg->image[0] = 0;
+  cfg->steps = PROD_STEP_ALL;
+  cfg->method = FLASH_PROG_WORD;
+  cfg->opts = 0;
+
+  t_sfile *fd = storage_open(path, "rb");
+  if (!fd)
+    return false;
+
+  char buf[1024];
+  unsigned len = storage_read(fd, buf, sizeof(buf) - 1);
+  storage_close(fd);
+  buf[len] = 0;
+
+  // One "key=value" per line, '#' starts a comment.
+  char *saveptr;
+  for (char *line = strtok_r(buf, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+    char *val = strchr(line, '=');
+    if (line[0] == '#' || !val)
+      continue;
+    *val++ = 0;
+
+    if (!strcmp(line, "image"))
+      snprintf(cfg->image, sizeof(cfg->image), "%s", val);
+    else if (!strcmp(line, "steps"))
+      cfg->steps = parse_steps(val);
+    else if (!strcmp(line, "method")) {
+      if (!strcasecmp(val, "bypass"))
+        cfg->method = FLASH_PROG_BYPASS;
+      else if (!strcasecmp(val, "buffered"))
+        cfg->method = FLASH_PROG_BUFFERED;
+      else
+        cfg->method = FLASH_PROG_WORD;
+    }
+    else if (!strcmp(line, "diff") && atoi(val))
+      cfg->opts |= FLASH_OPT_DIFF;
+    else if (!strcmp(line, "sparse") && atoi(val))
+      cfg->opts |= FLASH_OPT_SPARSE;
+  }
+
+  return true;
+}
+
+bool prod_cart_probe(t_cart_state *st) {
+  memset(st, 0, sizeof(*st));
+  // Carts of a different variant can be inserted at any time.
+  if (!cart_detect(&st->flash_id))
+    return false;
+
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_read_block(st->header, 0, sizeof(st->header));
+  slot2_release(pmode);
+  return true;
+}
+
+// Runs the steps, returns the failing one (or zero).
+static unsigned run_steps(const t_prod_config *cfg, const uint8_t *img, unsigned size,
+                          t_prod_result *res, void (*progress)(unsigned step)) {
+  // Flashing and backups need the chip and firmware identification.
+  uint8_t hash[32];
+  if (cfg->steps & (PROD_STEP_IDENT | PROD_STEP_BACKUP | PROD_STEP_FLASH)) {
+    if (progress)
+      progress(PROD_STEP_IDENT);
+    res->flash_id = flash_ident();
+    res->chip = chipdb_lookup(res->flash_id);
+    if (!res->chip || !flash_hash(hash, NULL, 0))
+      return PROD_STEP_IDENT;
+    res->fw_name = image_lookup(hash);
+  }
+
+  if (cfg->steps & PROD_STEP_BACKUP) {
+    if (progress)
+      progress(PROD_STEP_BACKUP);
+    // Backups are named after the firmware hash, so each firmware is only
+    // dumped once. They are dumped to a temporary name and renamed once
+    // complete, so that a failed (or cancelled) dump is never taken for one.
+    char fn[64], tmpfn[64];
+    snprintf(fn, sizeof(fn), "fat:/sc_backup_%02x%02x%02x%02x%02x%02x%02x%02x.bin",
+             hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
+    snprintf(tmpfn, sizeof(tmpfn), "%.*s.tmp", (int)strlen(fn) - 4, fn);
+    uint32_t bsize, mtime;
+    if (!storage_stat(fn, &bsize, &mtime) || bsize != cart_profile()->fw_size) {
+      storage_remove(fn);
+      res->backed_up = flash_dump(tmpfn) && storage_rename(tmpfn, fn);
+      if (!res->backed_up) {
+        storage_remove(tmpfn);
+        resume_clear(OP_FLASH_DUMP, tmpfn);
+        return PROD_STEP_BACKUP;
+      }
+    }
+  }
+
+  if ((cfg->steps & PROD_STEP_FLASH) && img) {
+    if (progress)
+      progress(PROD_STEP_FLASH);
+    if (!flash_compare(img, size)) {
+      res->flashed = true;
+      if (!flash_update(res->chip, img, size, cfg->method, cfg->opts))
+        return PROD_STEP_FLASH;
+    }
+  }
+
+  if ((cfg->steps & PROD_STEP_VERIFY) && img) {
+    if (progress)
+      progress(PROD_STEP_VERIFY);
+    if (!flash_validate(img, size))
+      return PROD_STEP_VERIFY;
+  }
+
+  if (cfg->steps & PROD_STEP_SRAM) {
+    if (progress)
+      progress(PROD_STEP_SRAM);
+    if ((res->sram_errors = slot2_sram_test()))
+      return PROD_STEP_SRAM;
+  }
+
+  return 0;
+}
+
+void prod_run(const t_prod_config *cfg, const uint8_t *img, unsigned size,
+              t_prod_result *res, void (*progress)(unsigned step)) {
+  uint32_t start = platform_ticks();
+  memset(res, 0, sizeof(*res));
+  // Carts can look alike (same chip and header), never trust a previous one.
+  flash_cache_invalidate();
+  res->failed_step = run_steps(cfg, img, size, res, progress);
+  res->ticks = platform_ticks() - start;
+}
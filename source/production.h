@@ -0,0 +1,59 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Production line mode: cart detection and the per-cart pipeline.
+
+#ifndef _PRODUCTION_H_
+#define _PRODUCTION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chipdb.h"
+#include "image.h"
+
+#define PROD_CONFIG_FILE   "fat:/sc_production.cfg"
+
+// Pipeline steps (run in this order)
+#define PROD_STEP_IDENT     0x01     // Identify the chip and the firmware
+#define PROD_STEP_BACKUP    0x02     // Dump the firmware (once per firmware hash)
+#define PROD_STEP_FLASH     0x04     // Flash the image (if the cart has a different one)
+#define PROD_STEP_VERIFY    0x08     // Validate the flash contents against the image
+#define PROD_STEP_SRAM      0x10     // SRAM test
+#define PROD_STEP_ALL       0x1F
+
+typedef struct {
+  char image[256];              // Image to flash (empty for none)
+  unsigned steps;               // PROD_STEP_* mask
+  unsigned method, opts;        // Flashing method and options (see flash.h)
+} t_prod_config;
+
+typedef struct {
+  uint32_t flash_id;
+  const t_flash_chip *chip;
+  const char *fw_name;          // Firmware found in the cart (if well-known)
+  bool backed_up;               // A new backup was written
+  bool flashed;                 // The image was written (it was not there already)
+  unsigned failed_step;         // Step that failed (or zero)
+  unsigned sram_errors;
+  uint32_t ticks;               // Time spent (platform ticks)
+} t_prod_result;
+
+// Cart signature, used to detect cart insertion/removal (or a cart swap).
+typedef struct {
+  uint32_t flash_id;
+  uint8_t header[IMAGE_HEADER_SIZE];
+} t_cart_state;
+
+// Loads the config file, unknown keys are ignored. Missing files result in
+// the default config (all steps, word programming, no image).
+bool prod_load_config(const char *path, t_prod_config *cfg);
+// Returns false if there is no cart (or no known flash chip answers).
+bool prod_cart_probe(t_cart_state *st);
+// Runs the configured pipeline on the inserted cart. The progress callback
+// (if any) is called before every step.
+void prod_run(const t_prod_config *cfg, const uint8_t *img, unsigned size,
+              t_prod_result *res, void (*progress)(unsigned step));
+// Short name of a step.
+const char *prod_step_name(unsigned step);
+
+#endif
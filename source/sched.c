@@ -0,0 +1,61 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Cooperative background task scheduler, see sched.h
+
+#include "platform.h"
+#include "sched.h"
+
+typedef struct {
+  t_sched_fn fn;
+  unsigned prio;
+  uint32_t max_budget;
+} t_task;
+
+// Kept sorted by priority (tasks with the same priority run in order of
+// registration).
+static t_task tasks[SCHED_MAX_TASKS];
+static unsigned num_tasks = 0;
+
+bool sched_add(t_sched_fn fn, unsigned prio, uint32_t max_budget) {
+  if (num_tasks == SCHED_MAX_TASKS)
+    return false;
+
+  unsigned i = num_tasks++;
+  for (; i > 0 && tasks[i - 1].prio > prio; i--)
+    tasks[i] = tasks[i - 1];
+  tasks[i].fn = fn;
+  tasks[i].prio = prio;
+  tasks[i].max_budget = max_budget;
+  return true;
+}
+
+void sched_remove(t_sched_fn fn) {
+  unsigned n = 0;
+  for (unsigned i = 0; i < num_tasks; i++)
+    if (tasks[i].fn != fn)
+      tasks[n++] = tasks[i];
+  num_tasks = n;
+}
+
+bool sched_run(uint32_t budget) {
+  uint32_t start = platform_ticks();
+  bool pending = false;
+  for (unsigned i = 0; i < num_tasks; i++) {
+    uint32_t used = platform_ticks() - start;
+    if (used >= budget) {
+      pending = true;    // Unknown, assume there is work left
+      break;
+    }
+    uint32_t left = budget - used;
+    pending |= tasks[i].fn(left < tasks[i].max_budget ? left : tasks[i].max_budget);
+  }
+  return pending;
+}
+
+uint32_t sched_idle() {
+  uint32_t left = platform_ticks_to_vblank();
+  if (left <= SCHED_IDLE_MARGIN)
+    return 0;
+  sched_run(left - SCHED_IDLE_MARGIN);
+  return left - SCHED_IDLE_MARGIN;
+}
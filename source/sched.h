@@ -0,0 +1,42 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Cooperative background task scheduler.
+//
+// Background work (indexing, hashing, ...) is split in small steps that run
+// in the idle time of every frame. Tasks are step functions that do work for
+// up to the given budget (in platform ticks) and return whether they have
+// more work pending. Every sched_run call goes through the tasks in priority
+// order, each task gets the remaining budget (capped to its own per-frame
+// budget).
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "platform.h"
+
+#define SCHED_MAX_TASKS    8
+// Idle time left unused by sched_idle (task step overruns)
+#define SCHED_IDLE_MARGIN  (PLATFORM_TICKS_PER_SEC / 500)
+
+// Priorities (lower runs first)
+#define SCHED_PRIO_HIGH    0
+#define SCHED_PRIO_NORMAL  1
+#define SCHED_PRIO_LOW     2
+
+typedef bool (*t_sched_fn)(uint32_t budget);
+
+// Registers a task, returns false if there are too many.
+bool sched_add(t_sched_fn fn, unsigned prio, uint32_t max_budget);
+void sched_remove(t_sched_fn fn);
+// Runs the tasks for up to budget ticks. Returns true if any task has work
+// pending.
+bool sched_run(uint32_t budget);
+// Runs the tasks in the time left until the next VBlank (minus the margin),
+// meant to be called right before waiting for it. Returns the budget given
+// to the tasks (zero if there was no time left).
+uint32_t sched_idle();
+
+#endif
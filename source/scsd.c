@@ -0,0 +1,330 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// SuperCard SD interface driver, see scsd.h
+
+#include <string.h>
+
+#include "platform.h"
+#include "scsd.h"
+#include "slot2.h"
+
+// The host tools drive a simulated cart per thread.
+#ifdef SUPERFW_HOST
+  #define SCSD_TLS  __thread
+#else
+  #define SCSD_TLS
+#endif
+
+#define CMD_TIMEOUT     (PLATFORM_TICKS_PER_SEC / 100)   // Response, CRC status token
+#define DATA_TIMEOUT    (PLATFORM_TICKS_PER_SEC / 10)    // Read access time
+#define BUSY_TIMEOUT    (PLATFORM_TICKS_PER_SEC / 2)     // Programming (write busy)
+#define INIT_TIMEOUT    (PLATFORM_TICKS_PER_SEC)         // ACMD41 power up
+
+#define SCSD_RETRIES    2       // Extra attempts for a failed block
+
+#define DAT0            0x100
+
+// Response types (and their size in bytes)
+#define RESP_NONE       0
+#define RESP_R1         6       // Also R6 and R7, same framing
+#define RESP_R2         17
+#define RESP_R3         6       // No CRC nor command index
+
+#define R1_ERRORS       0xFDF90008     // Error bits of the card status
+
+#define OCR_READY       0x80000000
+#define OCR_CCS         0x40000000     // Card capacity status (high capacity)
+#define OCR_HCS         0x40000000     // ACMD41: host supports high capacity
+#define OCR_VOLTAGES    0x00FF8000     // 2.7 to 3.6V
+
+static SCSD_TLS struct {
+  bool ready;
+  bool hc;              // Block (rather than byte) addressing
+  uint16_t rca;
+  uint32_t sectors;
+} card;
+
+static inline uint16_t cmd_clock() {
+  return slot2_raw_read16(SCSD_CMD_WADDR);
+}
+
+static inline uint16_t dat_clock() {
+  return slot2_raw_read16(SCSD_DATA_RD_WADDR);
+}
+
+static inline void dat_out(uint16_t nibbles) {
+  slot2_raw_write16(SCSD_DATA_WR_WADDR, nibbles);
+}
+
+static inline uint32_t be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint8_t crc7(const uint8_t *data, unsigned size) {
+  uint8_t crc = 0;
+  for (unsigned i = 0; i < size; i++) {
+    for (int b = 7; b >= 0; b--) {
+      unsigned fb = ((data[i] >> b) & 1) ^ (crc >> 6);
+      crc = (crc << 1) & 0x7F;
+      if (fb)
+        crc ^= 0x09;
+    }
+  }
+  return crc;
+}
+
+// CRC16 of every DAT line, packed as they go on the bus: one nibble (the
+// same bit of the 4 CRCs) per clock, MSB first.
+static void crc16_lines(const uint8_t *data, unsigned size, uint8_t *out) {
+  uint16_t crc[4] = {0};
+  for (unsigned i = 0; i < size * 2; i++) {
+    unsigned nibble = (i & 1) ? data[i / 2] & 0xF : data[i / 2] >> 4;
+    for (unsigned l = 0; l < 4; l++) {
+      unsigned fb = ((nibble >> l) & 1) ^ (crc[l] >> 15);
+      crc[l] <<= 1;
+      if (fb)
+        crc[l] ^= 0x1021;
+    }
+  }
+  for (unsigned k = 0; k < 16; k++) {
+    unsigned nibble = 0;
+    for (unsigned l = 0; l < 4; l++)
+      nibble |= ((crc[l] >> (15 - k)) & 1) << l;
+    if (k & 1)
+      out[k / 2] |= nibble;
+    else
+      out[k / 2] = nibble << 4;
+  }
+}
+
+static bool send_cmd(unsigned cmd, uint32_t arg) {
+  uint8_t buf[6] = { 0x40 | cmd, arg >> 24, arg >> 16, arg >> 8, arg, 0 };
+  buf[5] = (crc7(buf, 5) << 1) | 1;
+
+  // The CMD line must be idle (high) before starting.
+  uint32_t start = platform_ticks();
+  while (!(cmd_clock() & 1))
+    if (platform_ticks() - start > CMD_TIMEOUT)
+      return false;
+
+  for (unsigned i = 0; i < sizeof(buf); i++)
+    for (int b = 7; b >= 0; b--)
+      slot2_raw_write16(SCSD_CMD_WADDR, buf[i] << (7 - b));
+  return true;
+}
+
+static bool get_response(uint8_t *resp, unsigned size) {
+  uint32_t start = platform_ticks();
+  while (cmd_clock() & 1)
+    if (platform_ticks() - start > CMD_TIMEOUT)
+      return false;
+
+  // The start bit (zero) was just read.
+  unsigned byte = 0;
+  for (unsigned bit = 1; bit < size * 8; bit++) {
+    byte = (byte << 1) | (cmd_clock() & 1);
+    if ((bit & 7) == 7) {
+      resp[bit / 8] = byte;
+      byte = 0;
+    }
+  }
+  // The card needs 8 clocks before the next command.
+  for (unsigned i = 0; i < 8; i++)
+    cmd_clock();
+  return true;
+}
+
+static bool command(unsigned cmd, uint32_t arg, uint8_t *resp, unsigned rtype) {
+  if (!send_cmd(cmd, arg))
+    return false;
+
+  switch (rtype) {
+  case RESP_NONE:
+    for (unsigned i = 0; i < 8; i++)
+      cmd_clock();
+    return true;
+  case RESP_R2:
+    return get_response(resp, RESP_R2);
+  default:
+    if (!get_response(resp, RESP_R1))
+      return false;
+    // R3 carries no command index nor CRC.
+    return cmd == 41 ||
+           ((resp[0] & 0x3F) == cmd && (resp[5] >> 1) == crc7(resp, 5));
+  };
+}
+
+static bool app_command(unsigned cmd, uint32_t arg, uint8_t *resp, unsigned rtype) {
+  uint8_t r1[RESP_R1];
+  return command(55, (uint32_t)card.rca << 16, r1, RESP_R1) && command(cmd, arg, resp, rtype);
+}
+
+// Waits for the card to release DAT0 (programming or stopping).
+static bool wait_busy() {
+  uint32_t start = platform_ticks();
+  while (!(dat_clock() & DAT0))
+    if (platform_ticks() - start > BUSY_TIMEOUT)
+      return false;
+  return true;
+}
+
+// Bits msb..lsb of a 128 bit register (as received in R2).
+static uint32_t reg_bits(const uint8_t *reg, unsigned msb, unsigned lsb) {
+  uint32_t v = 0;
+  for (int b = msb; b >= (int)lsb; b--)
+    v = (v << 1) | ((reg[15 - b / 8] >> (b % 8)) & 1);
+  return v;
+}
+
+static uint32_t csd_sectors(const uint8_t *csd) {
+  if (reg_bits(csd, 127, 126) == 1)
+    return (reg_bits(csd, 69, 48) + 1) * 1024;
+
+  unsigned shift = reg_bits(csd, 49, 47) + 2 + reg_bits(csd, 83, 80);
+  return (reg_bits(csd, 73, 62) + 1) << (shift - 9);
+}
+
+bool scsd_init() {
+  uint8_t resp[RESP_R2];
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_SDRAM, false, true);
+  memset(&card, 0, sizeof(card));
+
+  // At least 74 clocks with CMD high before the first command.
+  for (unsigned i = 0; i < 80; i++)
+    cmd_clock();
+
+  bool ok = command(0, 0, NULL, RESP_NONE);
+  // Only v2 cards answer CMD8 (echoing the check pattern), those might be
+  // high capacity ones.
+  bool v2 = ok && command(8, 0x1AA, resp, RESP_R1) && (be32(&resp[1]) & 0xFFF) == 0x1AA;
+
+  uint32_t ocr = 0;
+  uint32_t start = platform_ticks();
+  while (ok && !(ocr & OCR_READY)) {
+    ok = app_command(41, (v2 ? OCR_HCS : 0) | OCR_VOLTAGES, resp, RESP_R3) &&
+         platform_ticks() - start < INIT_TIMEOUT;
+    ocr = be32(&resp[1]);
+  }
+  card.hc = ocr & OCR_CCS;
+
+  ok = ok && command(2, 0, resp, RESP_R2) && command(3, 0, resp, RESP_R1);
+  if (ok)
+    card.rca = (resp[1] << 8) | resp[2];
+  ok = ok && command(9, (uint32_t)card.rca << 16, resp, RESP_R2);
+  if (ok)
+    card.sectors = csd_sectors(&resp[1]);
+  ok = ok && command(7, (uint32_t)card.rca << 16, resp, RESP_R1) && wait_busy();
+  ok = ok && app_command(6, 2, resp, RESP_R1);     // 4 bit bus
+  if (!card.hc)
+    ok = ok && command(16, SCSD_SECTOR_SIZE, resp, RESP_R1);
+
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+  card.ready = ok;
+  return ok;
+}
+
+bool scsd_inserted() {
+  return card.ready;
+}
+
+uint32_t scsd_sectors() {
+  return card.sectors;
+}
+
+static bool read_block(uint8_t *dst) {
+  uint32_t start = platform_ticks();
+  while (dat_clock() & DAT0)
+    if (platform_ticks() - start > DATA_TIMEOUT)
+      return false;
+
+  for (unsigned i = 0; i < SCSD_SECTOR_SIZE; i += 2) {
+    dat_clock();
+    uint16_t v = dat_clock();
+    dst[i] = v >> 8;
+    dst[i+1] = v;
+  }
+  uint8_t crc[8], bcrc[8];
+  for (unsigned i = 0; i < sizeof(bcrc); i += 2) {
+    dat_clock();
+    uint16_t v = dat_clock();
+    bcrc[i] = v >> 8;
+    bcrc[i+1] = v;
+  }
+  crc16_lines(dst, SCSD_SECTOR_SIZE, crc);
+  return !memcmp(crc, bcrc, sizeof(crc));
+}
+
+static bool write_block(const uint8_t *src) {
+  uint8_t crc[8];
+  crc16_lines(src, SCSD_SECTOR_SIZE, crc);
+
+  dat_out(0xFFF0);          // Start bit (after some idle clocks)
+  for (unsigned i = 0; i < SCSD_SECTOR_SIZE; i += 2)
+    dat_out((src[i] << 8) | src[i+1]);
+  for (unsigned i = 0; i < sizeof(crc); i += 2)
+    dat_out((crc[i] << 8) | crc[i+1]);
+  dat_out(0xFFFF);          // End bit
+
+  // CRC status token on DAT0: start bit, status (010: accepted) and end bit.
+  uint32_t start = platform_ticks();
+  while (dat_clock() & DAT0)
+    if (platform_ticks() - start > CMD_TIMEOUT)
+      return false;
+  unsigned status = 0;
+  for (unsigned i = 0; i < 3; i++)
+    status = (status << 1) | ((dat_clock() & DAT0) ? 1 : 0);
+  dat_clock();
+  return wait_busy() && status == 2;
+}
+
+// Transfers a run of sectors, returns the number of sectors transferred.
+static unsigned transfer_blocks(uint32_t sector, unsigned count, uint8_t *buf, bool write) {
+  uint8_t resp[RESP_R1];
+  uint32_t addr = card.hc ? sector : sector * SCSD_SECTOR_SIZE;
+  unsigned cmd = write ? (count > 1 ? 25 : 24) : (count > 1 ? 18 : 17);
+  if (!command(cmd, addr, resp, RESP_R1) || (be32(&resp[1]) & R1_ERRORS))
+    return 0;
+
+  unsigned done = 0;
+  while (done < count) {
+    uint8_t *block = &buf[done * SCSD_SECTOR_SIZE];
+    if (!(write ? write_block(block) : read_block(block)))
+      break;
+    done++;
+  }
+
+  // Multi-block transfers go on until stopped.
+  if (count > 1 && (!command(12, 0, resp, RESP_R1) || !wait_busy()))
+    return 0;
+  return done;
+}
+
+static bool transfer(uint32_t sector, unsigned count, uint8_t *buf, bool write) {
+  if (!card.ready || sector + count > card.sectors)
+    return false;
+
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_SDRAM, false, true);
+  unsigned done = 0, failures = 0;
+  while (done < count && failures <= SCSD_RETRIES) {
+    unsigned n = transfer_blocks(sector + done, count - done,
+                                 &buf[done * SCSD_SECTOR_SIZE], write);
+    // Retries are counted per block.
+    if (n < count - done)
+      failures = n ? 1 : failures + 1;
+    done += n;
+  }
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+  return done == count;
+}
+
+bool scsd_read(uint32_t sector, unsigned count, void *buf) {
+  return transfer(sector, count, (uint8_t*)buf, false);
+}
+
+bool scsd_write(uint32_t sector, unsigned count, const void *buf) {
+  return transfer(sector, count, (uint8_t*)buf, true);
+}
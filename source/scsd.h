@@ -0,0 +1,45 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Native driver for the SuperCard SD interface.
+//
+// With the SD interface mode bit set (see set_supercard_mode) the SuperCard
+// maps its own SD slot in the upper ROM space, and the card bus is driven
+// directly, one card clock per register access:
+//  - SCSD_CMD: writes shift bit 7 out on the CMD line, reads sample it (bit 0).
+//  - SCSD_DATA_RD: reads sample the DAT lines (bits 8..11, DAT0 being the
+//    start/busy bit). Once a data block started, every read clocks a byte in
+//    (two 4 bit clocks) and returns the last two bytes received, so blocks are
+//    read as pairs (like the 32 bit accesses of the DLDI driver).
+//  - SCSD_DATA_WR: every write clocks 4 nibbles out (bits 15..12 first).
+//
+// Cards are switched to the 4 bit bus, runs of sectors use multi-block
+// commands and the data CRCs are checked (failed transfers are retried from
+// the first block that failed). The traffic is not traced (see trace.h), it
+// would flush the flash traffic out of the ring. The host tools run it
+// against host/sdsim.c.
+//
+// The DLDI driver might be driving the same card: this is only meant to be
+// used when no other driver is.
+
+#ifndef _SCSD_H_
+#define _SCSD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCSD_DATA_WR_WADDR   (0x01000000 / 2)
+#define SCSD_DATA_RD_WADDR   (0x01100000 / 2)
+#define SCSD_CMD_WADDR       (0x01800000 / 2)
+
+#define SCSD_SECTOR_SIZE     512
+
+// Identifies and initializes the card, returns false if none answers.
+bool scsd_init();
+// Whether a card was initialized.
+bool scsd_inserted();
+// Card size in sectors.
+uint32_t scsd_sectors();
+bool scsd_read(uint32_t sector, unsigned count, void *buf);
+bool scsd_write(uint32_t sector, unsigned count, const void *buf);
+
+#endif
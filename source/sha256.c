@@ -21,6 +21,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "sha256.h"
+
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
   #define read32be(x) __builtin_bswap32(x)
   #define read64be(x) __builtin_bswap64(x)
@@ -90,47 +92,69 @@ void sha256_transform(uint32_t *state, const void *data) {
     state[i] += ls[i];
 }
 
-void sha256_internal(const uint8_t *inbuffer, unsigned length, void *output) {
-  uint32_t *state = (uint32_t*)output;
-  uint64_t bitlen = length << 3;
+void sha256_init(t_sha256_ctx *ctx) {
+  memcpy(ctx->state, sha256_kinit, sizeof(sha256_kinit));
+  ctx->blen = 0;
+  ctx->length = 0;
+}
 
-  // Init state
-  memcpy(state, sha256_kinit, sizeof(sha256_kinit));
+void sha256_update(t_sha256_ctx *ctx, const void *data, unsigned length) {
+  const uint8_t *inbuffer = (const uint8_t*)data;
+  ctx->length += length;
+
+  // Complete any partial block first
+  if (ctx->blen) {
+    unsigned n = 64 - ctx->blen < length ? 64 - ctx->blen : length;
+    memcpy(&ctx->block.chars[ctx->blen], inbuffer, n);
+    ctx->blen += n;
+    inbuffer += n;
+    length -= n;
+    if (ctx->blen < 64)
+      return;
+    sha256_transform(ctx->state, ctx->block.u32);
+    ctx->blen = 0;
+  }
 
   while (length >= 64) {
-    sha256_transform(state, inbuffer);
+    if ((uintptr_t)inbuffer & 3) {
+      // Unaligned input, go through the block buffer.
+      memcpy(ctx->block.chars, inbuffer, 64);
+      sha256_transform(ctx->state, ctx->block.u32);
+    } else
+      sha256_transform(ctx->state, inbuffer);
     inbuffer += 64;
     length -= 64;
   }
 
+  memcpy(ctx->block.chars, inbuffer, length);
+  ctx->blen = length;
+}
+
+void sha256_final(t_sha256_ctx *ctx, void *output) {
+  uint32_t *outw = (uint32_t*)output;
+
   // Last bits
-  union {
-    uint8_t chars[64];
-    uint32_t u32[16];
-    uint64_t u64[8];
-  } tmp = {0};
-  memcpy(tmp.chars, inbuffer, length);
-  tmp.chars[length] = 0x80;
-
-  if (length >= 56) {
+  ctx->block.chars[ctx->blen++] = 0x80;
+  if (ctx->blen > 56) {
     // Need an extra block
-    sha256_transform(state, tmp.u32);
-    memset(tmp.chars, 0, 64);
+    memset(&ctx->block.chars[ctx->blen], 0, 64 - ctx->blen);
+    sha256_transform(ctx->state, ctx->block.u32);
+    ctx->blen = 0;
   }
+  memset(&ctx->block.chars[ctx->blen], 0, 56 - ctx->blen);
 
-  tmp.u64[7] = read64be(bitlen);
-  sha256_transform(state, tmp.u32);
-}
-
-
-// Get the sha1sum for a buffer
-void sha256sum(const uint8_t *inbuffer, unsigned length, void *output) {
-  uint32_t *state = (uint32_t*)output;
-  sha256_internal(inbuffer, length, output);
+  ctx->block.u64[7] = read64be(ctx->length << 3);
+  sha256_transform(ctx->state, ctx->block.u32);
 
   // Output conversion
   for (unsigned i = 0; i < 8; i++)
-    state[i] = read32be(state[i]);
+    outw[i] = read32be(ctx->state[i]);
 }
 
-
+// Get the sha256sum for a buffer
+void sha256sum(const uint8_t *inbuffer, unsigned length, void *output) {
+  t_sha256_ctx ctx;
+  sha256_init(&ctx);
+  sha256_update(&ctx, inbuffer, length);
+  sha256_final(&ctx, output);
+}
@@ -0,0 +1,29 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Minimal SHA256 implementation (one-shot and incremental).
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stdint.h>
+
+typedef struct {
+  uint32_t state[8];
+  union {
+    uint8_t chars[64];
+    uint32_t u32[16];
+    uint64_t u64[8];
+  } block;               // Partial input block
+  unsigned blen;         // Bytes in the partial block
+  uint64_t length;       // Total bytes hashed
+} t_sha256_ctx;
+
+void sha256_init(t_sha256_ctx *ctx);
+void sha256_update(t_sha256_ctx *ctx, const void *data, unsigned length);
+// Writes the 32 byte digest.
+void sha256_final(t_sha256_ctx *ctx, void *output);
+
+// Hashes a whole buffer in one go.
+void sha256sum(const uint8_t *inbuffer, unsigned length, void *output);
+
+#endif
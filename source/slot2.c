@@ -0,0 +1,64 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Slot-2 bus access layer, see slot2.h
+
+#include "cartprof.h"
+#include "slot2.h"
+
+// The host tools drive a simulated cart per thread.
+#ifdef SUPERFW_HOST
+  #define SLOT2_TLS  __thread
+#else
+  #define SLOT2_TLS
+#endif
+
+static SLOT2_TLS unsigned acquire_depth = 0;
+static SLOT2_TLS uint16_t saved_timing;
+
+bool slot2_acquire() {
+  if (!acquire_depth++)
+    saved_timing = slot2_raw_get_timing();
+  return slot2_raw_acquire();
+}
+
+void slot2_release(bool pmode) {
+  if (acquire_depth && !--acquire_depth && slot2_raw_get_timing() != saved_timing)
+    slot2_set_timing(saved_timing);
+  slot2_raw_release(pmode);
+}
+
+void set_supercard_mode(unsigned mapped_area, bool write_access, bool sdcard_interface) {
+  // Bit0: Controls SDRAM vs internal Flash mapping
+  // Bit1: Controls whether the SD card interface is mapped into the ROM addresspace.
+  // Bit2: Controls read-only/write access.
+  uint16_t value = mapped_area | (sdcard_interface ? 0x2 : 0x0) | (write_access ? 0x4 : 0x0);
+  const t_cart_profile *prof = cart_profile();
+
+  if (trace_enabled)
+    trace_event(TRACE_MODE, prof->mode_waddr, value);
+
+  // Write magic value and then the mode value (twice) to trigger the mode change.
+  slot2_raw_write16(prof->mode_waddr, prof->mode_magic);
+  slot2_raw_write16(prof->mode_waddr, prof->mode_magic);
+  slot2_raw_write16(prof->mode_waddr, value);
+  slot2_raw_write16(prof->mode_waddr, value);
+}
+
+unsigned slot2_sram_test() {
+  bool pmode = slot2_acquire();
+
+  // Just write the SRAM with some well-known data, and read it back
+  slot2_slow_timing();   // Use the slowest possible access time.
+  uint32_t size = cart_profile()->sram_size;
+  for (unsigned i = 0; i < size; i++)
+    slot2_sram_write8(i, 0x00);
+  for (unsigned i = 0; i < size; i++)
+    slot2_sram_write8(i, i ^ (i * i) ^ 0x5A);
+  unsigned numerrs = 0;
+  for (unsigned i = 0; i < size; i++)
+    if (slot2_sram_read8(i) != ((i ^ (i * i) ^ 0x5A) & 0xFF))
+      numerrs++;
+
+  slot2_release(pmode);
+  return numerrs;
+}
@@ -0,0 +1,155 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Slot-2 bus access layer.
+//
+// Every access to the SuperCard (mode switches, flash commands, status polls,
+// bulk reads) goes through these functions. This allows tracing the bus
+// traffic (see trace.h) and running the flash code against the host
+// simulator, which provides the slot2_raw_* primitives when building with
+// SUPERFW_HOST.
+
+#ifndef _SLOT2_H_
+#define _SLOT2_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define MAPPED_FIRMWARE      0
+#define MAPPED_SDRAM         1
+
+// SuperCard memory windows and mode register, the cart profiles (see
+// cartprof.h) describe the variants.
+#define SLOT2_ROM_SIZE       (32*1024*1024)
+#define SLOT2_SRAM_SIZE      (64*1024)
+// Mode register lives at 0x09FFFFFE (word address in the ROM space)
+#define SLOT2_MODE_WADDR     (0x01FFFFFE / 2)
+
+#ifdef SUPERFW_HOST
+
+bool slot2_raw_acquire();
+void slot2_raw_release(bool pmode);
+uint16_t slot2_raw_get_timing();
+void slot2_raw_set_timing(uint16_t bits);
+uint16_t slot2_raw_read16(uint32_t waddr);
+void slot2_raw_write16(uint32_t waddr, uint16_t value);
+void slot2_raw_read(void *dst, uint32_t offset, unsigned bytes);
+void slot2_raw_write(uint32_t offset, const void *src, unsigned bytes);
+uint8_t slot2_raw_sram_read8(uint32_t addr);
+void slot2_raw_sram_write8(uint32_t addr, uint8_t value);
+
+#else
+
+#include <nds.h>
+
+#define SLOT2_BASE_U16 ((volatile uint16_t*)(0x08000000))
+#define SLOT2_SRAM_U8  ((volatile uint8_t*)( 0x0A000000))
+
+static inline bool slot2_raw_acquire() {
+  bool pmode = sysGetCartOwner();
+  sysSetCartOwner(BUS_OWNER_ARM9);
+  return pmode;
+}
+
+static inline void slot2_raw_release(bool pmode) {
+  sysSetCartOwner(pmode);
+}
+
+// Slot-2 timing bits of EXMEMCNT (SRAM, ROM first/second access and PHI).
+static inline uint16_t slot2_raw_get_timing() {
+  return REG_EXMEMCNT & 0x7F;
+}
+
+static inline void slot2_raw_set_timing(uint16_t bits) {
+  REG_EXMEMCNT = (REG_EXMEMCNT & ~0x7F) | (bits & 0x7F);
+}
+
+static inline uint16_t slot2_raw_read16(uint32_t waddr) {
+  return SLOT2_BASE_U16[waddr];
+}
+
+static inline void slot2_raw_write16(uint32_t waddr, uint16_t value) {
+  SLOT2_BASE_U16[waddr] = value;
+}
+
+static inline void slot2_raw_read(void *dst, uint32_t offset, unsigned bytes) {
+  memcpy(dst, (void*)(0x08000000 + offset), bytes);
+}
+
+// The ROM space does not take byte writes, data is written as halfwords.
+static inline void slot2_raw_write(uint32_t offset, const void *src, unsigned bytes) {
+  const uint8_t *s = (const uint8_t*)src;
+  for (unsigned i = 0; i < bytes / 2; i++)
+    SLOT2_BASE_U16[offset / 2 + i] = s[i*2] | (s[i*2+1] << 8);
+}
+
+static inline uint8_t slot2_raw_sram_read8(uint32_t addr) {
+  return SLOT2_SRAM_U8[addr];
+}
+
+static inline void slot2_raw_sram_write8(uint32_t addr, uint8_t value) {
+  SLOT2_SRAM_U8[addr] = value;
+}
+
+#endif
+
+// Traced accessors, to be used by the flash/dump code.
+
+static inline uint16_t slot2_read16(uint32_t waddr) {
+  uint16_t value = slot2_raw_read16(waddr);
+  if (trace_enabled)
+    trace_event(TRACE_READ, waddr, value);
+  return value;
+}
+
+static inline void slot2_write16(uint32_t waddr, uint16_t value) {
+  if (trace_enabled)
+    trace_event(TRACE_WRITE, waddr, value);
+  slot2_raw_write16(waddr, value);
+}
+
+static inline void slot2_read_block(void *dst, uint32_t offset, unsigned bytes) {
+  if (trace_enabled)
+    trace_block(TRACE_BLOCK_READ, offset / 2, bytes / 2);
+  slot2_raw_read(dst, offset, bytes);
+}
+
+static inline void slot2_write_block(uint32_t offset, const void *src, unsigned bytes) {
+  if (trace_enabled)
+    trace_block(TRACE_BLOCK_WRITE, offset / 2, bytes / 2);
+  slot2_raw_write(offset, src, bytes);
+}
+
+static inline void slot2_set_timing(uint16_t bits) {
+  if (trace_enabled)
+    trace_event(TRACE_TIMING, 0, bits);
+  slot2_raw_set_timing(bits);
+}
+
+static inline void slot2_slow_timing() {
+  slot2_set_timing(slot2_raw_get_timing() | 0xF);   // use slow mode
+}
+
+static inline uint8_t slot2_sram_read8(uint32_t addr) {
+  return slot2_raw_sram_read8(addr);
+}
+
+static inline void slot2_sram_write8(uint32_t addr, uint8_t value) {
+  slot2_raw_sram_write8(addr, value);
+}
+
+// Takes ownership of the slot-2 bus, returns the previous owner. The bus
+// timing is saved by the outermost acquire and restored by its release, so
+// operations (also cancelled ones) leave EXMEMCNT as they found it.
+bool slot2_acquire();
+void slot2_release(bool pmode);
+
+void set_supercard_mode(unsigned mapped_area, bool write_access, bool sdcard_interface);
+
+// Writes and reads back a pattern to the whole SRAM, returns the number of
+// mismatching bytes.
+unsigned slot2_sram_test();
+
+#endif
@@ -0,0 +1,81 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Cart SDRAM staging area, see stage.h
+
+#include "cartprof.h"
+#include "slot2.h"
+#include "stage.h"
+
+#define ALIGN_UP(x)   (((x) + STAGE_ALIGN - 1) & ~(STAGE_ALIGN - 1))
+
+// The host tools drive a simulated cart per thread.
+#ifdef SUPERFW_HOST
+  #define STAGE_TLS  __thread
+#else
+  #define STAGE_TLS
+#endif
+
+static STAGE_TLS uint32_t stage_top = 0;     // Used bytes (from the area base)
+
+// The area depends on the cart profile (SDRAM window size).
+static uint32_t stage_base() {
+  return cart_profile()->sdram_size / 2;
+}
+
+static uint32_t stage_size() {
+  return cart_profile()->sdram_size - stage_base();
+}
+
+uint32_t stage_avail() {
+  return stage_top < stage_size() ? stage_size() - stage_top : 0;
+}
+
+t_stage stage_alloc(uint32_t size) {
+  if (!size || size > stage_avail())
+    return STAGE_NONE;
+
+  t_stage ret = stage_base() + stage_top;
+  stage_top = ALIGN_UP(stage_top + size);
+  if (stage_top > stage_size())
+    stage_top = stage_size();
+  return ret;
+}
+
+unsigned stage_mark() {
+  return stage_top;
+}
+
+void stage_release(unsigned mark) {
+  if (mark < stage_top)
+    stage_top = mark;
+}
+
+static bool stage_check(t_stage st, uint32_t offset, unsigned size) {
+  uint32_t start = st + offset;
+  return st != STAGE_NONE && !(start & 1) && !(size & 1) &&
+         start >= stage_base() && start + size <= stage_base() + stage_top;
+}
+
+bool stage_write(t_stage st, uint32_t offset, const void *src, unsigned size) {
+  if (!stage_check(st, offset, size))
+    return false;
+
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_SDRAM, true, false);
+  slot2_write_block(st + offset, src, size);
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+  return true;
+}
+
+bool stage_read(t_stage st, uint32_t offset, void *dst, unsigned size) {
+  if (!stage_check(st, offset, size))
+    return false;
+
+  bool pmode = slot2_acquire();
+  set_supercard_mode(MAPPED_SDRAM, false, false);
+  slot2_read_block(dst, st + offset, size);
+  set_supercard_mode(MAPPED_FIRMWARE, false, false);
+  slot2_release(pmode);
+  return true;
+}
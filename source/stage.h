@@ -0,0 +1,39 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Cart SDRAM staging area.
+//
+// The SuperCard SDRAM (the ROM space) is much larger than the DS main RAM.
+// The upper half of it is handed out by a bump allocator (same usage as the
+// scratch allocator in arena.h) to keep data that does not need to live in
+// main RAM, ie. a copy of the flash contents taken before updating it.
+// Staged data is only reachable through stage_read/stage_write, which map the
+// SDRAM (writable) for the transfer and switch back to the firmware mapping,
+// so callers never deal with the cart mode.
+//
+// Staging overwrites whatever the SDRAM held (ie. a loaded ROM), which ROM
+// dumps and cart archives include.
+
+#ifndef _STAGE_H_
+#define _STAGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STAGE_ALIGN      512         // Keeps transfers sector sized
+#define STAGE_NONE       0
+
+// Staged ranges are SDRAM byte offsets (never zero).
+typedef uint32_t t_stage;
+
+// Bytes still available for staging.
+uint32_t stage_avail();
+// Returns STAGE_NONE if there is not enough space left.
+t_stage stage_alloc(uint32_t size);
+unsigned stage_mark();
+void stage_release(unsigned mark);
+
+// Copies data to/from a staged range (offset and size must be even).
+bool stage_write(t_stage st, uint32_t offset, const void *src, unsigned size);
+bool stage_read(t_stage st, uint32_t offset, void *dst, unsigned size);
+
+#endif
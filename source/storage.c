@@ -0,0 +1,147 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// File storage primitives on top of libfat, see storage.h
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fat.h>
+#include <nds/disc_io.h>
+
+#include "scsd.h"
+#include "storage.h"
+
+// The SuperCard SD slot, through the native driver (see scsd.h).
+static bool scsd_startup() {
+  return scsd_init();
+}
+
+static bool scsd_read_sectors(sec_t sector, sec_t count, void *buf) {
+  return scsd_read(sector, count, buf);
+}
+
+static bool scsd_write_sectors(sec_t sector, sec_t count, const void *buf) {
+  return scsd_write(sector, count, buf);
+}
+
+static bool scsd_nop() {
+  return true;
+}
+
+static const DISC_INTERFACE scsd_disc = {
+  .ioType = 0x44534353,    // "SCSD"
+  .features = FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE | FEATURE_SLOT_GBA,
+  .startup = scsd_startup,
+  .isInserted = scsd_inserted,
+  .readSectors = scsd_read_sectors,
+  .writeSectors = scsd_write_sectors,
+  .clearStatus = scsd_nop,
+  .shutdown = scsd_nop,
+};
+
+static unsigned target = STORAGE_DLDI;
+static bool attempted = false, mounted = false;
+
+bool storage_select(unsigned t) {
+  if (mounted)
+    return t == target;
+  target = t;
+  attempted = false;    // A failed mount can be retried on the other card
+  return true;
+}
+
+unsigned storage_target() {
+  return target;
+}
+
+bool storage_mount() {
+  if (!attempted) {
+    attempted = true;
+    if (target == STORAGE_SLOT2)
+      mounted = fatMount("fat", &scsd_disc, 0, 8, 8);
+    else
+      mounted = fatInitDefault();
+  }
+  return mounted;
+}
+
+bool storage_is_slot2() {
+  return target == STORAGE_SLOT2;
+}
+
+t_sfile *storage_open(const char *path, const char *mode) {
+  if (!storage_mount())
+    return NULL;
+  return (t_sfile*)fopen(path, mode);
+}
+
+unsigned storage_read(t_sfile *fd, void *buf, unsigned size) {
+  return fread(buf, 1, size, (FILE*)fd);
+}
+
+unsigned storage_write(t_sfile *fd, const void *buf, unsigned size) {
+  return fwrite(buf, 1, size, (FILE*)fd);
+}
+
+bool storage_seek(t_sfile *fd, uint32_t offset) {
+  return !fseek((FILE*)fd, offset, SEEK_SET);
+}
+
+long storage_size(t_sfile *fd) {
+  FILE *f = (FILE*)fd;
+  long cur = ftell(f);
+  if (fseek(f, 0, SEEK_END))
+    return -1;
+  long ret = ftell(f);
+  fseek(f, cur, SEEK_SET);
+  return ret;
+}
+
+bool storage_flush(t_sfile *fd) {
+  FILE *f = (FILE*)fd;
+  return !fflush(f) && !fsync(fileno(f));
+}
+
+bool storage_close(t_sfile *fd) {
+  return !fclose((FILE*)fd);
+}
+
+t_sdir *storage_opendir(const char *path) {
+  if (!storage_mount())
+    return NULL;
+  return (t_sdir*)opendir(path);
+}
+
+bool storage_readdir(t_sdir *dir, char *name, unsigned maxlen, bool *isdir) {
+  struct dirent *cur = readdir((DIR*)dir);
+  if (!cur || !cur->d_name[0])
+    return false;
+
+  strncpy(name, cur->d_name, maxlen - 1);
+  name[maxlen - 1] = 0;
+  *isdir = cur->d_type == DT_DIR;
+  return true;
+}
+
+void storage_closedir(t_sdir *dir) {
+  closedir((DIR*)dir);
+}
+
+bool storage_stat(const char *path, uint32_t *size, uint32_t *mtime) {
+  struct stat st;
+  if (!storage_mount() || stat(path, &st))
+    return false;
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+  return true;
+}
+
+bool storage_rename(const char *from, const char *to) {
+  return storage_mount() && !rename(from, to);
+}
+
+bool storage_remove(const char *path) {
+  return storage_mount() && !unlink(path);
+}
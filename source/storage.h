@@ -0,0 +1,60 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// File storage primitives. On the NDS these go to libfat (DLDI), when
+// building the host tools (SUPERFW_HOST) they are provided by the storage
+// simulator, which maps "fat:/" to a host directory.
+
+#ifndef _STORAGE_H_
+#define _STORAGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct t_storage_file t_sfile;
+typedef struct t_storage_dir t_sdir;
+
+// Storage targets
+#define STORAGE_DLDI       0     // The card behind the DLDI driver (default)
+#define STORAGE_SLOT2      1     // The SuperCard's own SD slot (see scsd.h)
+
+// Selects the card to mount. It is an explicit user choice (there is no
+// fallback from one to the other), and it can only change while the
+// filesystem is not mounted: returns false afterwards.
+bool storage_select(unsigned target);
+unsigned storage_target();
+// Mounts the filesystem. This happens on first use (storage_open calls it),
+// so that startup and the cart-only operations do not wait for the card.
+// Only the first call attempts the mount, its result is cached (until the
+// target changes).
+bool storage_mount();
+// Whether the selected card is the one in the SuperCard SD slot: the cart
+// cannot be removed (or swapped) while the filesystem is in use then.
+bool storage_is_slot2();
+
+// Opens a file, mode as in fopen ("rb", "wb" or "ab").
+t_sfile *storage_open(const char *path, const char *mode);
+// Returns the number of bytes actually read/written.
+unsigned storage_read(t_sfile *fd, void *buf, unsigned size);
+unsigned storage_write(t_sfile *fd, const void *buf, unsigned size);
+// Moves to an absolute position, returns false on error.
+bool storage_seek(t_sfile *fd, uint32_t offset);
+// Returns the file size (or -1 on error).
+long storage_size(t_sfile *fd);
+// Writes any buffered data to the card (and updates the directory entry, so
+// that other handles see it). Returns false on error.
+bool storage_flush(t_sfile *fd);
+// Returns false if any buffered data could not be written.
+bool storage_close(t_sfile *fd);
+
+// Directory listing. readdir returns false at the end of the directory.
+t_sdir *storage_opendir(const char *path);
+bool storage_readdir(t_sdir *dir, char *name, unsigned maxlen, bool *isdir);
+void storage_closedir(t_sdir *dir);
+// File size and modification time, returns false if it does not exist.
+bool storage_stat(const char *path, uint32_t *size, uint32_t *mtime);
+// Renames (the destination must not exist) or deletes a file, return false
+// on error.
+bool storage_rename(const char *from, const char *to);
+bool storage_remove(const char *path);
+
+#endif
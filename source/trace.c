@@ -0,0 +1,96 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Slot-2 bus transaction tracer, see trace.h
+
+#include <stdio.h>
+
+#include "platform.h"
+#include "storage.h"
+#include "trace.h"
+
+bool trace_enabled = false;
+
+const char * const trace_op_names[TRACE_OP_COUNT] = {
+  "end", "ident", "erase", "erase-check", "write", "validate", "dump",
+};
+
+static t_trace_entry trace_ring[TRACE_ENTRIES];
+static unsigned trace_head = 0;       // Next entry to write
+static unsigned trace_count = 0;      // Valid entries in the ring
+static uint32_t trace_dropped = 0;
+
+void trace_start() {
+  trace_head = trace_count = 0;
+  trace_dropped = 0;
+  trace_enabled = true;
+}
+
+void trace_stop() {
+  trace_enabled = false;
+}
+
+static void trace_push(uint32_t ts, unsigned type, uint32_t waddr, uint16_t value, uint16_t repeat) {
+  t_trace_entry *e = &trace_ring[trace_head];
+  e->ts = ts;
+  e->addr = (type << 24) | (waddr & 0xFFFFFF);
+  e->value = value;
+  e->repeat = repeat;
+
+  trace_head = (trace_head + 1) % TRACE_ENTRIES;
+  if (trace_count < TRACE_ENTRIES)
+    trace_count++;
+  else
+    trace_dropped++;
+}
+
+void trace_event(unsigned type, uint32_t waddr, uint16_t value) {
+  uint32_t ts = platform_ticks();
+
+  // Merge consecutive reads to the same address (status polling).
+  if (type == TRACE_READ && trace_count) {
+    t_trace_entry *last = &trace_ring[(trace_head + TRACE_ENTRIES - 1) % TRACE_ENTRIES];
+    if (last->addr == ((TRACE_READ << 24) | (waddr & 0xFFFFFF)) && last->repeat != 0xFFFF) {
+      last->repeat++;
+      last->value = value;
+      return;
+    }
+  }
+
+  trace_push(ts, type, waddr, value, 0);
+}
+
+void trace_block(unsigned type, uint32_t waddr, uint32_t count) {
+  trace_push(platform_ticks(), type, waddr, count & 0xFFFF, count >> 16);
+}
+
+void trace_mark(unsigned op) {
+  if (trace_enabled)
+    trace_push(platform_ticks(), TRACE_MARK, 0, op, 0);
+}
+
+bool trace_save(const char *filename) {
+  t_sfile *fd = storage_open(filename, "wb");
+  if (!fd)
+    return false;
+
+  t_trace_header hdr = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .tick_rate = PLATFORM_TICKS_PER_SEC,
+    .count = trace_count,
+    .dropped = trace_dropped,
+  };
+  bool ok = storage_write(fd, &hdr, sizeof(hdr)) == sizeof(hdr);
+
+  // Write the oldest entries first (the ring might have wrapped around).
+  unsigned first = (trace_head + TRACE_ENTRIES - trace_count) % TRACE_ENTRIES;
+  unsigned tail = TRACE_ENTRIES - first;
+  if (tail > trace_count)
+    tail = trace_count;
+  unsigned tbytes = tail * sizeof(t_trace_entry);
+  unsigned hbytes = (trace_count - tail) * sizeof(t_trace_entry);
+  ok = ok && storage_write(fd, &trace_ring[first], tbytes) == tbytes;
+  ok = ok && storage_write(fd, &trace_ring[0], hbytes) == hbytes;
+
+  return storage_close(fd) && ok;
+}
@@ -0,0 +1,70 @@
+// Copyright 2024 David Guillen Fandos <david@davidgf.net>
+
+// Slot-2 bus transaction tracer.
+//
+// When enabled, every bus event issued through slot2.h is recorded in a ring
+// buffer (keeping the most recent TRACE_ENTRIES events). Consecutive reads of
+// the same address (ie. status polling) are merged into a single entry with a
+// repeat count, keeping the last value read. The ring can be saved to a file
+// and replayed on the host against the flash simulator (host/tracereplay).
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_ENTRIES      8192
+
+#define TRACE_MAGIC        0x52544653   // "SFTR"
+#define TRACE_VERSION      1
+
+// Event types
+#define TRACE_MODE         1    // Mode register write, value = mode
+#define TRACE_WRITE        2    // 16 bit write
+#define TRACE_READ         3    // 16 bit read
+#define TRACE_BLOCK_READ   4    // Bulk read, value | (repeat << 16) = word count
+#define TRACE_TIMING       5    // Bus timing change, value = EXMEMCNT bits
+#define TRACE_MARK         6    // Operation marker, value = TRACE_OP_*
+#define TRACE_BLOCK_WRITE  7    // Bulk write (SDRAM), same count as TRACE_BLOCK_READ
+
+// Operation markers (value of TRACE_MARK events)
+#define TRACE_OP_END       0
+#define TRACE_OP_IDENT     1
+#define TRACE_OP_ERASE     2
+#define TRACE_OP_ERASECHK  3
+#define TRACE_OP_WRITE     4
+#define TRACE_OP_VALIDATE  5
+#define TRACE_OP_DUMP      6
+#define TRACE_OP_COUNT     7
+
+typedef struct {
+  uint32_t ts;        // Timestamp (platform ticks) of the first occurrence
+  uint32_t addr;      // Bits 0..23: word address, bits 24..31: event type
+  uint16_t value;     // Value written/read
+  uint16_t repeat;    // Number of extra (merged) identical reads
+} t_trace_entry;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t tick_rate;   // Ticks per second
+  uint32_t count;       // Number of entries following the header
+  uint32_t dropped;     // Number of (older) entries lost due to wraparound
+} t_trace_header;
+
+#define TRACE_TYPE(e)     ((e)->addr >> 24)
+#define TRACE_ADDR(e)     ((e)->addr & 0xFFFFFF)
+
+extern bool trace_enabled;
+extern const char * const trace_op_names[TRACE_OP_COUNT];
+
+void trace_start();
+void trace_stop();
+void trace_event(unsigned type, uint32_t waddr, uint16_t value);
+void trace_block(unsigned type, uint32_t waddr, uint32_t count);
+void trace_mark(unsigned op);
+// Writes the ring contents (oldest first) to a file.
+bool trace_save(const char *filename);
+
+#endif